@@ -2,6 +2,7 @@
 
 #include "gl_compile_program.hpp"
 #include "gl_errors.hpp"
+#include "Mesh.hpp"
 
 Scene::Drawable::Pipeline lit_color_texture_program_pipeline;
 
@@ -11,12 +12,15 @@ Load< LitColorTextureProgram > lit_color_texture_program(LoadTagEarly, []() -> L
 	//----- build the pipeline template -----
 	lit_color_texture_program_pipeline.program = ret->program;
 
-	lit_color_texture_program_pipeline.OBJECT_TO_CLIP_mat4 = ret->OBJECT_TO_CLIP_mat4;
-	lit_color_texture_program_pipeline.OBJECT_TO_LIGHT_mat4x3 = ret->OBJECT_TO_LIGHT_mat4x3;
-	lit_color_texture_program_pipeline.NORMAL_TO_LIGHT_mat3 = ret->NORMAL_TO_LIGHT_mat3;
-
-	lit_color_texture_program_pipeline.CLIP_PLANE_vec4 = ret->CLIP_PLANE_vec4;
+	//transforms and the view clip plane come from the scene's shared buffers:
+	lit_color_texture_program_pipeline.OBJECT_INDEX_int = ret->OBJECT_INDEX_int;
 	lit_color_texture_program_pipeline.SELF_CLIP_PLANE_vec4 = ret->SELF_CLIP_PLANE_vec4;
+	lit_color_texture_program_pipeline.PORTAL_VIEWPORT_vec4 = ret->PORTAL_VIEWPORT_vec4;
+
+	//decoding for quantized meshes (the mesh's values are copied into each drawable's pipeline):
+	lit_color_texture_program_pipeline.POSITION_OFFSET_vec3 = ret->POSITION_OFFSET_vec3;
+	lit_color_texture_program_pipeline.POSITION_SCALE_vec3 = ret->POSITION_SCALE_vec3;
+	lit_color_texture_program_pipeline.OCTAHEDRAL_NORMALS_bool = ret->OCTAHEDRAL_NORMALS_bool;
 
 	/* This will be used later if/when we build a light loop into the Scene:
 	lit_color_texture_program_pipeline.LIGHT_TYPE_int = ret->LIGHT_TYPE_int;
@@ -50,14 +54,15 @@ LitColorTextureProgram::LitColorTextureProgram() {
 	//Compile vertex and fragment shaders using the convenient 'gl_compile_program' helper function:
 	program = gl_compile_program(
 		//vertex shader:
-		"#version 330\n"
-		"uniform mat4 OBJECT_TO_CLIP;\n"
-		"uniform mat4x3 OBJECT_TO_LIGHT;\n"
-		"uniform mat3 NORMAL_TO_LIGHT;\n"
-		"uniform vec4 CLIP_PLANE;\n"
+		std::string("#version 330\n") + MeshBuffer::VertexDecodeGLSL + //(declares Position and Normal)
+		"layout(std140) uniform View {\n"
+		"	mat4 WORLD_TO_CLIP;\n"
+		"	vec4 CLIP_PLANE;\n"
+		"};\n"
+		"uniform samplerBuffer OBJECTS;\n" //see Scene::ObjectDataTexels for layout
+		"uniform isamplerBuffer INSTANCES;\n"
+		"uniform int OBJECT_INDEX;\n" //negative for instanced draws (see Scene::InstanceDataUnit)
 		"uniform vec4 SELF_CLIP_PLANE;\n"
-		"in vec4 Position;\n"
-		"in vec3 Normal;\n"
 		"in vec4 Color;\n"
 		"in vec2 TexCoord;\n"
 		"out vec3 position;\n"
@@ -66,14 +71,18 @@ LitColorTextureProgram::LitColorTextureProgram() {
 		"out vec2 texCoord;\n"
 		"out mat4 PROJECTION_MATRIX;\n"
 		"void main() {\n"
-		"	gl_Position = OBJECT_TO_CLIP * Position;\n"
-		"	position = OBJECT_TO_LIGHT * Position;\n"
+		"	int object = OBJECT_INDEX >= 0 ? OBJECT_INDEX : texelFetch(INSTANCES, -1 - OBJECT_INDEX + gl_InstanceID).r;\n"
+		"	int base = object * 6;\n"
+		"	mat4x3 OBJECT_TO_LIGHT = transpose(mat3x4(texelFetch(OBJECTS, base), texelFetch(OBJECTS, base+1), texelFetch(OBJECTS, base+2)));\n"
+		"	mat3 NORMAL_TO_LIGHT = mat3(texelFetch(OBJECTS, base+3).xyz, texelFetch(OBJECTS, base+4).xyz, texelFetch(OBJECTS, base+5).xyz);\n"
+		"	position = OBJECT_TO_LIGHT * mesh_position();\n"
+		"	gl_Position = WORLD_TO_CLIP * vec4(position, 1.0);\n"
 		"   gl_ClipDistance[0] = dot(vec4(position,1), CLIP_PLANE);\n"
 		"   gl_ClipDistance[1] = dot(vec4(position,1), SELF_CLIP_PLANE);"
-		"	normal = NORMAL_TO_LIGHT * Normal;\n"
+		"	normal = NORMAL_TO_LIGHT * mesh_normal();\n"
 		"	color = Color;\n"
 		"	texCoord = TexCoord;\n"
-		"	PROJECTION_MATRIX = OBJECT_TO_CLIP;\n"
+		"	PROJECTION_MATRIX = WORLD_TO_CLIP * mat4(OBJECT_TO_LIGHT);\n"
 		"}\n"
 	,
 		//fragment shader:
@@ -84,6 +93,7 @@ LitColorTextureProgram::LitColorTextureProgram() {
 		"uniform vec3 LIGHT_DIRECTION;\n"
 		"uniform vec3 LIGHT_ENERGY;\n"
 		"uniform float LIGHT_CUTOFF;\n"
+		"uniform vec4 PORTAL_VIEWPORT;\n"
 		"in vec3 position;\n"
 		"in vec3 normal;\n"
 		"in vec4 color;\n"
@@ -123,7 +133,11 @@ LitColorTextureProgram::LitColorTextureProgram() {
 		"		e = max(0.75, dot(n,-LIGHT_DIRECTION)) * LIGHT_ENERGY;\n"
 		"	}\n"
 		"	vec4 albedo = texture(TEX, texCoord) * color;\n"
-		"	fragColor = vec4(e*albedo.rgb, albedo.a);\n"
+		"	if (PORTAL_VIEWPORT.z > 0.0) { //portal showing its offscreen view: screen-space lookup, unlit \n"
+		"		fragColor = vec4(texture(TEX, (gl_FragCoord.xy - PORTAL_VIEWPORT.xy) / PORTAL_VIEWPORT.zw).rgb, 1.0);\n"
+		"	} else {\n"
+		"		fragColor = vec4(e*albedo.rgb, albedo.a);\n"
+		"	}\n"
 		"	//fragColor = color;\n"
 		"	outNormal = n;\n"
 		"	outDepth = LinearizeDepth(gl_FragCoord.z);\n"
@@ -140,12 +154,15 @@ LitColorTextureProgram::LitColorTextureProgram() {
 	TexCoord_vec2 = glGetAttribLocation(program, "TexCoord");
 
 	//look up the locations of uniforms:
-	OBJECT_TO_CLIP_mat4 = glGetUniformLocation(program, "OBJECT_TO_CLIP");
-	OBJECT_TO_LIGHT_mat4x3 = glGetUniformLocation(program, "OBJECT_TO_LIGHT");
-	NORMAL_TO_LIGHT_mat3 = glGetUniformLocation(program, "NORMAL_TO_LIGHT");
-
-	CLIP_PLANE_vec4 = glGetUniformLocation(program, "CLIP_PLANE");
+	OBJECT_INDEX_int = glGetUniformLocation(program, "OBJECT_INDEX");
 	SELF_CLIP_PLANE_vec4 = glGetUniformLocation(program, "SELF_CLIP_PLANE");
+	PORTAL_VIEWPORT_vec4 = glGetUniformLocation(program, "PORTAL_VIEWPORT");
+	POSITION_OFFSET_vec3 = glGetUniformLocation(program, "POSITION_OFFSET");
+	POSITION_SCALE_vec3 = glGetUniformLocation(program, "POSITION_SCALE");
+	OCTAHEDRAL_NORMALS_bool = glGetUniformLocation(program, "OCTAHEDRAL_NORMALS");
+
+	//per-view data comes from the scene's View block:
+	glUniformBlockBinding(program, glGetUniformBlockIndex(program, "View"), Scene::ViewBlockBinding);
 
 	LIGHT_TYPE_int = glGetUniformLocation(program, "LIGHT_TYPE");
 	LIGHT_LOCATION_vec3 = glGetUniformLocation(program, "LIGHT_LOCATION");
@@ -155,11 +172,15 @@ LitColorTextureProgram::LitColorTextureProgram() {
 
 
 	GLuint TEX_sampler2D = glGetUniformLocation(program, "TEX");
+	GLuint OBJECTS_samplerBuffer = glGetUniformLocation(program, "OBJECTS");
+	GLuint INSTANCES_isamplerBuffer = glGetUniformLocation(program, "INSTANCES");
 
 	//set TEX to always refer to texture binding zero:
 	glUseProgram(program); //bind program -- glUniform* calls refer to this program now
 
 	glUniform1i(TEX_sampler2D, 0); //set TEX to sample from GL_TEXTURE0
+	glUniform1i(OBJECTS_samplerBuffer, Scene::ObjectDataUnit); //per-object data lives on the unit after the pipeline's textures
+	glUniform1i(INSTANCES_isamplerBuffer, Scene::InstanceDataUnit); //...and instanced draws' object lists on the one after that
 
 	glUseProgram(0); //unbind program -- glUniform* calls refer to ??? now
 }
@@ -18,12 +18,14 @@ struct LitColorTextureProgram {
 	GLuint TexCoord_vec2 = -1U;
 
 	//Uniform (per-invocation variable) locations:
-	GLuint OBJECT_TO_CLIP_mat4 = -1U;
-	GLuint OBJECT_TO_LIGHT_mat4x3 = -1U;
-	GLuint NORMAL_TO_LIGHT_mat3 = -1U;
-
-	GLuint CLIP_PLANE_vec4 = -1U;
+	// (transforms and CLIP_PLANE are read from the scene's View block and per-object buffer; see Scene::ViewBlockBinding)
+	GLuint OBJECT_INDEX_int = -1U;
 	GLuint SELF_CLIP_PLANE_vec4 = -1U;
+	GLuint PORTAL_VIEWPORT_vec4 = -1U; //for portal meshes showing an offscreen view (see Scene::PortalMode::Texture)
+	//vertex decoding for quantized meshes (see MeshBuffer::VertexDecodeGLSL):
+	GLuint POSITION_OFFSET_vec3 = -1U;
+	GLuint POSITION_SCALE_vec3 = -1U;
+	GLuint OCTAHEDRAL_NORMALS_bool = -1U;
 
 	//lighting:
 	GLuint LIGHT_TYPE_int = -1U;
@@ -34,6 +36,8 @@ struct LitColorTextureProgram {
 	
 	//Textures:
 	//TEXTURE0 - texture that is accessed by TexCoord
+	//TEXTURE0 + Scene::ObjectDataUnit - per-object data buffer (bound by Scene::draw)
+	//TEXTURE0 + Scene::InstanceDataUnit - per-instance object indices (bound by Scene::draw)
 };
 
 extern Load< LitColorTextureProgram > lit_color_texture_program;
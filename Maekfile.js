@@ -128,8 +128,14 @@ if (maek.OS === 'windows') {
 // cppFile: name of c++ file to compile
 // objFileBase (optional): base name object file to produce (if not supplied, set to options.objDir + '/' + cppFile without the extension)
 //returns objFile: objFileBase + a platform-dependant suffix ('.o' or '.obj')
+const walkmesh_obj = maek.CPP('WalkMesh.cpp'); //(also used by walkmesh-bench, below)
+const mapped_chunk_obj = maek.CPP('mapped_chunk.cpp'); //(likewise)
+const navigation_obj = maek.CPP('Navigation.cpp'); //(also used by navigation-bench, below)
+
 const game_names = [
-	maek.CPP('WalkMesh.cpp'),
+	walkmesh_obj,
+	navigation_obj,
+	maek.CPP('NavigationPortals.cpp'),
 	maek.CPP('PlayMode.cpp'),
 	maek.CPP('main.cpp'),
 	maek.CPP('LitColorTextureProgram.cpp'),
@@ -152,7 +158,8 @@ const common_names = [
 	maek.CPP('gl_compile_program.cpp'),
 	maek.CPP('Mode.cpp'),
 	maek.CPP('GL.cpp'),
-	maek.CPP('Load.cpp')
+	maek.CPP('Load.cpp'),
+	mapped_chunk_obj
 ];
 
 const show_meshes_names = [
@@ -174,9 +181,17 @@ const show_scene_names = [
 const game_exe = maek.LINK([...game_names, ...common_names], 'dist/game');
 const show_meshes_exe = maek.LINK([...show_meshes_names, ...common_names], 'scenes/show-meshes');
 const show_scene_exe = maek.LINK([...show_scene_names, ...common_names], 'scenes/show-scene');
+//times WalkMesh queries against the linear scans they replaced (run it by hand; it isn't part of the game):
+const walkmesh_bench_exe = maek.LINK([maek.CPP('walkmesh-bench.cpp'), walkmesh_obj, mapped_chunk_obj], 'scenes/walkmesh-bench');
+//times Navigation path queries, with and without the corridor cache (likewise):
+const navigation_bench_exe = maek.LINK([maek.CPP('navigation-bench.cpp'), navigation_obj, walkmesh_obj, mapped_chunk_obj], 'scenes/navigation-bench');
+//converts .pnct/.ipnct mesh files to the quantized .qpnct format:
+const compress_meshes_exe = maek.LINK([maek.CPP('compress-meshes.cpp')], 'scenes/compress-meshes');
+//reorders mesh files for vertex cache reuse and less overdraw:
+const optimize_meshes_exe = maek.LINK([maek.CPP('optimize-meshes.cpp')], 'scenes/optimize-meshes');
 
 //set the default target to the game (and copy the readme files):
-maek.TARGETS = [game_exe, show_meshes_exe, show_scene_exe, ...copies];
+maek.TARGETS = [game_exe, show_meshes_exe, show_scene_exe, walkmesh_bench_exe, navigation_bench_exe, compress_meshes_exe, optimize_meshes_exe, ...copies];
 
 //Note that tasks that produce ':abstract targets' are never cached.
 // This is similar to how .PHONY targets behave in make.
@@ -1,20 +1,118 @@
 #include "Mesh.hpp"
-#include "read_write_chunk.hpp"
+#include "mapped_chunk.hpp"
 
 #include <glm/glm.hpp>
 
 #include <stdexcept>
-#include <fstream>
 #include <iostream>
 #include <vector>
 #include <string>
 #include <set>
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
 #include <cstddef>
+#include <cstring>
 
-MeshBuffer::MeshBuffer(std::string const &filename) {
+//Append coarser versions of the triangles in elements[begin,end) to *lod_elements (which the element buffer
+// holds after 'elements'), recording them in *lods.
+// Each level snaps every vertex to one representative vertex (the one nearest the average) per cell of a grid,
+// and drops the triangles that collapse; the grid is halved in resolution each level.
+// Levels that don't remove at least a quarter of the triangles of the level before are skipped.
+template< typename PositionOf >
+static void generate_lods(ChunkSpan< uint32_t > const &elements, uint32_t begin, uint32_t end, PositionOf const &position_of, uint32_t levels, std::vector< uint32_t > *lod_elements_, std::vector< Mesh::LOD > *lods) {
+	assert(lod_elements_);
+	assert(lods);
+	auto &lod_elements = *lod_elements_;
+
+	constexpr uint32_t MinTriangles = 32; //(smaller meshes aren't worth it)
+	if ((end - begin) / 3 < MinTriangles) return;
+
+	ChunkSpan< uint32_t > const full(elements.data() + begin, end - begin);
+	std::vector< uint32_t > vertices(full.begin(), full.end());
+	std::sort(vertices.begin(), vertices.end());
+	vertices.erase(std::unique(vertices.begin(), vertices.end()), vertices.end());
+
+	glm::vec3 min = glm::vec3( std::numeric_limits< float >::infinity());
+	glm::vec3 max = glm::vec3(-std::numeric_limits< float >::infinity());
+	for (uint32_t v : vertices) {
+		min = glm::min(min, position_of(v));
+		max = glm::max(max, position_of(v));
+	}
+	float const extent = std::max(max.x - min.x, std::max(max.y - min.y, max.z - min.z));
+	if (!(extent > 0.0f)) return;
+
+	struct Cell {
+		glm::vec3 sum = glm::vec3(0.0f);
+		uint32_t count = 0;
+		uint32_t representative = -1U;
+		float dis2 = 0.0f;
+	};
+	std::unordered_map< uint64_t, Cell > cells;
+	std::unordered_map< uint32_t, uint32_t > representative_of;
+	std::vector< uint32_t > coarse;
+
+	uint32_t previous = uint32_t(full.size() / 3);
+	for (uint32_t resolution = 32; resolution >= 2 && lods->size() < levels; resolution /= 2) {
+		float const cell_size = extent / float(resolution);
+		auto cell_of = [&](glm::vec3 const &p) {
+			glm::uvec3 c = glm::uvec3(glm::max((p - min) / cell_size, glm::vec3(0.0f)));
+			c = glm::min(c, glm::uvec3(resolution - 1));
+			return uint64_t(c.x) | (uint64_t(c.y) << 21) | (uint64_t(c.z) << 42);
+		};
+
+		cells.clear();
+		for (uint32_t v : vertices) {
+			Cell &cell = cells[cell_of(position_of(v))];
+			cell.sum += position_of(v);
+			cell.count += 1;
+		}
+		for (uint32_t v : vertices) {
+			glm::vec3 const p = position_of(v);
+			Cell &cell = cells[cell_of(p)];
+			glm::vec3 const to_mean = p - cell.sum / float(cell.count);
+			float const dis2 = glm::dot(to_mean, to_mean);
+			if (cell.representative == -1U || dis2 < cell.dis2) {
+				cell.representative = v;
+				cell.dis2 = dis2;
+			}
+		}
+		float error = 0.0f;
+		for (uint32_t v : vertices) {
+			uint32_t const r = cells[cell_of(position_of(v))].representative;
+			representative_of[v] = r;
+			error = std::max(error, glm::length(position_of(v) - position_of(r)));
+		}
+
+		coarse.clear();
+		for (uint32_t i = 0; i + 2 < full.size(); i += 3) {
+			uint32_t const a = representative_of[full[i]];
+			uint32_t const b = representative_of[full[i+1]];
+			uint32_t const c = representative_of[full[i+2]];
+			if (a == b || b == c || c == a) continue;
+			coarse.emplace_back(a);
+			coarse.emplace_back(b);
+			coarse.emplace_back(c);
+		}
+		uint32_t const triangles = uint32_t(coarse.size() / 3);
+		if (triangles == 0) break;
+		if (triangles * 4 > previous * 3) continue;
+
+		Mesh::LOD lod;
+		lod.start = uint32_t(elements.size() + lod_elements.size());
+		lod.count = uint32_t(coarse.size());
+		lod.error = error;
+		lods->emplace_back(lod);
+		lod_elements.insert(lod_elements.end(), coarse.begin(), coarse.end());
+		previous = triangles;
+	}
+}
+
+MeshBuffer::MeshBuffer(std::string const &filename, bool weld, uint32_t lod_levels) {
 	glGenBuffers(1, &buffer);
 
-	std::ifstream file(filename, std::ios::binary);
+	//(chunks are used in place, so vertex data goes straight from the mapped file to GL)
+	MappedChunks file(filename);
 
 	GLuint total = 0;
 
@@ -25,62 +123,218 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 		glm::vec2 TexCoord;
 	};
 	static_assert(sizeof(Vertex) == 3*4+3*4+4*1+2*4, "Vertex is packed.");
-	std::vector< Vertex > data;
-
-	//read + upload data chunk:
-	if (filename.size() >= 5 && filename.substr(filename.size()-5) == ".pnct") {
-		read_chunk(file, "pnct", &data);
+	ChunkSpan< Vertex > data;
 
-		//upload data:
-		glBindBuffer(GL_ARRAY_BUFFER, buffer);
-		glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(Vertex), data.data(), GL_STATIC_DRAW);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	//quantized vertices, as written by compress-meshes:
+	struct QuantizedVertex {
+		glm::u16vec4 Position; //xyz as fractions of the mesh's bounding box (w unused)
+		glm::i16vec2 Normal; //octahedral encoding, as snorm16
+		glm::u8vec4 Color;
+		glm::u16vec2 TexCoord; //half floats
+	};
+	static_assert(sizeof(QuantizedVertex) == 4*2+2*2+4*1+2*2, "QuantizedVertex is packed.");
+	ChunkSpan< QuantizedVertex > quantized_data;
+	bool quantized = false;
 
-		total = GLuint(data.size()); //store total for later checks on index
+	//element indices into data; index entries are ranges of these when indexed:
+	ChunkSpan< uint32_t > indices;
+	bool indexed = false;
 
-		//store attrib locations:
-		Position = Attrib(3, GL_FLOAT, GL_FALSE, sizeof(Vertex), offsetof(Vertex, Position));
-		Normal = Attrib(3, GL_FLOAT, GL_FALSE, sizeof(Vertex), offsetof(Vertex, Normal));
-		Color = Attrib(4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), offsetof(Vertex, Color));
-		TexCoord = Attrib(2, GL_FLOAT, GL_FALSE, sizeof(Vertex), offsetof(Vertex, TexCoord));
+	//read data chunk (and, for indexed files, the element chunk):
+	if (filename.size() >= 5 && filename.substr(filename.size()-5) == ".pnct") {
+		read_chunk(file, "pnct", &data);
+	} else if (filename.size() >= 6 && filename.substr(filename.size()-6) == ".ipnct") {
+		read_chunk(file, "pnct", &data);
+		read_chunk(file, "ind0", &indices);
+		indexed = true;
+	} else if (filename.size() >= 6 && filename.substr(filename.size()-6) == ".qpnct") {
+		read_chunk(file, "pnq0", &quantized_data);
+		read_chunk(file, "ind0", &indices);
+		indexed = true;
+		quantized = true;
 	} else {
 		throw std::runtime_error("Unknown file type '" + filename + "'");
 	}
 
-	std::vector< char > strings;
+	ChunkSpan< char > strings;
 	read_chunk(file, "str0", &strings);
 
-	{ //read index chunk, add to meshes:
-		struct IndexEntry {
-			uint32_t name_begin, name_end;
-			uint32_t vertex_begin, vertex_end;
+	struct IndexEntry {
+		uint32_t name_begin, name_end;
+		uint32_t vertex_begin, vertex_end; //(element begin, end for indexed files)
+	};
+	static_assert(sizeof(IndexEntry) == 16, "Index entry should be packed");
+
+	ChunkSpan< IndexEntry > file_index;
+	read_chunk(file, "idx0", &file_index);
+	//(copied, since welding rewrites the ranges)
+	std::vector< IndexEntry > index(file_index.begin(), file_index.end());
+
+	ChunkSpan< uint32_t > programs;
+	read_chunk(file, "prg0", &programs);
+
+	if (programs.size() < index.size()) {
+		throw std::runtime_error("program chunk has fewer entries than index chunk");
+	}
+
+	//quantized files also store the bounds each mesh's positions are relative to:
+	struct Bounds {
+		glm::vec3 min, max;
+	};
+	static_assert(sizeof(Bounds) == 2*3*4, "Bounds is packed.");
+	ChunkSpan< Bounds > bounds;
+	if (quantized) {
+		read_chunk(file, "bnd0", &bounds);
+		if (bounds.size() != index.size()) {
+			throw std::runtime_error("bounds chunk doesn't match index chunk");
+		}
+	}
+
+	size_t const vertex_count = (quantized ? quantized_data.size() : data.size());
+	for (uint32_t i : indices) {
+		if (i >= vertex_count) throw std::runtime_error("element chunk has out-of-range vertex index");
+	}
+
+	total = GLuint(indexed ? indices.size() : data.size()); //store total for later checks on index
+	for (auto const &entry : index) {
+		if (!(entry.vertex_begin <= entry.vertex_end && entry.vertex_end <= total)) {
+			throw std::runtime_error("index entry has out-of-range vertex start/count");
+		}
+	}
+
+	std::vector< Vertex > welded;
+	std::vector< uint32_t > welded_indices;
+	if (!indexed && weld) {
+		//merge vertices that are identical in every attribute, one mesh at a time:
+		// (so each mesh's vertices stay together and the index's ranges become element ranges)
+		struct VertexHash {
+			size_t operator()(Vertex const &v) const {
+				//FNV-1a over the (packed) bytes:
+				unsigned char const *bytes = reinterpret_cast< unsigned char const * >(&v);
+				uint64_t hash = 0xcbf29ce484222325ULL;
+				for (size_t i = 0; i < sizeof(Vertex); ++i) {
+					hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+				}
+				return size_t(hash);
+			}
+		};
+		struct VertexEqual {
+			bool operator()(Vertex const &a, Vertex const &b) const {
+				return std::memcmp(&a, &b, sizeof(Vertex)) == 0;
+			}
 		};
-		static_assert(sizeof(IndexEntry) == 16, "Index entry should be packed");
+		std::unordered_map< Vertex, uint32_t, VertexHash, VertexEqual > welded_index;
+
+		welded.reserve(data.size());
+		welded_indices.reserve(data.size());
+		for (auto &entry : index) {
+			welded_index.clear();
+			uint32_t const begin = uint32_t(welded_indices.size());
+			for (uint32_t v = entry.vertex_begin; v < entry.vertex_end; ++v) {
+				auto ret = welded_index.emplace(data[v], uint32_t(welded.size()));
+				if (ret.second) welded.emplace_back(data[v]);
+				welded_indices.emplace_back(ret.first->second);
+			}
+			entry.vertex_begin = begin;
+			entry.vertex_end = uint32_t(welded_indices.size());
+		}
+
+		/* //DEBUG:
+		std::cout << "Welded '" << filename << "' from " << data.size() << " to " << welded.size() << " vertices." << std::endl;
+		*/
+
+		data = ChunkSpan< Vertex >(welded);
+		indices = ChunkSpan< uint32_t >(welded_indices);
+		indexed = true;
+	}
+
+	//generate levels of detail, with their elements after all the full meshes':
+	std::vector< uint32_t > lod_indices;
+	std::vector< std::vector< Mesh::LOD > > entry_lods(index.size());
+	if (indexed && lod_levels > 0) {
+		for (uint32_t i = 0; i < index.size(); ++i) {
+			auto position_of = [&](uint32_t v) {
+				if (quantized) {
+					Bounds const &b = bounds[i];
+					return b.min + (b.max - b.min) * (glm::vec3(quantized_data[v].Position) / 65535.0f);
+				}
+				return data[v].Position;
+			};
+			generate_lods(indices, index[i].vertex_begin, index[i].vertex_end, position_of, lod_levels, &lod_indices, &entry_lods[i]);
+		}
+	}
+
+	//upload data and store attrib locations:
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	if (quantized) {
+		glBufferData(GL_ARRAY_BUFFER, quantized_data.size() * sizeof(QuantizedVertex), quantized_data.data(), GL_STATIC_DRAW);
+
+		//(Position reads as 0..1 within the bounds, Normal as -1..1 before decoding; see VertexDecodeGLSL)
+		Position = Attrib(3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(QuantizedVertex), offsetof(QuantizedVertex, Position));
+		Normal = Attrib(2, GL_SHORT, GL_TRUE, sizeof(QuantizedVertex), offsetof(QuantizedVertex, Normal));
+		Color = Attrib(4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(QuantizedVertex), offsetof(QuantizedVertex, Color));
+		TexCoord = Attrib(2, GL_HALF_FLOAT, GL_FALSE, sizeof(QuantizedVertex), offsetof(QuantizedVertex, TexCoord));
+	} else {
+		glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(Vertex), data.data(), GL_STATIC_DRAW);
 
-		std::vector< IndexEntry > index;
-		read_chunk(file, "idx0", &index);
+		Position = Attrib(3, GL_FLOAT, GL_FALSE, sizeof(Vertex), offsetof(Vertex, Position));
+		Normal = Attrib(3, GL_FLOAT, GL_FALSE, sizeof(Vertex), offsetof(Vertex, Normal));
+		Color = Attrib(4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), offsetof(Vertex, Color));
+		TexCoord = Attrib(2, GL_FLOAT, GL_FALSE, sizeof(Vertex), offsetof(Vertex, TexCoord));
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-		std::vector< uint32_t > programs;
-		read_chunk(file, "prg0", &programs);
+	//upload elements, as 16-bit indices when they all fit:
+	GLenum index_type = GL_NONE;
+	if (indexed) {
+		glGenBuffers(1, &index_buffer);
+		//(uploaded through GL_ARRAY_BUFFER, since binding GL_ELEMENT_ARRAY_BUFFER would change whatever vertex array is bound)
+		glBindBuffer(GL_ARRAY_BUFFER, index_buffer);
+		if ((quantized ? quantized_data.size() : data.size()) <= 0x10000) {
+			std::vector< uint16_t > short_indices;
+			short_indices.reserve(indices.size() + lod_indices.size());
+			short_indices.insert(short_indices.end(), indices.begin(), indices.end());
+			short_indices.insert(short_indices.end(), lod_indices.begin(), lod_indices.end());
+			glBufferData(GL_ARRAY_BUFFER, short_indices.size() * sizeof(uint16_t), short_indices.data(), GL_STATIC_DRAW);
+			index_type = GL_UNSIGNED_SHORT;
+		} else {
+			//(file elements straight from the mapping, then the generated ones)
+			glBufferData(GL_ARRAY_BUFFER, (indices.size() + lod_indices.size()) * sizeof(uint32_t), nullptr, GL_STATIC_DRAW);
+			glBufferSubData(GL_ARRAY_BUFFER, 0, indices.size() * sizeof(uint32_t), indices.data());
+			glBufferSubData(GL_ARRAY_BUFFER, indices.size() * sizeof(uint32_t), lod_indices.size() * sizeof(uint32_t), lod_indices.data());
+			index_type = GL_UNSIGNED_INT;
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
 
+	{ //add index entries to meshes:
 		size_t prg_index = 0;
 		for (auto const &entry : index) {
 			if (!(entry.name_begin <= entry.name_end && entry.name_end <= strings.size())) {
 				throw std::runtime_error("index entry has out-of-range name begin/end");
 			}
-			if (!(entry.vertex_begin <= entry.vertex_end && entry.vertex_end <= total)) {
-				throw std::runtime_error("index entry has out-of-range vertex start/count");
-			}
-			std::string name(&strings[0] + entry.name_begin, &strings[0] + entry.name_end);
+			std::string name(strings.data() + entry.name_begin, strings.data() + entry.name_end);
 			Mesh mesh;
 			mesh.type = GL_TRIANGLES;
 			mesh.start = entry.vertex_begin;
 			mesh.count = entry.vertex_end - entry.vertex_begin;
-			mesh.program = programs[prg_index++];
-			for (uint32_t v = entry.vertex_begin; v < entry.vertex_end; ++v) {
-				mesh.min = glm::min(mesh.min, data[v].Position);
-				mesh.max = glm::max(mesh.max, data[v].Position);
+			mesh.index_type = index_type;
+			mesh.lods = entry_lods[prg_index];
+			if (quantized) {
+				Bounds const &b = bounds[prg_index];
+				mesh.min = b.min;
+				mesh.max = b.max;
+				mesh.position_offset = b.min;
+				mesh.position_scale = b.max - b.min;
+				mesh.octahedral_normals = true;
+			} else {
+				for (uint32_t i = entry.vertex_begin; i < entry.vertex_end; ++i) {
+					glm::vec3 const &position = data[indexed ? indices[i] : i].Position;
+					mesh.min = glm::min(mesh.min, position);
+					mesh.max = glm::max(mesh.max, position);
+				}
 			}
+			mesh.program = programs[prg_index++];
 			bool inserted = meshes.insert(std::make_pair(name, mesh)).second;
 			if (!inserted) {
 				std::cerr << "WARNING: mesh name '" + name + "' in filename '" + filename + "' collides with existing mesh." << std::endl;
@@ -88,7 +342,7 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 		}
 	}
 
-	if (file.peek() != EOF) {
+	if (!file.at_end()) {
 		std::cerr << "WARNING: trailing data in mesh file '" << filename << "'" << std::endl;
 	}
 
@@ -103,6 +357,25 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 	*/
 }
 
+char const *MeshBuffer::VertexDecodeGLSL =
+	"uniform vec3 POSITION_OFFSET = vec3(0.0);\n"
+	"uniform vec3 POSITION_SCALE = vec3(1.0);\n"
+	"uniform bool OCTAHEDRAL_NORMALS = false;\n"
+	"in vec4 Position;\n"
+	"in vec3 Normal;\n"
+	"vec4 mesh_position() {\n"
+	"	return vec4(POSITION_OFFSET + POSITION_SCALE * Position.xyz, 1.0);\n"
+	"}\n"
+	"vec3 mesh_normal() {\n"
+	"	if (!OCTAHEDRAL_NORMALS) return Normal;\n"
+	"	vec3 n = vec3(Normal.xy, 1.0 - abs(Normal.x) - abs(Normal.y));\n" //unfold the lower hemisphere:
+	"	float t = max(-n.z, 0.0);\n"
+	"	n.x += (n.x >= 0.0 ? -t : t);\n"
+	"	n.y += (n.y >= 0.0 ? -t : t);\n"
+	"	return normalize(n);\n"
+	"}\n"
+;
+
 const Mesh &MeshBuffer::lookup(std::string const &name) const {
 	auto f = meshes.find(name);
 	if (f == meshes.end()) {
@@ -133,6 +406,8 @@ GLuint MeshBuffer::make_vao_for_program(GLuint program) const {
 	bind_attribute("Color", Color);
 	bind_attribute("TexCoord", TexCoord);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	//(the element buffer binding is part of the vertex array's state, so it stays bound until the vao is unbound)
+	if (index_buffer != 0) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
 	glBindVertexArray(0);
 
 	//Check that all active attributes were bound:
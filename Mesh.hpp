@@ -7,6 +7,20 @@
  *  a single OpenGL array buffer. Individual meshes can be looked up by name
  *  using the MeshBuffer::lookup() function.
  *
+ * Meshes may also be indexed, in which case they are a range of the
+ *  MeshBuffer's element buffer (and vertices are shared between triangles).
+ *  Indexed meshes come from ".ipnct" files, or from welding identical
+ *  vertices in ".pnct" files at load time.
+ *
+ * ".qpnct" files (written by scenes/compress-meshes) are indexed and also
+ *  quantized: positions are 16-bit fractions of each mesh's bounding box,
+ *  normals are octahedral-encoded in two 16-bit values, and texture
+ *  coordinates are half floats. Shaders decode them with the code in
+ *  MeshBuffer::VertexDecodeGLSL.
+ *
+ * Indexed meshes also get a few coarser levels of detail, generated at load
+ *  time by clustering nearby vertices, as more ranges of the element buffer.
+ *
  */
 
 #include "GL.hpp"
@@ -14,17 +28,33 @@
 #include <map>
 #include <limits>
 #include <string>
+#include <vector>
 
 
 struct Mesh {
 	//Meshes are vertex ranges (and primitive types) in their MeshBuffer:
 
 	GLenum type = GL_TRIANGLES; //type of primitives in mesh
-	GLuint start = 0; //index of first vertex
-	GLuint count = 0; //count of vertices
+	GLuint start = 0; //index of first vertex (or first element, if indexed)
+	GLuint count = 0; //count of vertices (or elements, if indexed)
+	GLenum index_type = GL_NONE; //GL_UNSIGNED_SHORT or GL_UNSIGNED_INT if the mesh is a range of the element buffer
 
 	GLuint program = 0;
 
+	//vertex decoding for quantized buffers (copy to Scene::Drawable::Pipeline; the defaults leave float vertices as-is):
+	// object-space position = position_offset + position_scale * Position
+	glm::vec3 position_offset = glm::vec3(0.0f);
+	glm::vec3 position_scale = glm::vec3(1.0f);
+	bool octahedral_normals = false; //Normal.xy holds an octahedral-encoded unit vector
+
+	//coarser versions of the mesh (element ranges over the same vertices), finest first:
+	struct LOD {
+		GLuint start = 0; //first element
+		GLuint count = 0; //count of elements
+		float error = 0.0f; //farthest (in object space) any vertex was moved to make this level
+	};
+	std::vector< LOD > lods;
+
 	//Bounding box.
 	//useful for debug visualization and (perhaps, eventually) collision detection:
 	glm::vec3 min = glm::vec3( std::numeric_limits< float >::infinity());
@@ -34,7 +64,9 @@ struct Mesh {
 struct MeshBuffer {
 	//construct from a file:
 	// note: will throw if file fails to read.
-	MeshBuffer(std::string const &filename);
+	// weld: merge identical vertices within each mesh of a (non-indexed) ".pnct" file and draw it indexed
+	// lod_levels: most levels of detail to generate for each indexed mesh (see Mesh::lods)
+	MeshBuffer(std::string const &filename, bool weld = true, uint32_t lod_levels = 3);
 
 	//look up a particular mesh by name:
 	// note: will throw if mesh not found.
@@ -44,8 +76,16 @@ struct MeshBuffer {
 	// note: will throw if program defines attributes not contained in this buffer
 	GLuint make_vao_for_program(GLuint program) const;
 
+	//GLSL for vertex shaders that draw MeshBuffer meshes (quantized or not):
+	// declares the Position and Normal attributes and the POSITION_OFFSET, POSITION_SCALE, and OCTAHEDRAL_NORMALS uniforms,
+	// along with mesh_position() and mesh_normal(), which return decoded object-space values.
+	static char const *VertexDecodeGLSL;
+
 	//This is the OpenGL vertex buffer object containing the mesh data:
 	GLuint buffer = 0;
+	//...and the element buffer with indices into it (0 if no meshes are indexed):
+	// (make_vao_for_program records it in the vertex array object)
+	GLuint index_buffer = 0;
 
 	//-- internals ---
 
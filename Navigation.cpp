@@ -0,0 +1,298 @@
+#include "Navigation.hpp"
+
+#include <glm/gtx/norm.hpp>
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+Navigation::Navigation(WalkMeshes const &walkmeshes) {
+	//number meshes in name order, so ids don't depend on hash order:
+	for (auto const &wm : walkmeshes.meshes) {
+		names.emplace_back(wm.first);
+	}
+	std::sort(names.begin(), names.end());
+
+	mesh_first_node.emplace_back(0);
+	for (auto const &name : names) {
+		WalkMesh const &wm = walkmeshes.lookup(name);
+		uint32_t const mesh = uint32_t(meshes.size());
+		meshes.emplace_back(&wm);
+		for (auto const &tri : wm.triangles) {
+			node_centers.emplace_back((wm.vertices[tri.x] + wm.vertices[tri.y] + wm.vertices[tri.z]) / 3.0f);
+			node_mesh.emplace_back(mesh);
+		}
+		mesh_first_node.emplace_back(uint32_t(node_centers.size()));
+	}
+	node_links.resize(node_centers.size());
+	node_link_distance.assign(node_centers.size(), std::numeric_limits< float >::infinity());
+}
+
+uint32_t Navigation::mesh_id(std::string const &name) const {
+	auto f = std::lower_bound(names.begin(), names.end(), name);
+	if (f == names.end() || *f != name) {
+		throw std::runtime_error("No walkmesh named '" + name + "' to navigate on.");
+	}
+	return uint32_t(f - names.begin());
+}
+
+void Navigation::add_link(uint32_t from_mesh, glm::vec3 const &from_point, uint32_t to_mesh, glm::vec3 const &to_point) {
+	assert(from_mesh < meshes.size() && to_mesh < meshes.size());
+	if (meshes[from_mesh]->triangles.empty() || meshes[to_mesh]->triangles.empty()) return;
+
+	//links start and end on the meshes themselves:
+	WalkPoint const from = meshes[from_mesh]->nearest_walk_point(from_point);
+	WalkPoint const to = meshes[to_mesh]->nearest_walk_point(to_point);
+
+	Link link;
+	link.from_mesh = from_mesh;
+	link.from_triangle = node_of(from_mesh, from) - mesh_first_node[from_mesh];
+	link.from_point = meshes[from_mesh]->to_world_point(from);
+	link.to_mesh = to_mesh;
+	link.to_triangle = node_of(to_mesh, to) - mesh_first_node[to_mesh];
+	link.to_point = meshes[to_mesh]->to_world_point(to);
+
+	uint32_t const from_node = mesh_first_node[from_mesh] + link.from_triangle;
+	node_links[from_node].emplace_back(uint32_t(links.size()));
+	links.emplace_back(link);
+
+	//keep the search heuristic's distance-to-nearest-link current:
+	for (uint32_t n = mesh_first_node[from_mesh]; n < mesh_first_node[from_mesh + 1]; ++n) {
+		node_link_distance[n] = std::min(node_link_distance[n], glm::distance(node_centers[n], node_centers[from_node]));
+	}
+
+	//cached corridors may have a shorter way around now:
+	clear_cache();
+}
+
+uint32_t Navigation::node_of(uint32_t mesh, WalkPoint const &wp) const {
+	assert(mesh < meshes.size());
+	uint32_t rotation;
+	return mesh_first_node[mesh] + meshes[mesh]->triangle_of(wp, &rotation);
+}
+
+void Navigation::clear_cache() const {
+	cache.clear();
+	cache_order.clear();
+}
+
+bool Navigation::find_path(uint32_t from_mesh, WalkPoint const &from, uint32_t to_mesh, WalkPoint const &to, std::vector< Waypoint > *path) const {
+	assert(path);
+	path->clear();
+
+	uint32_t const start = node_of(from_mesh, from);
+	uint32_t const goal = node_of(to_mesh, to);
+
+	//recently-found corridor between the same triangles?
+	uint64_t const key = (uint64_t(start) << 32) | uint64_t(goal);
+	std::vector< Step > const *corridor = nullptr;
+	auto f = cache.find(key);
+	if (f != cache.end()) {
+		cache_stats.hits += 1;
+		cache_order.splice(cache_order.begin(), cache_order, f->second);
+		corridor = &f->second->second;
+	} else {
+		cache_stats.misses += 1;
+		std::vector< Step > found;
+		if (!search(start, goal, &found)) return false;
+		if (cache_capacity == 0) {
+			smooth(found, meshes[from_mesh]->to_world_point(from), meshes[to_mesh]->to_world_point(to), path);
+			return true;
+		}
+		cache_order.emplace_front(key, std::move(found));
+		cache.emplace(key, cache_order.begin());
+		corridor = &cache_order.front().second;
+		while (cache_order.size() > cache_capacity) {
+			cache.erase(cache_order.back().first);
+			cache_order.pop_back();
+		}
+	}
+
+	smooth(*corridor, meshes[from_mesh]->to_world_point(from), meshes[to_mesh]->to_world_point(to), path);
+	return true;
+}
+
+bool Navigation::search(uint32_t start, uint32_t goal, std::vector< Step > *corridor) const {
+	assert(corridor);
+	corridor->clear();
+
+	uint32_t const node_count = uint32_t(node_centers.size());
+	if (visit_stamp.size() != node_count) {
+		visit_stamp.assign(node_count, 0);
+		cost.resize(node_count);
+		came_from.resize(node_count);
+		closed.resize(node_count);
+		stamp = 0;
+	}
+	stamp += 1;
+	if (stamp == 0) { //(wrapped around; old stamps could look current)
+		std::fill(visit_stamp.begin(), visit_stamp.end(), 0);
+		stamp = 1;
+	}
+
+	uint32_t const goal_mesh = node_mesh[goal];
+	glm::vec3 const &goal_center = node_centers[goal];
+
+	//Straight-line distance to the goal can't be used on meshes with links, since a link may jump closer,
+	// so there the heuristic is the distance to the goal or to the nearest link, whichever is smaller.
+	// (it's zero at a link's own triangle, which keeps it consistent with links being free to take)
+	auto heuristic = [&](uint32_t n) {
+		float h = node_link_distance[n];
+		if (node_mesh[n] == goal_mesh) h = std::min(h, glm::distance(node_centers[n], goal_center));
+		return h; //(infinite if the goal can't be reached from here at all)
+	};
+
+	//open set as a binary heap, with stale entries skipped when popped:
+	open.clear();
+	auto later = [](std::pair< float, uint32_t > const &a, std::pair< float, uint32_t > const &b) {
+		return a.first > b.first;
+	};
+	auto visit = [&](uint32_t n, float n_cost, Step from) {
+		if (visit_stamp[n] == stamp && (closed[n] || cost[n] <= n_cost)) return;
+		float const h = heuristic(n);
+		if (h == std::numeric_limits< float >::infinity()) return;
+		visit_stamp[n] = stamp;
+		cost[n] = n_cost;
+		came_from[n] = from;
+		closed[n] = 0;
+		open.emplace_back(n_cost + h, n);
+		std::push_heap(open.begin(), open.end(), later);
+	};
+
+	visit(start, 0.0f, Step{-1U, -1U});
+	while (!open.empty()) {
+		std::pop_heap(open.begin(), open.end(), later);
+		uint32_t const n = open.back().second;
+		open.pop_back();
+		if (closed[n]) continue;
+		closed[n] = 1;
+
+		if (n == goal) {
+			//walk back to the start:
+			for (uint32_t at = goal; at != -1U; ) {
+				Step const &prev = came_from[at];
+				corridor->emplace_back(Step{at, prev.via});
+				at = prev.node;
+			}
+			std::reverse(corridor->begin(), corridor->end());
+			return true;
+		}
+
+		uint32_t const mesh = node_mesh[n];
+		WalkMesh const &wm = *meshes[mesh];
+		uint32_t const t = n - mesh_first_node[mesh];
+		//neighbors over each edge:
+		for (uint32_t e = 0; e < 3; ++e) {
+			uint32_t const twin = wm.opposite[3 * t + e];
+			if (twin == -1U) continue;
+			uint32_t const m = mesh_first_node[mesh] + twin / 3;
+			visit(m, cost[n] + glm::distance(node_centers[n], node_centers[m]), Step{n, 3 * t + e});
+		}
+		//...and through links:
+		for (uint32_t l : node_links[n]) {
+			Link const &link = links[l];
+			visit(mesh_first_node[link.to_mesh] + link.to_triangle, cost[n], Step{n, l | LinkBit});
+		}
+	}
+	return false;
+}
+
+//twice the signed area of triangle (a,b,c), as seen from above (+z):
+static float triarea2(glm::vec3 const &a, glm::vec3 const &b, glm::vec3 const &c) {
+	float const ax = b.x - a.x, ay = b.y - a.y;
+	float const bx = c.x - a.x, by = c.y - a.y;
+	return bx * ay - ax * by;
+}
+
+static bool same_xy(glm::vec3 const &a, glm::vec3 const &b) {
+	return glm::length2(glm::vec2(a) - glm::vec2(b)) < 1e-12f;
+}
+
+// "Simple Stupid Funnel Algorithm", Mikko Mononen
+// http://digestingduck.blogspot.com/2010/03/simple-stupid-funnel-algorithm.html
+void Navigation::smooth(std::vector< Step > const &corridor, glm::vec3 const &from, glm::vec3 const &to, std::vector< Waypoint > *path) const {
+	assert(path);
+	assert(!corridor.empty());
+
+	struct Gap {
+		glm::vec3 left, right; //(as seen walking through it)
+	};
+	std::vector< Gap > gaps;
+
+	auto add = [&path](uint32_t mesh, glm::vec3 const &position, bool portal) {
+		if (!path->empty() && path->back().mesh == mesh && !path->back().portal && same_xy(path->back().position, position)) {
+			path->back().position = position;
+			path->back().portal = portal;
+			return;
+		}
+		path->emplace_back(Waypoint{mesh, position, portal});
+	};
+
+	//the corridor is split into runs on one mesh each, joined by links:
+	size_t begin = 0;
+	glm::vec3 run_start = from;
+	while (begin < corridor.size()) {
+		size_t end = begin + 1;
+		while (end < corridor.size() && !(corridor[end].via & LinkBit)) ++end;
+		uint32_t const mesh = node_mesh[corridor[begin].node];
+		WalkMesh const &wm = *meshes[mesh];
+		bool const through_link = (end < corridor.size());
+		glm::vec3 const run_end = (through_link ? links[corridor[end].via & ~LinkBit].from_point : to);
+
+		//gaps are the shared edges between successive triangles:
+		gaps.clear();
+		gaps.emplace_back(Gap{run_start, run_start});
+		for (size_t i = begin + 1; i < end; ++i) {
+			uint32_t const he = corridor[i].via;
+			glm::uvec3 const &tri = wm.triangles[he / 3];
+			//(triangles are CCW from above, so leaving over edge a->b has b on the left)
+			gaps.emplace_back(Gap{wm.vertices[tri[(he % 3 + 1) % 3]], wm.vertices[tri[he % 3]]});
+		}
+		gaps.emplace_back(Gap{run_end, run_end});
+
+		//pull the string tight through the gaps:
+		glm::vec3 apex = gaps[0].left, left = gaps[0].left, right = gaps[0].right;
+		size_t apex_index = 0, left_index = 0, right_index = 0;
+		for (size_t i = 1; i < gaps.size(); ++i) {
+			glm::vec3 const &next_left = gaps[i].left;
+			glm::vec3 const &next_right = gaps[i].right;
+
+			//try to narrow the funnel from the right:
+			if (triarea2(apex, right, next_right) <= 0.0f) {
+				if (same_xy(apex, right) || triarea2(apex, left, next_right) > 0.0f) {
+					right = next_right;
+					right_index = i;
+				} else {
+					//right crossed over left, so the left point is a corner; restart from there:
+					add(mesh, left, false);
+					apex = left;
+					apex_index = left_index;
+					left = right = apex;
+					left_index = right_index = apex_index;
+					i = apex_index;
+					continue;
+				}
+			}
+
+			//...and from the left:
+			if (triarea2(apex, left, next_left) >= 0.0f) {
+				if (same_xy(apex, left) || triarea2(apex, right, next_left) < 0.0f) {
+					left = next_left;
+					left_index = i;
+				} else {
+					add(mesh, right, false);
+					apex = right;
+					apex_index = right_index;
+					left = right = apex;
+					left_index = right_index = apex_index;
+					i = apex_index;
+					continue;
+				}
+			}
+		}
+		add(mesh, run_end, through_link);
+
+		if (through_link) run_start = links[corridor[end].via & ~LinkBit].to_point;
+		begin = end;
+	}
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+/*
+ * "Navigation" finds routes over a set of walkmeshes:
+ *  - A* over walkmesh triangles (using each WalkMesh's half-edge adjacency),
+ *  - "funnel" smoothing of the resulting triangle corridor into a few straight segments,
+ *  - links between walkmeshes where a portal on one leads to a portal on another,
+ *  - an LRU cache of recent corridors, so agents repathing between the same places skip the search.
+ *
+ * Queries reuse internal scratch buffers, so a Navigation shouldn't be used from several threads at once.
+ */
+
+#include "WalkMesh.hpp"
+
+#include <glm/glm.hpp>
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct Scene;
+
+struct Navigation {
+	//Navigate over every mesh in 'walkmeshes' (which must outlive this object):
+	Navigation(WalkMeshes const &walkmeshes);
+
+	//the meshes, indexed by mesh id:
+	std::vector< WalkMesh const * > meshes;
+	std::vector< std::string > names;
+	//mesh id of a named walkmesh (throws if there's no such mesh):
+	uint32_t mesh_id(std::string const &name) const;
+
+	//Links let a path leave one walkmesh at a point and continue on another (e.g., through a portal):
+	struct Link {
+		uint32_t from_mesh, from_triangle;
+		glm::vec3 from_point; //walking to this point takes you through...
+		uint32_t to_mesh, to_triangle;
+		glm::vec3 to_point; //...to here
+	};
+	std::vector< Link > links;
+	void add_link(uint32_t from_mesh, glm::vec3 const &from_point, uint32_t to_mesh, glm::vec3 const &to_point);
+	//one link per portal with a destination, from the portal (on its Portal::on_walkmesh) to its dest (on dest's):
+	// (portals on walkmeshes this Navigation doesn't know about are skipped)
+	// (defined in NavigationPortals.cpp, so tools can use Navigation without linking Scene)
+	void link_portals(Scene const &scene);
+
+	//A route, as straight segments between waypoints:
+	struct Waypoint {
+		uint32_t mesh;
+		glm::vec3 position;
+		bool portal; //reaching this waypoint takes you through a link; the next waypoint is on the far side
+	};
+	//finds a path from 'from' (on mesh from_mesh) to 'to' (on mesh to_mesh):
+	// returns false (and leaves *path empty) if there isn't one
+	bool find_path(uint32_t from_mesh, WalkPoint const &from, uint32_t to_mesh, WalkPoint const &to, std::vector< Waypoint > *path) const;
+
+	//Recent corridors (triangle sequences) by (start node, goal node), least recently used dropped first:
+	size_t cache_capacity = 256;
+	struct CacheStats {
+		uint32_t hits = 0;
+		uint32_t misses = 0;
+	};
+	mutable CacheStats cache_stats;
+	void clear_cache() const;
+
+	//--- internals ---
+	//search nodes are triangles, numbered across all meshes: node = mesh_first_node[mesh] + triangle
+	std::vector< uint32_t > mesh_first_node; //(one extra entry at the end holds the total node count)
+	std::vector< glm::vec3 > node_centers; //triangle centroids
+	std::vector< uint32_t > node_mesh;
+	std::vector< std::vector< uint32_t > > node_links; //indices in 'links' leaving each node (mostly empty)
+	std::vector< float > node_link_distance; //from each node's center to the nearest link start on its mesh (infinite if none)
+
+	uint32_t node_of(uint32_t mesh, WalkPoint const &wp) const;
+
+	//one step of a corridor: the node, and how it was entered from the previous one
+	struct Step {
+		uint32_t node;
+		uint32_t via; //half-edge (in the previous node's triangle) crossed to get here, or link index | LinkBit
+	};
+	static constexpr uint32_t LinkBit = 0x80000000;
+	bool search(uint32_t start, uint32_t goal, std::vector< Step > *corridor) const;
+	void smooth(std::vector< Step > const &corridor, glm::vec3 const &from, glm::vec3 const &to, std::vector< Waypoint > *path) const;
+
+	//search scratch, indexed by node (entries are only valid where visit_stamp == stamp):
+	mutable std::vector< uint32_t > visit_stamp;
+	mutable std::vector< float > cost; //best known cost from start
+	mutable std::vector< Step > came_from; //(node is the previous node)
+	mutable std::vector< uint8_t > closed;
+	mutable uint32_t stamp = 0;
+	mutable std::vector< std::pair< float, uint32_t > > open; //binary heap of (estimated total, node)
+
+	//the cache:
+	mutable std::list< std::pair< uint64_t, std::vector< Step > > > cache_order; //most recently used first
+	mutable std::unordered_map< uint64_t, decltype(cache_order)::iterator > cache;
+};
@@ -0,0 +1,20 @@
+#include "Navigation.hpp"
+
+#include "Scene.hpp"
+
+#include <algorithm>
+
+void Navigation::link_portals(Scene const &scene) {
+	for (auto const &pair : scene.portals) {
+		Scene::Portal const *p = pair.second;
+		if (p == nullptr || p->dest == nullptr) continue;
+		if (p->drawable == nullptr || p->dest->drawable == nullptr) continue;
+		auto from = std::lower_bound(names.begin(), names.end(), p->on_walkmesh);
+		auto to = std::lower_bound(names.begin(), names.end(), p->dest->on_walkmesh);
+		if (from == names.end() || *from != p->on_walkmesh) continue;
+		if (to == names.end() || *to != p->dest->on_walkmesh) continue;
+
+		add_link(uint32_t(from - names.begin()), scene.transforms.make_local_to_world(p->drawable->transform)[3],
+			uint32_t(to - names.begin()), scene.transforms.make_local_to_world(p->dest->drawable->transform)[3]);
+	}
+}
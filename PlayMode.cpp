@@ -13,6 +13,7 @@
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/quaternion.hpp>
 
+#include <algorithm>
 #include <random>
 
 GLuint meshes_for_lit_color_texture_program = 0;
@@ -25,7 +26,7 @@ Load< MeshBuffer > level_meshes(LoadTagDefault, []() -> MeshBuffer const * {
 });
 
 Load< Scene > level_scene(LoadTagDefault, []() -> Scene const * {
-	return new Scene(data_path("level/demo.scene"), [&](Scene &scene, Scene::Transform *transform, std::string const &mesh_name){
+	return new Scene(data_path("level/demo.scene"), [&](Scene &scene, Scene::Transform transform, std::string const &mesh_name){
 		Mesh const &mesh = level_meshes->lookup(mesh_name);
 
 		scene.drawables.emplace_back(transform);
@@ -36,8 +37,19 @@ Load< Scene > level_scene(LoadTagDefault, []() -> Scene const * {
 		drawable.pipeline.type = mesh.type;
 		drawable.pipeline.start = mesh.start;
 		drawable.pipeline.count = mesh.count;
+		drawable.pipeline.index_type = mesh.index_type;
+		drawable.pipeline.position_offset = mesh.position_offset;
+		drawable.pipeline.position_scale = mesh.position_scale;
+		drawable.pipeline.octahedral_normals = mesh.octahedral_normals;
+		drawable.pipeline.lod_count = uint32_t(std::min< size_t >(mesh.lods.size(), Scene::Drawable::Pipeline::MaxLODs));
+		for (uint32_t l = 0; l < drawable.pipeline.lod_count; ++l) {
+			drawable.pipeline.lods[l] = Scene::Drawable::Pipeline::LOD{mesh.lods[l].start, mesh.lods[l].count, mesh.lods[l].error};
+		}
+
+		drawable.min = mesh.min;
+		drawable.max = mesh.max;
 
-	}, [&](Scene &scene, Scene::Transform *transform, std::string const &mesh_name, std::string const &dest_name, std::string const &walk_mesh_name, std::string const &group_name){
+	}, [&](Scene &scene, Scene::Transform transform, std::string const &mesh_name, std::string const &dest_name, std::string const &walk_mesh_name, std::string const &group_name){
 		Mesh const &mesh = level_meshes->lookup(mesh_name);
 
 		Scene::Drawable *drawable = new Scene::Drawable(transform);
@@ -47,11 +59,15 @@ Load< Scene > level_scene(LoadTagDefault, []() -> Scene const * {
 		drawable->pipeline.type = mesh.type;
 		drawable->pipeline.start = mesh.start;
 		drawable->pipeline.count = mesh.count;
+		drawable->pipeline.index_type = mesh.index_type;
+		drawable->pipeline.position_offset = mesh.position_offset;
+		drawable->pipeline.position_scale = mesh.position_scale;
+		drawable->pipeline.octahedral_normals = mesh.octahedral_normals;
 
 		//why transform name and not mesh name? well the portal data addon in blender uses transform to point to destination.
 		//so when we link portals up here, we need to make sure we can index using the dest transform's name (not mesh name).
 		//We should probably make these the same anyway just because it's nicer.
-		Scene::Portal *&portal = scene.portals[transform->name];
+		Scene::Portal *&portal = scene.portals[scene.transforms.name(transform)];
 		if (dest_name != "") {
 			Scene::Portal *&dest = scene.portals[dest_name];
 
@@ -81,7 +97,7 @@ Load< Scene > level_scene(LoadTagDefault, []() -> Scene const * {
 
 		scene.portal_groups[group_name].emplace_back(portal);
 
-	}, [&](Scene &scene, Scene::Transform *transform, std::string const &button_name){
+	}, [&](Scene &scene, Scene::Transform transform, std::string const &button_name){
 		Mesh const &mesh = level_meshes->lookup(button_name);
 
 		scene.drawables.emplace_back(transform);
@@ -93,6 +109,17 @@ Load< Scene > level_scene(LoadTagDefault, []() -> Scene const * {
 		drawable.pipeline.type = mesh.type;
 		drawable.pipeline.start = mesh.start;
 		drawable.pipeline.count = mesh.count;
+		drawable.pipeline.index_type = mesh.index_type;
+		drawable.pipeline.position_offset = mesh.position_offset;
+		drawable.pipeline.position_scale = mesh.position_scale;
+		drawable.pipeline.octahedral_normals = mesh.octahedral_normals;
+		drawable.pipeline.lod_count = uint32_t(std::min< size_t >(mesh.lods.size(), Scene::Drawable::Pipeline::MaxLODs));
+		for (uint32_t l = 0; l < drawable.pipeline.lod_count; ++l) {
+			drawable.pipeline.lods[l] = Scene::Drawable::Pipeline::LOD{mesh.lods[l].start, mesh.lods[l].count, mesh.lods[l].error};
+		}
+
+		drawable.min = mesh.min;
+		drawable.max = mesh.max;
 
 		scene.buttons.emplace_back(&drawable, mesh.min, mesh.max, button_name);
 	});
@@ -144,24 +171,22 @@ PlayMode::PlayMode() : scene(*level_scene) {
 	scene.full_tri_program = *full_tri_program;
 
 	//create a player transform:
-	scene.transforms.emplace_back();
-	player.transform = &scene.transforms.back();
-	player.transform->position = glm::vec3(0.0f, 0.0f, 0.0f);
-	player.transform->rotation = glm::quat(glm::vec3(0.0f, 0.0f, glm::radians(-90.0f)));
+	player.transform = scene.transforms.create("Player");
+	scene.transforms.position(player.transform) = glm::vec3(0.0f, 0.0f, 0.0f);
+	scene.transforms.rotation(player.transform) = glm::quat(glm::vec3(0.0f, 0.0f, glm::radians(-90.0f)));
+	player.traveler = scene.travel.add(player.transform);
 
 	//create a player camera attached to a child of the player transform:
-	scene.transforms.emplace_back();
-	scene.cameras.emplace_back(&scene.transforms.back());
+	scene.cameras.emplace_back(scene.transforms.create("PlayerCamera", player.transform));
 	player.camera = &scene.cameras.back();
 	player.camera->fovy = glm::radians(60.0f);
 	player.camera->near = 0.01f;
-	player.camera->transform->parent = player.transform;
 
 	//player's eyes are 1.8 units above the ground:
-	player.camera->transform->position = glm::vec3(0.0f, 0.0f, 1.8f);
+	scene.transforms.position(player.camera->transform) = glm::vec3(0.0f, 0.0f, 1.8f);
 
 	//rotate camera facing direction (-z) to player facing direction (+y):
-	player.camera->transform->rotation = glm::quat(glm::vec3(glm::radians(80.0f), 0.0f, 0.0f));
+	scene.transforms.rotation(player.camera->transform) = glm::quat(glm::vec3(glm::radians(80.0f), 0.0f, 0.0f));
 
 	//gather walkmeshes
 	{
@@ -176,16 +201,33 @@ PlayMode::PlayMode() : scene(*level_scene) {
 
 	//start player walking at nearest walk point:
 	if (walkmesh != nullptr) {
-		player.at = walkmesh->nearest_walk_point(player.transform->position);
+		player.at = walkmesh->nearest_walk_point(scene.transforms.get_position(player.transform));
 	}
 
 	scene.current_group = &scene.portal_groups["Start"];
 
-	for (auto &t : scene.transforms) {
-		if (t.name == "RotateBase") {
-			rotate_base = &t;
+	//sort drawables into cells (one per portal group), bounding each cell by the walkmeshes its portals sit on:
+	// (assign_cells grows these to cover each group's portals and the drawables the scene puts in it)
+	{
+		std::unordered_map< std::string, Scene::BoxCollider > cell_bounds;
+		for (auto const &g : scene.portal_groups) {
+			glm::vec3 min = glm::vec3( std::numeric_limits< float >::infinity());
+			glm::vec3 max = glm::vec3(-std::numeric_limits< float >::infinity());
+			for (auto const *p : g.second) {
+				WalkMesh const *wm = walkmesh_map[p->on_walkmesh];
+				if (wm == nullptr) continue;
+				for (auto const &v : wm->vertices) {
+					min = glm::min(min, v);
+					max = glm::max(max, v);
+				}
+			}
+			if (!(min.x <= max.x)) continue;
+			cell_bounds.emplace(g.first, Scene::BoxCollider(min, max));
 		}
+		scene.assign_cells(cell_bounds);
 	}
+
+	rotate_base = scene.transforms.find("RotateBase");
 	
 	//Button scripting
 	for (auto &b : scene.buttons) {
@@ -200,7 +242,7 @@ PlayMode::PlayMode() : scene(*level_scene) {
 				//we could also init timer once (without auto start/delete) and just save a ref, but it's not a big deal
 				timers.emplace_back(0.12f, [&](float alpha){
 					float angle = b.hit ? glm::mix(0.0f, 90.0f, alpha) : glm::mix(90.0f, 0.0f, alpha);
-					b.drawable->transform->rotation = glm::angleAxis(glm::radians(angle), glm::vec3(1,0,0));
+					scene.transforms.rotation(b.drawable->transform) = glm::angleAxis(glm::radians(angle), glm::vec3(1,0,0));
 				}, [&](){
 					b.active = true;
 				});
@@ -234,13 +276,14 @@ PlayMode::PlayMode() : scene(*level_scene) {
 		
 
 		for (auto &d : scene.drawables) {
-			if (d.transform->name == "dingus") {
+			std::string const &name = scene.transforms.name(d.transform);
+			if (name == "dingus") {
 				d.pipeline.textures->texture = dingus_tex;
 			}
-			if (d.transform->name.substr(0, 5) == "Floor" || d.transform->name.substr(0, 4) == "Ceil") {
+			if (name.substr(0, 5) == "Floor" || name.substr(0, 4) == "Ceil") {
 				d.pipeline.textures->texture = wood_tex;
 			}
-			if (d.transform->name.substr(0, 4) == "Wall") {
+			if (name.substr(0, 4) == "Wall") {
 				d.pipeline.textures->texture = brick_tex;
 			}
 		}
@@ -314,6 +357,30 @@ bool PlayMode::handle_event(SDL_Event const &evt, glm::uvec2 const &window_size)
 			down_arrow.downs += 1;
 			down_arrow.pressed = true;
 			return true;
+		} else if (evt.key.keysym.sym == SDLK_F2) {
+			occlusion_toggle.downs += 1;
+			occlusion_toggle.pressed = true;
+			return true;
+		} else if (evt.key.keysym.sym == SDLK_F3) {
+			budget_toggle.downs += 1;
+			budget_toggle.pressed = true;
+			return true;
+		} else if (evt.key.keysym.sym == SDLK_F4) {
+			portal_mode_toggle.downs += 1;
+			portal_mode_toggle.pressed = true;
+			return true;
+		} else if (evt.key.keysym.sym == SDLK_F5) {
+			scale_toggle.downs += 1;
+			scale_toggle.pressed = true;
+			return true;
+		} else if (evt.key.keysym.sym == SDLK_F6) {
+			clip_toggle.downs += 1;
+			clip_toggle.pressed = true;
+			return true;
+		} else if (evt.key.keysym.sym == SDLK_F7) {
+			lod_toggle.downs += 1;
+			lod_toggle.pressed = true;
+			return true;
 		}
 	} else if (evt.type == SDL_KEYUP) {
 		if (paused) return false;
@@ -341,6 +408,24 @@ bool PlayMode::handle_event(SDL_Event const &evt, glm::uvec2 const &window_size)
 		} else if (evt.key.keysym.sym == SDLK_DOWN) {
 			down_arrow.pressed = false;
 			return true;
+		} else if (evt.key.keysym.sym == SDLK_F2) {
+			occlusion_toggle.pressed = false;
+			return true;
+		} else if (evt.key.keysym.sym == SDLK_F3) {
+			budget_toggle.pressed = false;
+			return true;
+		} else if (evt.key.keysym.sym == SDLK_F4) {
+			portal_mode_toggle.pressed = false;
+			return true;
+		} else if (evt.key.keysym.sym == SDLK_F5) {
+			scale_toggle.pressed = false;
+			return true;
+		} else if (evt.key.keysym.sym == SDLK_F6) {
+			clip_toggle.pressed = false;
+			return true;
+		} else if (evt.key.keysym.sym == SDLK_F7) {
+			lod_toggle.pressed = false;
+			return true;
 		}
 	} else if (evt.type == SDL_MOUSEBUTTONDOWN) {
 		if (SDL_GetRelativeMouseMode() == SDL_FALSE) {
@@ -373,15 +458,16 @@ bool PlayMode::handle_event(SDL_Event const &evt, glm::uvec2 const &window_size)
 				evt.motion.xrel / float(window_size.y),
 				-evt.motion.yrel / float(window_size.y)
 			);
-			glm::vec3 upDir = player.transform->make_local_to_world() * glm::vec4(0,0,1,0);
-			player.transform->rotation = glm::angleAxis(-motion.x * player.camera->fovy, upDir) * player.transform->rotation;
+			glm::vec3 upDir = scene.transforms.make_local_to_world(player.transform) * glm::vec4(0,0,1,0);
+			glm::quat &player_rotation = scene.transforms.rotation(player.transform);
+			player_rotation = glm::angleAxis(-motion.x * player.camera->fovy, upDir) * player_rotation;
 
-			float pitch = glm::pitch(player.camera->transform->rotation);
+			float pitch = glm::pitch(scene.transforms.get_rotation(player.camera->transform));
 			pitch += motion.y * player.camera->fovy;
 			//camera looks down -z (basically at the player's feet) when pitch is at zero.
 			pitch = std::min(pitch, 0.95f * 3.1415926f);
 			pitch = std::max(pitch, 0.05f * 3.1415926f);
-			player.camera->transform->rotation = glm::angleAxis(pitch, glm::vec3(1.0f, 0.0f, 0.0f));
+			scene.transforms.rotation(player.camera->transform) = glm::angleAxis(pitch, glm::vec3(1.0f, 0.0f, 0.0f));
 
 			return true;
 		}
@@ -396,15 +482,15 @@ void PlayMode::update(float elapsed) {
 	//interaction with buttons
 	constexpr float MaxButtonPollRange2 = 20.0f; //speed up checking a bit by ignoring far buttons
 	{
-		glm::mat4 const &cam_to_world = player.camera->transform->make_local_to_world();
+		glm::mat4 const &cam_to_world = scene.transforms.make_local_to_world(player.camera->transform);
 		glm::vec4 const &cam_invdir = glm::vec4(glm::vec3(1.0f / -cam_to_world[2]), 0);
 		glm::vec4 const &cam_origin = cam_to_world[3];
 
 		player.show_mouse_prompt = false;
 		for (auto &b : scene.buttons) {
 			if (!b.active) continue;
-			if (glm::distance2(glm::vec3(cam_origin), b.drawable->transform->make_local_to_world()[3]) > MaxButtonPollRange2) continue;
-			glm::mat4x3 const &b_to_local = b.drawable->transform->make_world_to_local();
+			if (glm::distance2(glm::vec3(cam_origin), scene.transforms.make_local_to_world(b.drawable->transform)[3]) > MaxButtonPollRange2) continue;
+			glm::mat4x3 const &b_to_local = scene.transforms.make_world_to_local(b.drawable->transform);
 			if (Scene::ray_bbox_hit(b.box, b_to_local * cam_invdir, b_to_local * cam_origin, 1.7f * b.range_mult)) {
 				player.show_mouse_prompt = true;
 				if (click.pressed && !click.last_pressed && b.on_pressed) b.on_pressed();
@@ -431,58 +517,17 @@ void PlayMode::update(float elapsed) {
 		
 
 		//get move in world coordinate system:
-		glm::vec3 remain = player.transform->make_local_to_world() * glm::vec4(move.x, move.y, 0.0f, 0.0f);
+		glm::vec3 remain = scene.transforms.make_local_to_world(player.transform) * glm::vec4(move.x, move.y, 0.0f, 0.0f);
 
 		if (player.uses_walkmesh) {
-			//using a for() instead of a while() here so that if walkpoint gets stuck in
-			// some awkward case, code will not infinite loop:
-			for (uint32_t iter = 0; iter < 10; ++iter) {
-				if (remain == glm::vec3(0.0f)) break;
-				WalkPoint end;
-				float time;
-				walkmesh->walk_in_triangle(player.at, remain, &end, &time);
-				player.at = end;
-				if (time == 1.0f) {
-					//finished within triangle:
-					remain = glm::vec3(0.0f);
-					break;
-				}
-				//some step remains:
-				remain *= (1.0f - time);
-				//try to step over edge:
-				glm::quat rotation;
-				if (walkmesh->cross_edge(player.at, &end, &rotation)) {
-					//stepped to a new triangle:
-					player.at = end;
-					//rotate step to follow surface:
-					remain = rotation * remain;
-				} else {
-					//ran into a wall, bounce / slide along it:
-					glm::vec3 const &a = walkmesh->vertices[player.at.indices.x];
-					glm::vec3 const &b = walkmesh->vertices[player.at.indices.y];
-					glm::vec3 const &c = walkmesh->vertices[player.at.indices.z];
-					glm::vec3 along = glm::normalize(b-a);
-					glm::vec3 normal = glm::normalize(glm::cross(b-a, c-a));
-					glm::vec3 in = glm::cross(normal, along);
-
-					//check how much 'remain' is pointing out of the triangle:
-					float d = glm::dot(remain, in);
-					if (d < 0.0f) {
-						//bounce off of the wall:
-						remain += (-1.25f * d) * in;
-					} else {
-						//if it's just pointing along the edge, bend slightly away from wall:
-						remain += 0.01f * d * in;
-					}
-				}
-			}
+			remain = walkmesh->walk(&player.at, remain);
 
 			if (remain != glm::vec3(0.0f)) {
 				std::cout << "NOTE: code used full iteration budget for walking." << std::endl;
 			}
 
 			//update player's position to respect walking:
-			player.transform->position = walkmesh->to_world_point(player.at);
+			scene.transforms.position(player.transform) = walkmesh->to_world_point(player.at);
 
 			// This stuff is nice for walking on walls and such as you can automatically rotate with the surface normal. 
 			// But in normal use it makes inclines weird (you tilt when walking up stairs). I just kept it here for possible future puzzles.
@@ -506,7 +551,7 @@ void PlayMode::update(float elapsed) {
 			*/
 		}
 		else {
-			player.transform->position += remain;
+			scene.transforms.position(player.transform) += remain;
 		}
 	}
 
@@ -521,6 +566,30 @@ void PlayMode::update(float elapsed) {
 	if (down_arrow.pressed && !down_arrow.last_pressed && scene.default_draw_recursion_max > 0) {
 		scene.default_draw_recursion_max -= 1;
 	}
+	if (occlusion_toggle.pressed && !occlusion_toggle.last_pressed) {
+		//cycle Off -> Conditional -> LastFrame -> Off:
+		scene.portal_occlusion = Scene::PortalOcclusion((uint8_t(scene.portal_occlusion) + 1) % 3);
+	}
+	if (budget_toggle.pressed && !budget_toggle.last_pressed) {
+		scene.recursion_budget.enabled = !scene.recursion_budget.enabled;
+	}
+	if (portal_mode_toggle.pressed && !portal_mode_toggle.last_pressed) {
+		scene.portal_mode = (scene.portal_mode == Scene::PortalMode::Stencil ? Scene::PortalMode::Texture : Scene::PortalMode::Stencil);
+	}
+	if (scale_toggle.pressed && !scale_toggle.last_pressed) {
+		//switch between full resolution everywhere and progressively lower resolution for deeper views:
+		if (scene.level_scales == std::vector< float >{ 1.0f }) {
+			scene.level_scales = { 1.0f, 1.0f, 0.5f, 0.5f, 0.25f };
+		} else {
+			scene.level_scales = { 1.0f };
+		}
+	}
+	if (clip_toggle.pressed && !clip_toggle.last_pressed) {
+		scene.portal_clip = (scene.portal_clip == Scene::PortalClip::ClipDistance ? Scene::PortalClip::ObliqueNear : Scene::PortalClip::ClipDistance);
+	}
+	if (lod_toggle.pressed && !lod_toggle.last_pressed) {
+		scene.lod_selection.enabled = !scene.lod_selection.enabled;
+	}
 
 	//button cleanup
 	{
@@ -534,6 +603,12 @@ void PlayMode::update(float elapsed) {
 		hide_overlay.downs = 0;
 		up_arrow.downs = 0;
 		down_arrow.downs = 0;
+		occlusion_toggle.downs = 0;
+		budget_toggle.downs = 0;
+		portal_mode_toggle.downs = 0;
+		scale_toggle.downs = 0;
+		clip_toggle.downs = 0;
+		lod_toggle.downs = 0;
 
 		//and adjust last_pressed:
 		left.last_pressed = left.pressed;
@@ -545,12 +620,18 @@ void PlayMode::update(float elapsed) {
 		hide_overlay.last_pressed = hide_overlay.pressed;
 		up_arrow.last_pressed = up_arrow.pressed;
 		down_arrow.last_pressed = down_arrow.pressed;
+		occlusion_toggle.last_pressed = occlusion_toggle.pressed;
+		budget_toggle.last_pressed = budget_toggle.pressed;
+		portal_mode_toggle.last_pressed = portal_mode_toggle.pressed;
+		scale_toggle.last_pressed = scale_toggle.pressed;
+		clip_toggle.last_pressed = clip_toggle.pressed;
+		lod_toggle.last_pressed = lod_toggle.pressed;
 	}
 
 	handle_portals();
 
 	{ //update listener to camera position:
-		glm::mat4x3 frame = player.camera->transform->make_local_to_world();
+		glm::mat4x3 frame = scene.transforms.make_local_to_world(player.camera->transform);
 		glm::vec3 frame_right = frame[0];
 		glm::vec3 frame_at = frame[3];
 		Sound::listener.set_position_right(frame_at, frame_right, 1.0f / 60.0f);
@@ -567,74 +648,31 @@ void PlayMode::update(float elapsed) {
 		}
 	}
 
+	//things moved above (e.g., RotateBase, levers) may now be in different cells:
+	scene.update_cells();
+
 }
 
 void PlayMode::handle_portals() {
 
-	for (auto const &pair : scene.portals) {
-		Scene::Portal *p = pair.second;
-		if (p->dest == nullptr) continue;
-		if (!p->active) continue;
-		
-		glm::mat4 world_to_portal = p->drawable->transform->make_world_to_local();
-		glm::vec3 offset_from_portal = world_to_portal * glm::vec4(player.transform->position, 1);
-
-		// only consider player within tracking box
-		if (!Scene::point_in_box(offset_from_portal, p->tracking_box.min, p->tracking_box.max)) {
-			p->player_tracked = false;
-			continue;
-		}
-
-		// if just entered tracking box don't tp (could have stepped out of box on side A, stepped in on side B which would pass all further checks and cause improper tp)
-		if (!p->player_tracked) {
-			p->player_tracked = true;
-			p->player_last_pos = offset_from_portal;
-			continue;
-		}
-		
-		bool now_in_front = 0 < glm::dot(offset_from_portal, glm::vec3(0,1,0));
-		// confirm player crossed portal xz plane
-		if (now_in_front == p->player_in_front) {
-			p->sleeping = false;
-			p->player_last_pos = offset_from_portal;
-			continue;
-		}
-		p->player_in_front = now_in_front;
-
-		// don't tp if sleeping, meaning we just came from this portal (could have technically crossed plane)
-		if (p->sleeping) {
-			p->sleeping = false;
-			p->player_last_pos = offset_from_portal;
-			continue;
-		}
-
-		// lastly, check if player passed through portal
-		if (Scene::line_bbox_hit(p->player_last_pos, offset_from_portal, p->tp_box.min, p->tp_box.max)) {
-			// Teleport the player (or object)
-
-			glm::mat4x3 const &dest_to_world = p->dest->drawable->transform->make_local_to_world();
-			glm::mat4 const &portal_to_dest_mat = glm::mat4(dest_to_world) * glm::mat4(world_to_portal);
+	// Move the player (and anything else registered as a traveler) through any portals it crossed
+	crossings.clear();
+	scene.step_travelers(&crossings);
 
-			player.transform->position = portal_to_dest_mat * glm::vec4(player.transform->position, 1);
-			player.transform->rotation = portal_to_dest_mat * glm::mat4(player.transform->rotation);
-			// I considered working with scale here but didn't end up getting it working and moved on from that puzzle idea anyway
+	for (auto const &c : crossings) {
+		if (c.traveler != player.traveler) continue;
+		Scene::Portal const *p = c.portal;
 
-			// Stop destination from teleporting for 1 frame (so we don't instantly return)
-			p->dest->sleeping = true;
+		// Below stuff is more specific to this game/implementation. 
 
-			// Below stuff is more specific to this game/implementation. 
+		// We only draw portals in one "active" group at a time, so when we teleport we need to activate whatever group the destination portal is in
+		scene.current_group = &scene.portal_groups[p->dest->group];
 
-			// We only draw portals in one "active" group at a time, so when we teleport we need to activate whatever group the destination portal is in
-			scene.current_group = &scene.portal_groups[p->dest->group];
-
-			// And we use walkmesh for movement so we have to make sure the current walkmesh is the one on which the destination portal sits
-			walkmesh = walkmesh_map[p->dest->on_walkmesh];
-			if (walkmesh != nullptr) {
-				player.at = walkmesh->nearest_walk_point(player.transform->position);
-			}
-			
+		// And we use walkmesh for movement so we have to make sure the current walkmesh is the one on which the destination portal sits
+		walkmesh = walkmesh_map[p->dest->on_walkmesh];
+		if (walkmesh != nullptr) {
+			player.at = walkmesh->nearest_walk_point(scene.transforms.get_position(player.transform));
 		}
-		p->player_last_pos = offset_from_portal;
 	}
 }
 
@@ -664,7 +702,7 @@ void PlayMode::draw(glm::uvec2 const &drawable_size) {
 	/* In case you are wondering if your walkmesh is lining up with your scene, try:
 	{
 		glDisable(GL_DEPTH_TEST);
-		DrawLines lines(player.camera->make_projection() * glm::mat4(player.camera->transform->make_world_to_local()));
+		DrawLines lines(player.camera->make_projection() * glm::mat4(scene.transforms.make_world_to_local(player.camera->transform)));
 		for (auto const &tri : walkmesh->triangles) {
 			lines.draw(walkmesh->vertices[tri.x], walkmesh->vertices[tri.y], glm::u8vec4(0x88, 0x00, 0xff, 0xff));
 			lines.draw(walkmesh->vertices[tri.y], walkmesh->vertices[tri.z], glm::u8vec4(0x88, 0x00, 0xff, 0xff));
@@ -714,7 +752,10 @@ void PlayMode::draw(glm::uvec2 const &drawable_size) {
 			glm::vec3(H, 0.0f, 0.0f), glm::vec3(0.0f, H, 0.0f),
 			glm::u8vec4(0xff, 0xff, 0xff, 0x00));
 			
-			std::string const &recursion_lvl = "Portal recursion count: " + std::to_string(int(scene.default_draw_recursion_max));
+			std::string const &recursion_lvl = "Portal recursion count: " + std::to_string(int(scene.default_draw_recursion_max))
+				+ (scene.recursion_budget.enabled
+					? " Budget (F3): " + std::to_string(scene.budget_stats.views) + " views, " + std::to_string(scene.budget_stats.stopped) + " stopped"
+					: std::string(" Budget (F3): off"));
 			lines.draw_text(recursion_lvl, 
 			glm::vec3(-aspect + 0.1f * H, 0.99f - 2.0f * H + ofs, 0.0f),
 			glm::vec3(H, 0.0f, 0.0f), glm::vec3(0.0f, H, 0.0f),
@@ -723,6 +764,44 @@ void PlayMode::draw(glm::uvec2 const &drawable_size) {
 			glm::vec3(-aspect + 0.1f * H + ofs, 0.99f - 2.0f * H + 2.0f * ofs, 0.0f),
 			glm::vec3(H, 0.0f, 0.0f), glm::vec3(0.0f, H, 0.0f),
 			glm::u8vec4(0xff, 0xff, 0xff, 0x00));
+
+			uint32_t total_drawn = 0, total_culled = 0;
+			for (uint32_t n : scene.cull_stats.drawn) total_drawn += n;
+			for (uint32_t n : scene.cull_stats.culled) total_culled += n;
+			uint64_t lod_drawn = 0, lod_full = 0;
+			for (uint64_t n : scene.lod_stats.drawn) lod_drawn += n;
+			for (uint64_t n : scene.lod_stats.full) lod_full += n;
+			std::string const &cull_counts = "Drawn: " + std::to_string(total_drawn) + " Culled: " + std::to_string(total_culled)
+				+ " Draw calls: " + std::to_string(scene.gl_state.draws)
+				+ " GL calls: " + std::to_string(scene.gl_state.issued) + " (skipped " + std::to_string(scene.gl_state.skipped) + ")"
+				+ (scene.lod_selection.enabled
+					? " LOD (F7): " + std::to_string(lod_full ? (100 * lod_drawn) / lod_full : 100) + "% of triangles"
+					: std::string(" LOD (F7): off"));
+			lines.draw_text(cull_counts,
+			glm::vec3(-aspect + 0.1f * H, 0.99f - 3.0f * H + 2.0f * ofs, 0.0f),
+			glm::vec3(H, 0.0f, 0.0f), glm::vec3(0.0f, H, 0.0f),
+			glm::u8vec4(0x00, 0x00, 0x00, 0x00));
+			lines.draw_text(cull_counts,
+			glm::vec3(-aspect + 0.1f * H + ofs, 0.99f - 3.0f * H + 3.0f * ofs, 0.0f),
+			glm::vec3(H, 0.0f, 0.0f), glm::vec3(0.0f, H, 0.0f),
+			glm::u8vec4(0xff, 0xff, 0xff, 0x00));
+
+			static char const *occlusion_names[3] = { "off", "conditional", "last frame" };
+			std::string const &occlusion = std::string(scene.portal_clip == Scene::PortalClip::ObliqueNear ? "Clip (F6): oblique " : "Clip (F6): distance ")
+				+ (scene.portal_mode == Scene::PortalMode::Texture
+				? "Portal mode (F4): texture Views drawn: " + std::to_string(scene.portal_view_stats.drawn)
+					+ " Reused: " + std::to_string(scene.portal_view_stats.reused)
+				: "Portal mode (F4): stencil Occlusion (F2): " + std::string(occlusion_names[uint8_t(scene.portal_occlusion)])
+					+ " Queries: " + std::to_string(scene.occlusion_stats.queries)
+					+ " Skipped: " + std::to_string(scene.occlusion_stats.skipped));
+			lines.draw_text(occlusion,
+			glm::vec3(-aspect + 0.1f * H, 0.99f - 4.0f * H + 3.0f * ofs, 0.0f),
+			glm::vec3(H, 0.0f, 0.0f), glm::vec3(0.0f, H, 0.0f),
+			glm::u8vec4(0x00, 0x00, 0x00, 0x00));
+			lines.draw_text(occlusion,
+			glm::vec3(-aspect + 0.1f * H + ofs, 0.99f - 4.0f * H + 4.0f * ofs, 0.0f),
+			glm::vec3(H, 0.0f, 0.0f), glm::vec3(0.0f, H, 0.0f),
+			glm::u8vec4(0xff, 0xff, 0xff, 0x00));
 		}
 
 	}
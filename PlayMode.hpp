@@ -31,7 +31,7 @@ struct PlayMode : Mode {
 		uint8_t downs = 0;
 		uint8_t pressed = 0;
 		uint8_t last_pressed = 0; //useful for only doing things once on press / release
-	} left, right, down, up, shift, click, hide_overlay, up_arrow, down_arrow;
+	} left, right, down, up, shift, click, hide_overlay, up_arrow, down_arrow, occlusion_toggle, budget_toggle, portal_mode_toggle, scale_toggle, clip_toggle, lod_toggle;
 
 	//local copy of the game scene (so code can change it during gameplay):
 	Scene scene;
@@ -41,9 +41,11 @@ struct PlayMode : Mode {
 		bool uses_walkmesh = true;
 		WalkPoint at;
 		//transform is at player's feet and will be yawed by mouse left/right motion:
-		Scene::Transform *transform = nullptr;
+		Scene::Transform transform;
 		//camera is at player's head and will be pitched by mouse up/down motion:
 		Scene::Camera *camera = nullptr;
+		//id in scene.travel, which takes the player through portals:
+		uint32_t traveler = -1U;
 
         bool show_mouse_prompt = false;
 	} player;
@@ -61,9 +63,12 @@ struct PlayMode : Mode {
 	std::unordered_map<std::string, WalkMesh const *> walkmesh_map;
 	WalkMesh const *walkmesh = nullptr;
 
+	//portal crossings from the last Scene::step_travelers (kept to avoid reallocating):
+	std::vector< Scene::PortalTravel::Crossing > crossings;
+
 	//----- Random scripting objects -----
 
-    Scene::Transform *rotate_base = nullptr;
+    Scene::Transform rotate_base;
 
     struct Timer {
 		Timer(float time_, std::function<void(float)> on_tick_ = {}, std::function<void()> on_finish_ = {}, bool auto_start_ = true, bool auto_delete_ = true) :
@@ -1,18 +1,21 @@
 #include "Scene.hpp"
 
 #include "gl_errors.hpp"
-#include "read_write_chunk.hpp"
+#include "gl_compile_program.hpp"
+#include "Load.hpp"
+#include "mapped_chunk.hpp"
 #include "load_save_png.hpp"
 
 #include "ColorTextureProgram.hpp"
 
 #include <glm/gtc/type_ptr.hpp>
 
-#include <fstream>
+#include <algorithm>
+#include <cmath>
 
 //-------------------------
 
-glm::mat4x3 Scene::Transform::make_local_to_parent() const {
+glm::mat4x3 Scene::Transform::make_local_to_parent(glm::vec3 const &position, glm::quat const &rotation, glm::vec3 const &scale) {
 	//compute:
 	//   translate   *   rotate    *   scale
 	// [ 1 0 0 p.x ]   [       0 ]   [ s.x 0 0 0 ]
@@ -29,7 +32,7 @@ glm::mat4x3 Scene::Transform::make_local_to_parent() const {
 	);
 }
 
-glm::mat4x3 Scene::Transform::make_parent_to_local() const {
+glm::mat4x3 Scene::Transform::make_parent_to_local(glm::vec3 const &position, glm::quat const &rotation, glm::vec3 const &scale) {
 	//compute:
 	//   1/scale       *    rot^-1   *  translate^-1
 	// [ 1/s.x 0 0 0 ]   [       0 ]   [ 0 0 0 -p.x ]
@@ -59,29 +62,155 @@ glm::mat4x3 Scene::Transform::make_parent_to_local() const {
 	);
 }
 
-glm::mat4x3 Scene::Transform::make_local_to_world() const {
-	if (!parent) {
-		return make_local_to_parent();
-	} else {
-		return parent->make_local_to_world() * glm::mat4(make_local_to_parent()); //note: glm::mat4(glm::mat4x3) pads with a (0,0,0,1) row
+//-------------------------
+
+Scene::Transform Scene::TransformStore::create(std::string const &name, Transform parent) {
+	Transform t(uint32_t(handle_to_slot.size()));
+
+	uint32_t s = size();
+	positions.emplace_back(0.0f, 0.0f, 0.0f);
+	rotations.emplace_back(1.0f, 0.0f, 0.0f, 0.0f);
+	scales.emplace_back(1.0f, 1.0f, 1.0f);
+	parents.emplace_back(parent ? slot(parent) : -1U); //new slot is last, so any parent is already before it
+	local_to_world.emplace_back(1.0f);
+	world_to_local.emplace_back(1.0f);
+	dirty.emplace_back(1);
+	world_versions.emplace_back(0);
+	first_dirty = std::min(first_dirty, s);
+
+	names.emplace_back(name);
+	handle_to_slot.emplace_back(s);
+	slot_to_handle.emplace_back(t.id);
+
+	return t;
+}
+
+Scene::Transform Scene::TransformStore::find(std::string const &name) const {
+	for (uint32_t h = 0; h < names.size(); ++h) {
+		if (names[h] == name) return Transform(h);
 	}
+	return Transform();
+}
+
+Scene::Transform Scene::TransformStore::parent(Transform t) const {
+	uint32_t p = parents[slot(t)];
+	return (p == -1U ? Transform() : Transform(slot_to_handle[p]));
 }
-glm::mat4x3 Scene::Transform::make_world_to_local() const {
+
+void Scene::TransformStore::set_parent(Transform t, Transform parent) {
+	uint32_t s = mark_dirty(t);
 	if (!parent) {
-		return make_parent_to_local();
-	} else {
-		return make_parent_to_local() * glm::mat4(parent->make_world_to_local()); //note: glm::mat4(glm::mat4x3) pads with a (0,0,0,1) row
+		parents[s] = -1U;
+		return;
+	}
+	uint32_t p = slot(parent);
+	parents[s] = p;
+	if (p > s) {
+		//parent is after child; slots must be shuffled to restore topological order:
+		sort_topologically();
 	}
 }
 
-//-------------------------
+void Scene::TransformStore::sort_topologically() {
+	//build a new slot order where every parent comes before its children, keeping existing order otherwise:
+	std::vector< uint32_t > order; //new slot -> old slot
+	order.reserve(size());
+	std::vector< uint8_t > state(size(), 0); //0: not placed, 1: being placed, 2: placed
+	std::function< void(uint32_t) > place = [&](uint32_t s) {
+		if (state[s] == 2) return;
+		if (state[s] == 1) throw std::runtime_error("transform hierarchy contains a cycle (at '" + names[slot_to_handle[s]] + "')");
+		state[s] = 1;
+		if (parents[s] != -1U) place(parents[s]);
+		state[s] = 2;
+		order.emplace_back(s);
+	};
+	for (uint32_t s = 0; s < size(); ++s) {
+		place(s);
+	}
+
+	std::vector< uint32_t > old_to_new(size());
+	for (uint32_t n = 0; n < order.size(); ++n) {
+		old_to_new[order[n]] = n;
+	}
+
+	auto permute = [&order](auto &vec) {
+		std::remove_reference_t< decltype(vec) > sorted;
+		sorted.reserve(vec.size());
+		for (uint32_t o : order) sorted.emplace_back(vec[o]);
+		vec = std::move(sorted);
+	};
+	permute(positions);
+	permute(rotations);
+	permute(scales);
+	permute(parents);
+	permute(slot_to_handle);
+	for (auto &p : parents) {
+		if (p != -1U) p = old_to_new[p];
+	}
+	for (uint32_t n = 0; n < slot_to_handle.size(); ++n) {
+		handle_to_slot[slot_to_handle[n]] = n;
+	}
+
+	//caches have moved too, so just rebuild everything on the next sweep:
+	std::fill(dirty.begin(), dirty.end(), 1);
+	first_dirty = 0;
+}
+
+glm::mat4x3 Scene::TransformStore::make_local_to_parent(Transform t) const {
+	uint32_t s = slot(t);
+	return Transform::make_local_to_parent(positions[s], rotations[s], scales[s]);
+}
+
+glm::mat4x3 Scene::TransformStore::make_parent_to_local(Transform t) const {
+	uint32_t s = slot(t);
+	return Transform::make_parent_to_local(positions[s], rotations[s], scales[s]);
+}
 
-void Scene::Transform::make_global(Transform const &from) {
-	glm::mat4x3 const &from_to_world = from.make_local_to_world();
+glm::mat4x3 Scene::TransformStore::make_local_to_world(Transform t) const {
+	uint32_t s = slot(t);
+	//slots before first_dirty can't have a dirty ancestor, since ancestors are always in earlier slots:
+	if (s >= first_dirty) update();
+	return local_to_world[s];
+}
+
+glm::mat4x3 Scene::TransformStore::make_world_to_local(Transform t) const {
+	uint32_t s = slot(t);
+	if (s >= first_dirty) update();
+	return world_to_local[s];
+}
+
+uint64_t Scene::TransformStore::world_version(Transform t) const {
+	uint32_t s = slot(t);
+	if (s >= first_dirty) update();
+	return world_versions[s];
+}
+
+void Scene::TransformStore::update() const {
+	uint32_t const count = size();
+	if (first_dirty >= count) return;
+
+	//(each sweep gets a fresh number, so versions stay unique even after slots are re-sorted)
+	sweeps += 1;
+	for (uint32_t s = first_dirty; s < count; ++s) {
+		uint32_t p = parents[s];
+		//dirtiness flows from parent to child (parent was handled earlier in this sweep):
+		if (p != -1U && dirty[p]) dirty[s] = 1;
+		if (!dirty[s]) continue;
+
+		glm::mat4x3 local_to_parent = Transform::make_local_to_parent(positions[s], rotations[s], scales[s]);
+		glm::mat4x3 parent_to_local = Transform::make_parent_to_local(positions[s], rotations[s], scales[s]);
+		if (p == -1U) {
+			local_to_world[s] = local_to_parent;
+			world_to_local[s] = parent_to_local;
+		} else {
+			local_to_world[s] = local_to_world[p] * glm::mat4(local_to_parent); //note: glm::mat4(glm::mat4x3) pads with a (0,0,0,1) row
+			world_to_local[s] = parent_to_local * glm::mat4(world_to_local[p]);
+		}
+		world_versions[s] = sweeps;
+	}
 
-	position = from_to_world[3];
-	scale = glm::vec3(glm::length(glm::vec3(from_to_world[0])), glm::length(glm::vec3(from_to_world[1])), glm::length(glm::vec3(from_to_world[2])));
-	rotation = glm::quat_cast(glm::mat3(glm::vec3(from_to_world[0]) / scale[0], glm::vec3(from_to_world[1]) / scale[1], glm::vec3(from_to_world[2]) / scale[2]));
+	std::fill(dirty.begin() + first_dirty, dirty.end(), 0);
+	first_dirty = count;
 }
 
 //-------------------------
@@ -92,38 +221,1234 @@ glm::mat4 Scene::Camera::make_projection() const {
 
 //-------------------------
 
-// gets clipping plane in the middle of this portal, facing away from view_pos
-glm::vec4 Scene::Portal::get_clipping_plane(glm::vec3 view_pos) const {
-	glm::mat4x3 const p_world = drawable->transform->make_local_to_world();
-	glm::vec3 p_forward = glm::normalize(p_world[1]);
-	glm::vec3 const p_origin = glm::vec3(p_world * glm::vec4(0,0,0,1));
-	glm::vec3 const camera_offset_from_portal = view_pos - p_origin;
-	if (glm::dot(p_forward, camera_offset_from_portal) >= 0) p_forward *= -1;
+void Scene::update_portal_frames() const {
+	//portals added, removed, or replaced since the last call? re-list them:
+	bool relist = false;
+	uint32_t with_drawable = 0;
+	for (auto const &p : portals) {
+		if (p.second == nullptr || p.second->drawable == nullptr) continue;
+		with_drawable += 1;
+		if (p.second->frame >= portal_frames.size() || portal_frames[p.second->frame].portal != p.second) relist = true;
+	}
+	if (relist || with_drawable != portal_frames.size()) {
+		portal_frames_version += 1;
+		portal_frames_listing += 1;
+		portal_frames.clear();
+		for (auto const &p : portals) {
+			if (p.second == nullptr || p.second->drawable == nullptr) continue;
+			p.second->frame = uint32_t(portal_frames.size());
+			portal_frames.emplace_back();
+			portal_frames.back().portal = p.second;
+		}
+	}
 
-	return glm::vec4(p_forward, -glm::dot(p_origin, p_forward));
+	//recompute the frames of portals that moved (or whose destinations did):
+	for (auto &f : portal_frames) {
+		Portal const &portal = *f.portal;
+		uint64_t const version = transforms.world_version(portal.drawable->transform);
+		uint64_t const dest_version = (portal.dest && portal.dest->drawable ? transforms.world_version(portal.dest->drawable->transform) : 0);
+		if (version == f.version && dest_version == f.dest_version) continue;
+
+		if (version != f.version) {
+			f.to_world = transforms.make_local_to_world(portal.drawable->transform);
+			f.to_local = transforms.make_world_to_local(portal.drawable->transform);
+			f.origin = f.to_world[3];
+			f.forward = glm::normalize(f.to_world[1]);
+			transform_box(f.to_world, portal.tp_box.min, portal.tp_box.max, &f.box_min, &f.box_max);
+			transform_box(f.to_world, portal.tracking_box.min, portal.tracking_box.max, &f.tracking_min, &f.tracking_max);
+		}
+		if (portal.dest && portal.dest->drawable) {
+			f.to_dest = glm::mat4(transforms.make_local_to_world(portal.dest->drawable->transform)) * glm::mat4(f.to_local);
+		} else {
+			f.to_dest = glm::mat4(1.0f);
+		}
+		f.version = version;
+		f.dest_version = dest_version;
+		portal_frames_version += 1;
+	}
+
+	if (portal_grid.built_version != portal_frames_version) {
+		portal_grid.build(portal_frames);
+		portal_grid.built_version = portal_frames_version;
+	}
+}
+
+void Scene::PortalGrid::build(std::vector< PortalFrame > const &frames) {
+	cells.clear();
+	for (uint32_t i = 0; i < frames.size(); ++i) {
+		glm::ivec3 const lo = cell_of(frames[i].tracking_min);
+		glm::ivec3 const hi = cell_of(frames[i].tracking_max);
+		for (int32_t z = lo.z; z <= hi.z; ++z) {
+			for (int32_t y = lo.y; y <= hi.y; ++y) {
+				for (int32_t x = lo.x; x <= hi.x; ++x) {
+					cells[key(glm::ivec3(x, y, z))].emplace_back(i);
+				}
+			}
+		}
+	}
+}
+
+std::vector< uint32_t > const &Scene::PortalGrid::near(glm::vec3 const &point) const {
+	static std::vector< uint32_t > const none;
+	auto f = cells.find(key(cell_of(point)));
+	return (f != cells.end() ? f->second : none);
+}
+
+void Scene::step_travelers(std::vector< PortalTravel::Crossing > *crossings) {
+	update_portal_frames();
+	auto &t = travel;
+	//tracks name portals by frame index, which a re-listing invalidates:
+	if (t.listing != portal_frames_listing) {
+		t.tracks.clear();
+		t.listing = portal_frames_listing;
+	}
+
+	//(1) each traveler's point in world space:
+	uint32_t const count = uint32_t(t.travelers.size());
+	t.points.resize(count);
+	for (uint32_t i = 0; i < count; ++i) {
+		if (!t.travelers[i].active) continue;
+		t.points[i] = transforms.make_local_to_world(t.travelers[i].transform) * glm::vec4(t.travelers[i].center, 1.0f);
+	}
+
+	//(2) candidate (traveler, portal) pairs from the grid, sorted like the tracks:
+	t.pairs.clear();
+	for (uint32_t i = 0; i < count; ++i) {
+		if (!t.travelers[i].active) continue;
+		size_t const begin = t.pairs.size();
+		for (uint32_t f : portal_grid.near(t.points[i])) {
+			Portal const &portal = *portal_frames[f].portal;
+			if (portal.dest == nullptr || !portal.active) continue;
+			t.pairs.emplace_back(PortalTravel::Pair{i, f});
+		}
+		std::sort(t.pairs.begin() + begin, t.pairs.end(), [](PortalTravel::Pair const &a, PortalTravel::Pair const &b) {
+			return a.frame < b.frame;
+		});
+	}
+
+	//(3) every pair's point in its portal's space (one straight loop over flat arrays):
+	t.offsets.resize(t.pairs.size());
+	for (size_t k = 0; k < t.pairs.size(); ++k) {
+		t.offsets[k] = portal_frames[t.pairs[k].frame].to_local * glm::vec4(t.points[t.pairs[k].traveler], 1.0f);
+	}
+
+	//(4) advance each pair's tracking state, picking up last step's state by merging the two sorted lists
+	// (pairs that are no longer near each other just drop out):
+	auto before = [](uint32_t traveler_a, uint32_t frame_a, uint32_t traveler_b, uint32_t frame_b) {
+		return traveler_a < traveler_b || (traveler_a == traveler_b && frame_a < frame_b);
+	};
+	t.crossed.clear();
+	t.next_tracks.clear();
+	size_t old = 0;
+	for (size_t k = 0; k < t.pairs.size(); ++k) {
+		PortalTravel::Pair const &pair = t.pairs[k];
+		glm::vec3 const &offset = t.offsets[k];
+		while (old < t.tracks.size() && before(t.tracks[old].traveler, t.tracks[old].frame, pair.traveler, pair.frame)) ++old;
+
+		PortalTravel::Track track{pair.traveler, pair.frame, offset, 0, 0, 0};
+		if (old < t.tracks.size() && t.tracks[old].traveler == pair.traveler && t.tracks[old].frame == pair.frame) {
+			track = t.tracks[old];
+		}
+		Portal *portal = portal_frames[pair.frame].portal;
+
+		if (!point_in_box(offset, portal->tracking_box.min, portal->tracking_box.max)) {
+			// only consider travelers within the tracking box
+			track.tracked = 0;
+		} else if (!track.tracked) {
+			// if just entered tracking box don't tp (could have stepped out of box on side A, stepped in on side B which would pass all further checks and cause improper tp)
+			track.tracked = 1;
+		} else {
+			uint8_t const now_in_front = (offset.y > 0.0f ? 1 : 0);
+			if (now_in_front == track.in_front) {
+				// didn't cross the portal's xz plane
+				track.sleeping = 0;
+			} else {
+				track.in_front = now_in_front;
+				if (track.sleeping) {
+					// don't tp if sleeping, meaning we just came from this portal (could have technically crossed plane)
+					track.sleeping = 0;
+				} else if (line_bbox_hit(track.last_pos, offset, portal->tp_box.min, portal->tp_box.max)) {
+					// crossed the plane within the portal itself
+					t.crossed.emplace_back(PortalTravel::Crossing{pair.traveler, portal});
+				}
+			}
+		}
+		track.last_pos = offset;
+		t.next_tracks.emplace_back(track);
+	}
+	std::swap(t.tracks, t.next_tracks);
+
+	//(5) teleport (at most once per traveler per step):
+	uint32_t last_traveler = -1U;
+	for (auto const &c : t.crossed) {
+		if (c.traveler == last_traveler) continue;
+		last_traveler = c.traveler;
+
+		glm::mat4 const &portal_to_dest_mat = portal_frame(*c.portal).to_dest;
+		Transform const transform = t.travelers[c.traveler].transform;
+		glm::vec3 &position = transforms.position(transform);
+		glm::quat &rotation = transforms.rotation(transform);
+		position = portal_to_dest_mat * glm::vec4(position, 1);
+		rotation = portal_to_dest_mat * glm::mat4(rotation);
+		// I considered working with scale here but didn't end up getting it working and moved on from that puzzle idea anyway
+
+		// Stop destination from teleporting this traveler for 1 frame (so it doesn't instantly return)
+		uint32_t const dest_frame = c.portal->dest->frame;
+		auto at = std::lower_bound(t.tracks.begin(), t.tracks.end(), c.traveler, [&](PortalTravel::Track const &a, uint32_t traveler) {
+			return before(a.traveler, a.frame, traveler, dest_frame);
+		});
+		if (at == t.tracks.end() || at->traveler != c.traveler || at->frame != dest_frame) {
+			at = t.tracks.insert(at, PortalTravel::Track{c.traveler, dest_frame, glm::vec3(0.0f), 0, 0, 0});
+		}
+		at->sleeping = 1;
+
+		if (crossings) crossings->emplace_back(c);
+	}
 }
 
 //-------------------------
 
+// plane extraction as per Gribb & Hartmann, "Fast Extraction of Viewing Frustum Planes from the World-View-Projection Matrix"
+Scene::Frustum::Frustum(glm::mat4 const &world_to_clip) {
+	//rows of the matrix:
+	glm::mat4 const rows = glm::transpose(world_to_clip);
+	planes[0] = rows[3] + rows[0]; //left:   -w <= x
+	planes[1] = rows[3] - rows[0]; //right:   x <= w
+	planes[2] = rows[3] + rows[1]; //bottom: -w <= y
+	planes[3] = rows[3] - rows[1]; //top:     y <= w
+	planes[4] = rows[3] + rows[2]; //near:   -w <= z
+	planes[5] = rows[3] - rows[2]; //far:     z <= w
+}
+
+Scene::Frustum::Frustum(glm::mat4 const &world_to_clip, ScreenRect const &rect) : Frustum(world_to_clip) {
+	glm::mat4 const rows = glm::transpose(world_to_clip);
+	planes[0] = rows[0] - rect.min.x * rows[3]; //left:   min.x * w <= x
+	planes[1] = rect.max.x * rows[3] - rows[0]; //right:  x <= max.x * w
+	planes[2] = rows[1] - rect.min.y * rows[3]; //bottom: min.y * w <= y
+	planes[3] = rect.max.y * rows[3] - rows[1]; //top:    y <= max.y * w
+}
+
+//-------------------------
+
+void Scene::update_bounds() const {
+	for (auto const &drawable : drawables) {
+		if (!drawable.has_bounds()) continue;
+		transform_box(transforms.make_local_to_world(drawable.transform), drawable.min, drawable.max, &drawable.world_min, &drawable.world_max);
+	}
+}
+
+void Scene::assign_cells(std::unordered_map< std::string, BoxCollider > const &bounds) {
+	update_transforms();
+	update_bounds();
+
+	//cells given by scene data, via an ancestor named after a portal group:
+	for (auto &drawable : drawables) {
+		if (!drawable.cell.empty()) continue;
+		for (Transform t = drawable.transform; t; t = transforms.parent(t)) {
+			if (portal_groups.count(transforms.name(t))) {
+				drawable.cell = transforms.name(t);
+				break;
+			}
+		}
+	}
+
+	//each cell covers its portals and the drawables named into it, along with whatever the caller knows about:
+	cell_bounds = bounds;
+	auto grow = [&](std::string const &cell, glm::vec3 const &min, glm::vec3 const &max) {
+		auto f = cell_bounds.find(cell);
+		if (f == cell_bounds.end()) {
+			cell_bounds.emplace(cell, BoxCollider(min, max));
+		} else {
+			f->second.min = glm::min(f->second.min, min);
+			f->second.max = glm::max(f->second.max, max);
+		}
+	};
+	for (auto const &g : portal_groups) {
+		for (Portal const *portal : g.second) {
+			if (portal == nullptr || portal->drawable == nullptr) continue;
+			PortalFrame const &f = portal_frame(*portal);
+			grow(g.first, f.box_min, f.box_max);
+		}
+	}
+	for (auto const &drawable : drawables) {
+		if (drawable.cell.empty() || !drawable.has_bounds()) continue;
+		grow(drawable.cell, drawable.world_min, drawable.world_max);
+	}
+
+	//place everything else from scratch:
+	for (auto &drawable : drawables) {
+		drawable.bounded_cells.clear();
+		drawable.bounded_cells_version = -1ULL;
+	}
+	update_cells();
+	rebuild_cells();
+}
+
+bool Scene::update_cells() {
+	if (cell_bounds.empty()) return false;
+	update_transforms();
+
+	bool changed = false;
+	for (auto &drawable : drawables) {
+		if (!drawable.cell.empty() || !drawable.has_bounds()) continue;
+		uint64_t const version = transforms.world_version(drawable.transform);
+		if (version == drawable.bounded_cells_version) continue;
+		drawable.bounded_cells_version = version;
+
+		glm::vec3 world_min, world_max;
+		transform_box(transforms.make_local_to_world(drawable.transform), drawable.min, drawable.max, &world_min, &world_max);
+		//(cell_bounds isn't modified here, so it iterates in the same order every time and lists can be compared directly)
+		uint32_t count = 0;
+		bool same = true;
+		for (auto const &cb : cell_bounds) {
+			BoxCollider const &box = cb.second;
+			if (!(glm::all(glm::lessThanEqual(world_min, box.max)) && glm::all(glm::lessThanEqual(box.min, world_max)))) continue;
+			if (count < drawable.bounded_cells.size()) {
+				if (drawable.bounded_cells[count] != cb.first) {
+					same = false;
+					drawable.bounded_cells[count] = cb.first;
+				}
+			} else {
+				same = false;
+				drawable.bounded_cells.emplace_back(cb.first);
+			}
+			count += 1;
+		}
+		if (count != drawable.bounded_cells.size()) {
+			same = false;
+			drawable.bounded_cells.resize(count);
+		}
+		if (!same) changed = true;
+	}
+
+	if (changed) rebuild_cells();
+	return changed;
+}
+
+void Scene::rebuild_cells() {
+	cells.clear();
+	shared_drawables.clear();
+	for (auto const &drawable : drawables) {
+		if (!drawable.cell.empty()) {
+			cells[drawable.cell].emplace_back(&drawable);
+		} else if (!drawable.bounded_cells.empty()) {
+			for (auto const &cell : drawable.bounded_cells) {
+				cells[cell].emplace_back(&drawable);
+			}
+		} else {
+			shared_drawables.emplace_back(&drawable);
+		}
+	}
+}
+
+//-------------------------
+
+void Scene::GLStateCache::invalidate() {
+	program = Unknown;
+	vao = Unknown;
+	active_unit = Unknown;
+	for (auto &t : textures) {
+		t.target = GL_TEXTURE_2D;
+		t.texture = Unknown;
+	}
+	clip_distances = 0xff;
+	vertex_decode.clear();
+	issued = 0;
+	skipped = 0;
+	draws = 0;
+}
+
+void Scene::GLStateCache::reset() {
+	for (uint32_t i = 0; i < Drawable::Pipeline::TextureCount + 2; ++i) {
+		if (textures[i].texture != 0) bind_texture(i, textures[i].target, 0);
+	}
+	if (active_unit != 0) {
+		glActiveTexture(GL_TEXTURE0);
+		active_unit = 0;
+		++issued;
+	}
+	use_program(0);
+	bind_vertex_array(0);
+	set_clip_distances(0);
+}
+
+void Scene::GLStateCache::use_program(GLuint program_) {
+	if (program == program_) {
+		++skipped;
+		return;
+	}
+	glUseProgram(program_);
+	program = program_;
+	++issued;
+}
+
+void Scene::GLStateCache::bind_vertex_array(GLuint vao_) {
+	if (vao == vao_) {
+		++skipped;
+		return;
+	}
+	glBindVertexArray(vao_);
+	vao = vao_;
+	++issued;
+}
+
+void Scene::GLStateCache::bind_texture(uint32_t unit, GLenum target, GLuint texture) {
+	assert(unit < Drawable::Pipeline::TextureCount + 2);
+	if (textures[unit].texture == texture && textures[unit].target == target) {
+		++skipped;
+		return;
+	}
+	if (active_unit != unit) {
+		glActiveTexture(GL_TEXTURE0 + unit);
+		active_unit = unit;
+		++issued;
+	}
+	//binding a different target leaves the old one bound, so unbind it first:
+	if (textures[unit].target != target && textures[unit].texture != 0) {
+		glBindTexture(textures[unit].target, 0);
+		++issued;
+	}
+	glBindTexture(target, texture);
+	textures[unit].target = target;
+	textures[unit].texture = texture;
+	++issued;
+}
+
+void Scene::GLStateCache::set_clip_distances(uint8_t count) {
+	assert(count <= 2);
+	if (clip_distances == count) {
+		++skipped;
+		return;
+	}
+	for (uint8_t i = 0; i < 2; ++i) {
+		bool const want = (i < count);
+		if (clip_distances == 0xff || want != (i < clip_distances)) {
+			if (want) glEnable(GL_CLIP_DISTANCE0 + i);
+			else glDisable(GL_CLIP_DISTANCE0 + i);
+			++issued;
+		}
+	}
+	clip_distances = count;
+}
+
+void Scene::GLStateCache::set_vertex_decode(Drawable::Pipeline const &pipeline) {
+	assert(program == pipeline.program);
+	auto f = vertex_decode.find(pipeline.program);
+	bool const known = (f != vertex_decode.end());
+	VertexDecode &current = (known ? f->second : vertex_decode[pipeline.program]);
+
+	if (pipeline.POSITION_OFFSET_vec3 != -1U) {
+		if (known && current.position_offset == pipeline.position_offset) {
+			++skipped;
+		} else {
+			glUniform3fv(pipeline.POSITION_OFFSET_vec3, 1, glm::value_ptr(pipeline.position_offset));
+			++issued;
+		}
+	}
+	if (pipeline.POSITION_SCALE_vec3 != -1U) {
+		if (known && current.position_scale == pipeline.position_scale) {
+			++skipped;
+		} else {
+			glUniform3fv(pipeline.POSITION_SCALE_vec3, 1, glm::value_ptr(pipeline.position_scale));
+			++issued;
+		}
+	}
+	if (pipeline.OCTAHEDRAL_NORMALS_bool != -1U) {
+		if (known && current.octahedral_normals == pipeline.octahedral_normals) {
+			++skipped;
+		} else {
+			glUniform1i(pipeline.OCTAHEDRAL_NORMALS_bool, pipeline.octahedral_normals ? 1 : 0);
+			++issued;
+		}
+	}
+	current.position_offset = pipeline.position_offset;
+	current.position_scale = pipeline.position_scale;
+	current.octahedral_normals = pipeline.octahedral_normals;
+}
+
+void Scene::RenderQueue::push(Drawable const &drawable, uint32_t lod) {
+	Drawable::Pipeline const &pipeline = drawable.pipeline;
+	//most-expensive-to-change state in the high bits; GL object names are small integers, so 16 bits each is plenty
+	// (textures past the second only break ties, since no scene here uses them)
+	uint64_t key =
+		  (uint64_t(pipeline.program & 0xffff) << 48)
+		| (uint64_t(pipeline.vao & 0xffff) << 32)
+		| (uint64_t(pipeline.textures[0].texture & 0xffff) << 16)
+		| (uint64_t(pipeline.textures[1].texture & 0xffff));
+	items.emplace_back(Item{key, &drawable, lod});
+}
+
+void Scene::RenderQueue::sort() {
+	//stable, so drawables with the same state keep scene order (and frames don't flicker between equal-key orders):
+	// (within a key, group by mesh so instanced runs are as long as possible)
+	std::stable_sort(items.begin(), items.end(), [](Item const &a, Item const &b){
+		if (a.key != b.key) return a.key < b.key;
+		if (a.drawable->pipeline.start != b.drawable->pipeline.start) return a.drawable->pipeline.start < b.drawable->pipeline.start;
+		if (a.drawable->pipeline.count != b.drawable->pipeline.count) return a.drawable->pipeline.count < b.drawable->pipeline.count;
+		return a.lod < b.lod;
+	});
+}
+
+bool Scene::can_batch(Drawable::Pipeline const &a, Drawable::Pipeline const &b) {
+	//only programs that read per-object data can be instanced, and custom uniforms can't be shared:
+	if (a.OBJECT_INDEX_int == -1U || a.set_uniforms || b.set_uniforms) return false;
+	if (a.program != b.program || a.vao != b.vao) return false;
+	if (a.type != b.type || a.start != b.start || a.count != b.count || a.index_type != b.index_type) return false;
+	if (a.position_offset != b.position_offset || a.position_scale != b.position_scale || a.octahedral_normals != b.octahedral_normals) return false;
+	if (a.OBJECT_INDEX_int != b.OBJECT_INDEX_int || a.SELF_CLIP_PLANE_vec4 != b.SELF_CLIP_PLANE_vec4) return false;
+	for (uint32_t i = 0; i < Drawable::Pipeline::TextureCount; ++i) {
+		if (a.textures[i].texture != b.textures[i].texture || a.textures[i].target != b.textures[i].target) return false;
+	}
+	return true;
+}
+
+void Scene::draw_render_queue(glm::mat4 const &world_to_clip, glm::mat4x3 const &world_to_light, uint8_t clip_plane_count, glm::vec4 const &clip_plane) const {
+	render_queue.sort();
+	auto &items = render_queue.items;
+	auto &runs = render_queue.runs;
+	auto &instances = render_queue.instances;
+
+	//find runs of batchable drawables, and list their objects for the instance buffer:
+	runs.clear();
+	instances.clear();
+	for (size_t begin = 0; begin < items.size(); ) {
+		size_t end = begin + 1;
+		while (end < items.size() && items[begin].lod == items[end].lod && can_batch(items[begin].drawable->pipeline, items[end].drawable->pipeline)) ++end;
+		runs.emplace_back(RenderQueue::Run{begin, end, uint32_t(instances.size())});
+		if (end - begin > 1) {
+			for (size_t i = begin; i < end; ++i) {
+				instances.emplace_back(int32_t(items[i].drawable->object_index));
+			}
+		}
+		begin = end;
+	}
+
+	if (!instances.empty()) {
+		if (instance_data_buffer == 0) {
+			glGenBuffers(1, &instance_data_buffer);
+			glGenTextures(1, &instance_data_tex);
+			glBindBuffer(GL_TEXTURE_BUFFER, instance_data_buffer);
+			glBindTexture(GL_TEXTURE_BUFFER, instance_data_tex);
+			glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, instance_data_buffer);
+			glBindTexture(GL_TEXTURE_BUFFER, 0);
+			glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		}
+		glBindBuffer(GL_TEXTURE_BUFFER, instance_data_buffer);
+		glBufferData(GL_TEXTURE_BUFFER, instances.size() * sizeof(int32_t), instances.data(), GL_STREAM_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		gl_state.issued += 1;
+		gl_state.bind_texture(InstanceDataUnit, GL_TEXTURE_BUFFER, instance_data_tex);
+	}
+
+	for (auto const &run : runs) {
+		Drawable const &first = *items[run.begin].drawable;
+		uint32_t const lod = items[run.begin].lod;
+		if (run.end - run.begin == 1) {
+			draw_one(first, world_to_clip, world_to_light, clip_plane_count, clip_plane, glm::vec4(0), 0, 0, lod);
+		} else {
+			draw_one(first, world_to_clip, world_to_light, clip_plane_count, clip_plane, glm::vec4(0), uint32_t(run.end - run.begin), run.instance_base, lod);
+		}
+	}
+
+	render_queue.clear();
+}
+
+void Scene::upload_object_data() const {
+	if (object_data_buffer == 0) {
+		glGenBuffers(1, &object_data_buffer);
+		glGenTextures(1, &object_data_tex);
+		glBindBuffer(GL_TEXTURE_BUFFER, object_data_buffer);
+		glBindTexture(GL_TEXTURE_BUFFER, object_data_tex);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, object_data_buffer);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	}
+
+	object_data.clear();
+	pipeline_data.clear();
+	auto add = [this](Drawable const &drawable) {
+		drawable.object_index = uint32_t(object_data.size() / ObjectDataTexels);
+		Drawable::Pipeline const &pipeline = drawable.pipeline;
+		pipeline_data.insert(pipeline_data.end(), { pipeline.program, pipeline.vao, pipeline.start, pipeline.count });
+		for (auto const &t : pipeline.textures) {
+			pipeline_data.emplace_back(t.texture);
+		}
+		glm::mat4x3 const object_to_world = transforms.make_local_to_world(drawable.transform);
+		//(the inverse-transpose is done here, once per object per frame, rather than per draw)
+		glm::mat3 const normal_to_world = glm::inverse(glm::transpose(glm::mat3(object_to_world)));
+		glm::mat3x4 const rows = glm::transpose(object_to_world);
+		object_data.emplace_back(rows[0]);
+		object_data.emplace_back(rows[1]);
+		object_data.emplace_back(rows[2]);
+		object_data.emplace_back(normal_to_world[0], 0.0f);
+		object_data.emplace_back(normal_to_world[1], 0.0f);
+		object_data.emplace_back(normal_to_world[2], 0.0f);
+	};
+	for (auto const &drawable : drawables) {
+		add(drawable);
+	}
+	for (auto const &p : portals) {
+		if (p.second->drawable) add(*p.second->drawable);
+	}
+
+	//anything that moved or now draws differently means cached portal views may be out of date:
+	if (object_data != previous_object_data || pipeline_data != previous_pipeline_data) contents_version += 1;
+	std::swap(object_data, previous_object_data);
+	std::swap(pipeline_data, previous_pipeline_data);
+	auto const &data = previous_object_data;
+
+	//(re-specifying the whole store each frame lets the driver hand back fresh memory instead of waiting on last frame's draws)
+	glBindBuffer(GL_TEXTURE_BUFFER, object_data_buffer);
+	glBufferData(GL_TEXTURE_BUFFER, data.size() * sizeof(glm::vec4), data.data(), GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void Scene::set_view(glm::mat4 const &world_to_clip, glm::vec4 const &clip_plane) const {
+	if (view_current && world_to_clip == current_view_world_to_clip && clip_plane == current_view_clip_plane) {
+		++gl_state.skipped;
+		return;
+	}
+	current_view_world_to_clip = world_to_clip;
+	current_view_clip_plane = clip_plane;
+	view_current = true;
+
+	struct {
+		glm::mat4 world_to_clip;
+		glm::vec4 clip_plane;
+	} data{world_to_clip, clip_plane};
+	static_assert(sizeof(data) == 4*16 + 16, "View block matches std140 layout");
+
+	glBindBuffer(GL_UNIFORM_BUFFER, view_buffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(data), &data);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	++gl_state.issued;
+}
+
+glm::mat4 Scene::portal_transfer(Portal const &portal) const {
+	assert(portal.dest);
+	return portal_frame(portal).to_dest;
+}
+
+// Lengyel, "Oblique View Frustum Depth Projection and Clipping"
+// http://www.terathon.com/lengyel/Lengyel-Oblique.pdf
+glm::mat4 Scene::view_projection(glm::mat4 const &cam_projection, glm::mat4x3 const &cam_to_world, glm::vec4 const &clip_plane, bool *oblique) const {
+	assert(oblique);
+	*oblique = false;
+	if (portal_clip != PortalClip::ObliqueNear) return cam_projection;
+
+	//clipping plane in camera space (planes transform by the inverse transpose, i.e., by cam_to_world from the left):
+	glm::vec4 const plane = glm::transpose(glm::mat4(cam_to_world)) * clip_plane;
+	//the camera has to be behind the plane, or the near plane would face the wrong way:
+	if (!(plane.w < 0.0f)) return cam_projection;
+
+	//far corner of the frustum on the plane's side, in camera space:
+	glm::vec4 const q = glm::inverse(cam_projection) * glm::vec4(
+		plane.x < 0.0f ? -1.0f : 1.0f,
+		plane.y < 0.0f ? -1.0f : 1.0f,
+		1.0f, 1.0f
+	);
+	float const along = glm::dot(plane, q);
+	if (!(along > 0.0f)) return cam_projection;
+
+	//scale the plane so the far plane still passes through that corner, then make it the near plane
+	// (the near plane is row 4 + row 3 of the projection, so row 3 becomes plane - row 4):
+	glm::vec4 const c = plane * (2.0f / along);
+	glm::mat4 projection = cam_projection;
+	for (uint32_t col = 0; col < 4; ++col) {
+		projection[col][2] = c[col] - projection[col][3];
+	}
+	*oblique = true;
+	return projection;
+}
+
+//-------------------------
+// Texture portal mode
+
+void Scene::OffscreenTarget::release() {
+	if (framebuffer != 0) glDeleteFramebuffers(1, &framebuffer);
+	if (color_tex != 0) glDeleteTextures(1, &color_tex);
+	if (depth_rb != 0) glDeleteRenderbuffers(1, &depth_rb);
+	framebuffer = color_tex = depth_rb = 0;
+	size = glm::uvec2(0);
+}
+
+void Scene::prepare_target(OffscreenTarget &target, glm::uvec2 const &size) const {
+	if (target.framebuffer != 0 && target.size == size) return;
+
+	if (target.framebuffer == 0) {
+		glGenFramebuffers(1, &target.framebuffer);
+		glGenTextures(1, &target.color_tex);
+		glGenRenderbuffers(1, &target.depth_rb);
+	}
+	target.size = size;
+
+	//(texture binds go through gl_state so it stays in sync with what's bound)
+	gl_state.bind_texture(0, GL_TEXTURE_2D, target.color_tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size.x, size.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	gl_state.bind_texture(0, GL_TEXTURE_2D, 0);
+
+	glBindRenderbuffer(GL_RENDERBUFFER, target.depth_rb);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, size.x, size.y);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.color_tex, 0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, target.depth_rb);
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		throw std::runtime_error("Offscreen framebuffer is incomplete (status " + std::to_string(status) + ").");
+	}
+}
+
+void Scene::draw_portal_texture(Portal const &portal, OffscreenTarget const *target, glm::mat4 const &world_to_clip, glm::vec4 const &clip_plane, glm::vec3 const &cam_position, glm::vec4 const &viewport) const {
+	Drawable const &mesh = *portal.drawable;
+	glm::vec4 const portal_clip_plane = portal_frame(portal).clipping_plane(cam_position);
+	if (mesh.pipeline.PORTAL_VIEWPORT_vec4 == -1U) {
+		draw_one(mesh, world_to_clip, glm::mat4x3(1.0f), 2, clip_plane, portal_clip_plane);
+		return;
+	}
+
+	gl_state.use_program(mesh.pipeline.program);
+	glUniform4fv(mesh.pipeline.PORTAL_VIEWPORT_vec4, 1, glm::value_ptr(viewport));
+	draw_one(mesh, world_to_clip, glm::mat4x3(1.0f), 2, clip_plane, portal_clip_plane, 0, 0, 0, (target ? target->color_tex : blank_view_tex));
+	//(uniforms stick to the program, so put it back for everything else drawn with it)
+	glUniform4fv(mesh.pipeline.PORTAL_VIEWPORT_vec4, 1, glm::value_ptr(glm::vec4(0.0f)));
+	gl_state.issued += 2;
+}
+
+//clip-space transform that stretches 'rect' (in normalized device coordinates) over the whole view:
+static glm::mat4 crop_to(Scene::ScreenRect const &rect) {
+	glm::vec2 const scale = 2.0f / (rect.max - rect.min);
+	glm::vec2 const center = 0.5f * (rect.min + rect.max);
+	glm::mat4 crop(1.0f);
+	crop[0][0] = scale.x;
+	crop[1][1] = scale.y;
+	crop[3][0] = -center.x * scale.x;
+	crop[3][1] = -center.y * scale.y;
+	return crop;
+}
+
+void Scene::draw_textured(glm::mat4 const &cam_projection, glm::mat4x3 const &cam_to_world, glm::vec4 const &clip_plane, GLint max_recursion_lvl) const {
+	assert(current_group);
+	frame_number += 1;
+	portal_view_stats = PortalViewStats();
+
+	glm::uvec2 const size = glm::uvec2(std::max(1, draw_viewport.z), std::max(1, draw_viewport.w));
+
+	//views are drawn whole, with no stencil masking:
+	glDisable(GL_SCISSOR_TEST);
+	glDisable(GL_STENCIL_TEST);
+	glStencilMask(0x00);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glDepthMask(GL_TRUE);
+	glEnable(GL_DEPTH_TEST);
+	glDepthFunc(GL_LESS);
+
+	GLfloat clear_color[4];
+	glGetFloatv(GL_COLOR_CLEAR_VALUE, clear_color);
+	{ //portals with no view show the clear color:
+		glm::u8vec4 const texel = glm::u8vec4(glm::round(glm::clamp(glm::vec4(clear_color[0], clear_color[1], clear_color[2], clear_color[3]), 0.0f, 1.0f) * 255.0f));
+		if (blank_view_tex == 0) glGenTextures(1, &blank_view_tex);
+		gl_state.bind_texture(0, GL_TEXTURE_2D, blank_view_tex);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, &texel);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		gl_state.bind_texture(0, GL_TEXTURE_2D, 0);
+	}
+
+	//---- gather the views needed this frame, breadth-first (so deeper views come later) ----
+	// Each view's projection is cropped to the rectangle of the portal it is seen through,
+	//  so its image only needs as many pixels as that rectangle covers.
+	struct Seen {
+		Portal const *portal;
+		ScreenRect rect; //in the viewing node's normalized device coordinates
+		uint32_t node; //view drawn through it (0 if none)
+	};
+	struct ViewNode {
+		PortalPath path; //portals crossed to get here (empty for the camera's own view)
+		Portal const *from; //portal this view looks out of
+		GLint level;
+		glm::mat4x3 cam_to_world;
+		glm::mat4 crop; //camera-view normalized device coordinates -> this view's
+		glm::mat4 world_to_clip;
+		glm::vec4 clip_plane;
+		bool oblique; //clip_plane is the near plane of world_to_clip (so no clip distances needed)
+		glm::vec2 full_extent; //size (in camera-view pixels) of the region this view covers
+		glm::uvec2 extent; //size of this view's image
+		std::vector< Portal * > const *portals;
+		std::string const *cell;
+		std::vector< Seen > visible; //portals to draw in this view
+		PortalView *view; //cache entry (null for the camera's own view)
+	};
+	std::vector< ViewNode > nodes;
+
+	nodes.emplace_back(ViewNode{
+		PortalPath(), nullptr, 0,
+		cam_to_world, glm::mat4(1.0f), cam_projection * glm::inverse(glm::mat4(cam_to_world)), clip_plane, false,
+		glm::vec2(size), size,
+		current_group, (current_group->empty() ? nullptr : &current_group->front()->group), {}, nullptr
+	});
+
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		//(copy out what's needed, since adding nodes may move 'nodes')
+		Frustum const frustum(nodes[i].world_to_clip);
+		for (auto const *p : *nodes[i].portals) {
+			if (p == nodes[i].from) continue;
+			if (p->dest == nullptr) continue;
+			if (!p->active) continue;
+			if (!is_portal_visible(frustum, *p)) continue;
+			ScreenRect const p_rect = get_portal_rect(nodes[i].world_to_clip, *p, ScreenRect());
+			if (p_rect.empty()) continue;
+			nodes[i].visible.emplace_back(Seen{p, p_rect, 0});
+
+			//views past the depth cap, the budget, or the pool get the clear color:
+			if (nodes[i].level > max_recursion_lvl) continue;
+			if (nodes.size() > max_portal_views) continue;
+			glm::vec2 const full_extent = 0.5f * (p_rect.max - p_rect.min) * nodes[i].full_extent;
+			if (recursion_budget.enabled && !open_portal_view(full_extent.x * full_extent.y)) continue;
+
+			glm::mat4x3 const new_cam_to_world = portal_transfer(*p) * glm::mat4(nodes[i].cam_to_world);
+			glm::vec4 const new_clip_plane = portal_frame(*p->dest).clipping_plane(new_cam_to_world[3]);
+			bool oblique = false;
+			glm::mat4 const projection = view_projection(cam_projection, new_cam_to_world, new_clip_plane, &oblique);
+			glm::mat4 const crop = crop_to(p_rect) * nodes[i].crop;
+			GLint const level = nodes[i].level + 1;
+			PortalPath path = nodes[i].path;
+			path.emplace_back(p);
+
+			nodes[i].visible.back().node = uint32_t(nodes.size());
+			nodes.emplace_back(ViewNode{
+				std::move(path), p->dest, level,
+				new_cam_to_world, crop, crop * projection * glm::inverse(glm::mat4(new_cam_to_world)), new_clip_plane, oblique,
+				full_extent, glm::max(glm::uvec2(1), glm::uvec2(glm::ceil(full_extent * level_scale(level)))),
+				&portal_groups.at(p->dest->group), &p->dest->group, {}, nullptr
+			});
+		}
+	}
+
+	//---- hand out pooled targets to this frame's views ----
+	for (size_t i = 1; i < nodes.size(); ++i) {
+		nodes[i].view = &portal_views[nodes[i].path];
+		nodes[i].view->used_frame = frame_number;
+	}
+	std::vector< bool > target_taken(portal_view_targets.size(), false);
+	for (auto const &pv : portal_views) {
+		if (pv.second.target != -1U) target_taken[pv.second.target] = true;
+	}
+	for (size_t i = 1; i < nodes.size(); ++i) {
+		PortalView &view = *nodes[i].view;
+		if (view.target == -1U) {
+			//a free target, else a new one, else one held by a view not wanted this frame (oldest first):
+			auto free = std::find(target_taken.begin(), target_taken.end(), false);
+			if (free != target_taken.end()) {
+				view.target = uint32_t(free - target_taken.begin());
+			} else if (portal_view_targets.size() < max_portal_views) {
+				view.target = uint32_t(portal_view_targets.size());
+				portal_view_targets.emplace_back();
+				target_taken.emplace_back(false);
+			} else {
+				PortalView *oldest = nullptr;
+				for (auto &pv : portal_views) {
+					if (pv.second.target == -1U || pv.second.used_frame == frame_number) continue;
+					if (!oldest || pv.second.used_frame < oldest->used_frame) oldest = &pv.second;
+				}
+				//(at most max_portal_views views are wanted per frame, so someone else holds a target)
+				assert(oldest);
+				view.target = oldest->target;
+				oldest->target = -1U;
+			}
+			target_taken[view.target] = true;
+			view.serial = 0; //(nothing drawn in this target yet)
+		}
+		//targets only grow (in steps, so views changing size a little don't reallocate them):
+		OffscreenTarget &target = portal_view_targets[view.target];
+		glm::uvec2 const want = glm::max(target.size, (nodes[i].extent + glm::uvec2(63)) / 64U * 64U);
+		if (want != target.size) {
+			prepare_target(target, want);
+			//(reallocating dropped the image, for every view drawn in it)
+			for (auto &pv : portal_views) {
+				if (pv.second.target == view.target) pv.second.serial = 0;
+			}
+		}
+	}
+
+	//what to show in a portal seen from a view ('origin' and 'extent' place the viewing image in its framebuffer):
+	auto draw_view_contents = [&](ViewNode const &node, glm::vec2 const &origin, glm::vec2 const &extent) {
+		draw_non_portals(node.world_to_clip, Frustum(node.world_to_clip), node.level, node.cell, glm::mat4x3(1.0f), !node.oblique, node.clip_plane);
+		for (auto const &seen : node.visible) {
+			OffscreenTarget const *target = nullptr;
+			glm::vec4 viewport = glm::vec4(0.0f);
+			if (seen.node != 0) {
+				ViewNode const &shown = nodes[seen.node];
+				target = &portal_view_targets[shown.view->target];
+				//the portal's rectangle (in window coordinates) shows the lower-left 'extent' texels of the target:
+				glm::vec2 const rect_origin = origin + (0.5f * seen.rect.min + 0.5f) * extent;
+				glm::vec2 const rect_size = 0.5f * (seen.rect.max - seen.rect.min) * extent;
+				glm::vec2 const target_span = rect_size * glm::vec2(target->size) / glm::vec2(shown.extent); //(window-space size of the whole target)
+				viewport = glm::vec4(rect_origin.x, rect_origin.y, target_span.x, target_span.y);
+			}
+			draw_portal_texture(*seen.portal, target, node.world_to_clip, node.clip_plane, node.cam_to_world[3], viewport);
+		}
+	};
+
+	//---- draw portal views, deepest first, reusing any that haven't changed ----
+	GLint prev_framebuffer = 0;
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &prev_framebuffer);
+
+	for (size_t i = nodes.size() - 1; i > 0; --i) {
+		ViewNode const &node = nodes[i];
+		PortalView &view = *node.view;
+
+		uint64_t sampled_serial = 0;
+		for (auto const &seen : node.visible) {
+			if (seen.node != 0) sampled_serial = std::max(sampled_serial, nodes[seen.node].view->serial);
+		}
+
+		bool same_camera = true;
+		for (uint32_t c = 0; c < 4; ++c) {
+			glm::vec4 const d = glm::abs(view.world_to_clip[c] - node.world_to_clip[c]);
+			if (glm::max(glm::max(d.x, d.y), glm::max(d.z, d.w)) > portal_view_tolerance) same_camera = false;
+		}
+		if (view.serial != 0 && same_camera && view.clip_plane == node.clip_plane && view.extent == node.extent
+		 && view.contents_version == contents_version && sampled_serial <= view.sampled_serial) {
+			portal_view_stats.reused += 1;
+			continue;
+		}
+
+		glBindFramebuffer(GL_FRAMEBUFFER, portal_view_targets[view.target].framebuffer);
+		glViewport(0, 0, node.extent.x, node.extent.y);
+		glEnable(GL_SCISSOR_TEST);
+		glScissor(0, 0, node.extent.x, node.extent.y);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glDisable(GL_SCISSOR_TEST);
+		draw_view_contents(node, glm::vec2(0.0f), glm::vec2(node.extent));
+
+		view.extent = node.extent;
+		view.world_to_clip = node.world_to_clip;
+		view.clip_plane = node.clip_plane;
+		view.contents_version = contents_version;
+		view.sampled_serial = sampled_serial;
+		view.serial = ++portal_view_serial;
+		portal_view_stats.drawn += 1;
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, prev_framebuffer);
+	glViewport(draw_viewport.x, draw_viewport.y, draw_viewport.z, draw_viewport.w);
+
+	//---- and the camera's own view ----
+	draw_view_contents(nodes[0], glm::vec2(draw_viewport.x, draw_viewport.y), glm::vec2(size));
+
+	//forget views nobody has looked through in a while (their targets go back to the pool):
+	for (auto f = portal_views.begin(); f != portal_views.end(); ) {
+		if (f->second.used_frame + 120 < frame_number) {
+			f = portal_views.erase(f);
+		} else {
+			++f;
+		}
+	}
+}
+
+float Scene::level_scale(GLint level) const {
+	if (level_scales.empty()) return 1.0f;
+	float scale = level_scales[std::min(size_t(std::max(level, 0)), level_scales.size() - 1)];
+	return glm::clamp(scale, 1.0f / 64.0f, 1.0f);
+}
+
+//copies a texture in screen space (for compositing reduced-resolution views; drawn with full_tri_program.vao):
+struct CopyTextureProgram {
+	GLuint program = 0;
+	GLuint VIEWPORT_vec4 = -1U;
+	//(TEX is left at its default, texture unit 0)
+};
+
+static Load< CopyTextureProgram > copy_texture_program(LoadTagEarly, []() -> CopyTextureProgram const * {
+	CopyTextureProgram *ret = new CopyTextureProgram();
+	ret->program = gl_compile_program(
+		"#version 330\n"
+		"void main() {\n"
+		"	float x,y;\n"
+		"	x = -1.0 + float((gl_VertexID & 1) << 2);\n"
+		"	y = -1.0 + float((gl_VertexID & 2) << 1);\n"
+		"	gl_Position = vec4(x, y, 0.0, 1.0);\n"
+		"}\n"
+	,
+		"#version 330\n"
+		"uniform sampler2D TEX;\n"
+		"uniform vec4 VIEWPORT;\n"
+		"out vec4 fragColor;\n"
+		"void main() {\n"
+		"	fragColor = texture(TEX, (gl_FragCoord.xy - VIEWPORT.xy) / VIEWPORT.zw);\n"
+		"}\n"
+	);
+	ret->VIEWPORT_vec4 = glGetUniformLocation(ret->program, "VIEWPORT");
+	return ret;
+});
+
+void Scene::draw_scaled(float scale, glm::mat4 const &cam_projection, glm::mat4x3 const &new_cam_to_world, glm::vec4 const &new_clip_plane,
+	GLint recursion_lvl, GLint max_recursion_lvl, Portal const *dest, ScreenRect const &p_rect, GLuint query, uint32_t plan_node) const {
+
+	if (scaled_targets.size() <= scaled_depth) scaled_targets.resize(scaled_depth + 1);
+	OffscreenTarget &target = scaled_targets[scaled_depth];
+	glm::uvec2 const size = glm::max(glm::uvec2(1), glm::uvec2(glm::ceil(glm::vec2(root_viewport.z, root_viewport.w) * scale)));
+	prepare_target(target, size);
+	//(nested calls may grow scaled_targets, so don't hold on to 'target' past this point)
+	GLuint const target_framebuffer = target.framebuffer;
+	GLuint const target_color_tex = target.color_tex;
+
+	//remember where we were drawing:
+	GLint prev_framebuffer = 0;
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &prev_framebuffer);
+	glm::ivec4 const prev_viewport = draw_viewport;
+	GLint const prev_level_offset = level_offset;
+	float const prev_target_scale = target_scale;
+
+	//draw into the (cleared, only within the portal's rectangle) reduced target as if it were a fresh screen:
+	glBindFramebuffer(GL_FRAMEBUFFER, target_framebuffer);
+	draw_viewport = glm::ivec4(0, 0, size.x, size.y);
+	glViewport(0, 0, size.x, size.y);
+	set_scissor(p_rect);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glDepthMask(GL_TRUE);
+	glStencilMask(0xFF);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+	glStencilMask(0x00);
+
+	GLint const view_lvl = level_offset + recursion_lvl + 1;
+	level_offset = view_lvl;
+	target_scale = scale;
+	scaled_depth += 1;
+	bool oblique = false;
+	glm::mat4 const new_world_to_clip = view_projection(cam_projection, new_cam_to_world, new_clip_plane, &oblique) * glm::inverse(glm::mat4(new_cam_to_world));
+	if (recursion_lvl == max_recursion_lvl) {
+		// Base case: just the objects
+		glDisable(GL_STENCIL_TEST);
+		glEnable(GL_DEPTH_TEST);
+		glDepthFunc(GL_LESS);
+		draw_non_portals(new_world_to_clip, Frustum(new_world_to_clip, p_rect), view_lvl, &dest->group, glm::mat4x3(1.0f), !oblique, new_clip_plane);
+		glEnable(GL_STENCIL_TEST);
+	} else {
+		// The rest of the recursion, starting over at level 0 of this target
+		draw(cam_projection, new_cam_to_world, new_clip_plane, max_recursion_lvl - recursion_lvl - 1, 0, dest, p_rect, 0, plan_node);
+	}
+	scaled_depth -= 1;
+	target_scale = prev_target_scale;
+	level_offset = prev_level_offset;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, prev_framebuffer);
+	draw_viewport = prev_viewport;
+	glViewport(draw_viewport.x, draw_viewport.y, draw_viewport.z, draw_viewport.w);
+	set_scissor(p_rect);
+
+	// Composite into the portal's stencil region (no depth: the portal surface is written into depth right after)
+	glEnable(GL_STENCIL_TEST);
+	glStencilFunc(GL_EQUAL, recursion_lvl + 1, 0xFF);
+	glStencilMask(0x00);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glDepthMask(GL_FALSE);
+	glDisable(GL_DEPTH_TEST);
+	if (query) glBeginConditionalRender(query, GL_QUERY_WAIT);
+	gl_state.use_program(copy_texture_program->program);
+	gl_state.bind_vertex_array(full_tri_program.vao);
+	gl_state.bind_texture(0, GL_TEXTURE_2D, target_color_tex);
+	glUniform4fv(copy_texture_program->VIEWPORT_vec4, 1, glm::value_ptr(glm::vec4(draw_viewport)));
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	gl_state.issued += 2;
+	gl_state.draws += 1;
+	if (query) glEndConditionalRender();
+	glEnable(GL_DEPTH_TEST);
+	glDepthMask(GL_TRUE);
+}
+
+bool Scene::open_portal_view(float pixels) const {
+	if (pixels < recursion_budget.min_pixels) {
+		budget_stats.stopped += 1;
+		return false;
+	}
+	return open_planned_view();
+}
+
+bool Scene::open_planned_view() const {
+	bool open = budget_stats.views < recursion_budget.max_views;
+	if (open && recursion_budget.max_milliseconds > 0.0f) {
+		float elapsed = std::chrono::duration< float, std::milli >(std::chrono::steady_clock::now() - draw_start).count();
+		open = elapsed < recursion_budget.max_milliseconds;
+	}
+	if (open) budget_stats.views += 1;
+	else budget_stats.stopped += 1;
+	return open;
+}
+
+void Scene::plan_recursion(glm::mat4 const &cam_projection, glm::mat4x3 const &cam_to_world, glm::vec4 const &clip_plane, GLint max_recursion_lvl) const {
+	budget_plan.clear();
+	budget_plan_links.clear();
+	if (current_group == nullptr) return;
+	budget_plan.emplace_back(BudgetPlanNode{nullptr, 0, cam_to_world, clip_plane, ScreenRect()});
+
+	uint32_t planned = 0;
+	size_t level_begin = 0;
+	for (GLint level = 0; level <= max_recursion_lvl && level_begin < budget_plan.size(); ++level) {
+		size_t const level_end = budget_plan.size();
+
+		//every portal seen from this level's views (with the same tests draw() makes):
+		budget_plan_candidates.clear();
+		for (size_t n = level_begin; n < level_end; ++n) {
+			BudgetPlanNode const &node = budget_plan[n];
+			bool oblique = false;
+			glm::mat4 const world_to_clip = (node.from == nullptr ? cam_projection : view_projection(cam_projection, node.cam_to_world, node.clip_plane, &oblique)) * glm::inverse(glm::mat4(node.cam_to_world));
+			Frustum const frustum(world_to_clip, node.view_rect);
+			std::vector< Portal * > const &local_portals = (node.from == nullptr ? *current_group : portal_groups.at(node.from->group));
+			for (auto const *p : local_portals) {
+				if (p == node.from) continue;
+				if (p->dest == nullptr) continue;
+				if (!p->active) continue;
+				if (!is_portal_visible(frustum, *p)) continue;
+				ScreenRect const p_rect = get_portal_rect(world_to_clip, *p, node.view_rect);
+				if (p_rect.empty()) continue;
+				if (portal_occlusion == PortalOcclusion::LastFrame) {
+					auto f = portal_queries.find(PortalSpot{node.from, p, level});
+					if (f != portal_queries.end() && !f->second.visible) continue;
+				}
+				glm::vec2 const px = 0.5f * (p_rect.max - p_rect.min) * glm::vec2(root_viewport.z, root_viewport.w);
+				budget_plan_candidates.emplace_back(BudgetPlanCandidate{uint32_t(n), p, p_rect, px.x * px.y});
+			}
+		}
+
+		//...of which the biggest get the budget:
+		std::stable_sort(budget_plan_candidates.begin(), budget_plan_candidates.end(), [](BudgetPlanCandidate const &a, BudgetPlanCandidate const &b) {
+			return a.pixels > b.pixels;
+		});
+		for (auto const &c : budget_plan_candidates) {
+			if (c.pixels < recursion_budget.min_pixels || planned >= recursion_budget.max_views) break;
+			planned += 1;
+			glm::mat4x3 const new_cam_to_world = portal_transfer(*c.portal) * glm::mat4(budget_plan[c.parent].cam_to_world);
+			glm::vec4 const new_clip_plane = portal_frame(*c.portal->dest).clipping_plane(new_cam_to_world[3]);
+			budget_plan_links.emplace_back(BudgetPlanLink{c.parent, c.portal, uint32_t(budget_plan.size())});
+			budget_plan.emplace_back(BudgetPlanNode{c.portal->dest, level + 1, new_cam_to_world, new_clip_plane, c.rect});
+		}
+
+		level_begin = level_end;
+	}
+}
+
+uint32_t Scene::planned_view(uint32_t plan_node, Portal const *portal) const {
+	//(links are capped by max_views, so a scan is fine)
+	for (auto const &link : budget_plan_links) {
+		if (link.parent == plan_node && link.portal == portal) return link.child;
+	}
+	return NotPlanned;
+}
+
+GLuint Scene::acquire_portal_query(PortalSpot const &key) const {
+	PortalQueries &pq = portal_queries[key];
+	if (pq.used == pq.queries.size()) {
+		pq.queries.emplace_back(0);
+		glGenQueries(1, &pq.queries.back());
+	}
+	occlusion_stats.queries += 1;
+	return pq.queries[pq.used++];
+}
+
+void Scene::collect_portal_queries() const {
+	for (auto &entry : portal_queries) {
+		PortalQueries &pq = entry.second;
+		if (portal_occlusion == PortalOcclusion::LastFrame && pq.used > 0) {
+			pq.visible = false;
+			for (uint32_t i = 0; i < pq.used && !pq.visible; ++i) {
+				GLuint available = GL_FALSE;
+				glGetQueryObjectuiv(pq.queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+				//results that aren't in yet count as visible, rather than waiting on the GPU:
+				GLuint result = GL_TRUE;
+				if (available) glGetQueryObjectuiv(pq.queries[i], GL_QUERY_RESULT, &result);
+				pq.visible = (result != GL_FALSE);
+			}
+		} else {
+			//not queried last frame (or not using the results): nothing is known, so draw it
+			pq.visible = true;
+		}
+		pq.used = 0;
+	}
+}
+
 void Scene::draw(Camera const &camera) const {
+	draw(camera, transforms);
+}
+
+void Scene::draw(Camera const &camera, TransformStore const &camera_transforms) const {
 	assert(camera.transform);
-	glm::mat4x3 const cam_to_world = camera.transform->make_local_to_world();
+	//rebuild any stale world matrices (and bounds) once, up front, so the recursive draw below only reads caches:
+	update_transforms();
+	update_bounds();
+	update_portal_frames();
+	cull_stats.reset();
+	lod_stats.reset();
+
+	//remember the viewport so portal screen rectangles can be turned into scissor boxes:
+	glGetIntegerv(GL_VIEWPORT, glm::value_ptr(draw_viewport));
+	root_viewport = draw_viewport;
+	glEnable(GL_SCISSOR_TEST);
+	set_scissor(ScreenRect());
+
+	//whatever was bound before isn't known, so the first binds of the frame always go through:
+	gl_state.invalidate();
+
+	budget_stats = BudgetStats();
+	draw_start = std::chrono::steady_clock::now();
+
+	occlusion_stats = OcclusionStats();
+	collect_portal_queries();
+
+	//per-object transforms, written once for every view this frame:
+	upload_object_data();
+	gl_state.bind_texture(ObjectDataUnit, GL_TEXTURE_BUFFER, object_data_tex);
+
+	//per-view block, rewritten as draws move between views:
+	if (view_buffer == 0) {
+		glGenBuffers(1, &view_buffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, view_buffer);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(glm::mat4) + sizeof(glm::vec4), nullptr, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+	glBindBufferBase(GL_UNIFORM_BUFFER, ViewBlockBinding, view_buffer);
+	view_current = false;
+
+	glm::mat4x3 const cam_to_world = camera_transforms.make_local_to_world(camera.transform);
 	glm::vec4 const clip_plane = glm::vec4(-cam_to_world[2], 
 		-glm::dot(cam_to_world * glm::vec4(0,0,0,1), -cam_to_world[2]));
-	Transform cam_transform = Transform();
-	cam_transform.make_global(*camera.transform);
 
-	draw(camera.make_projection(), cam_transform, clip_plane, default_draw_recursion_max);
+	if (portal_mode == PortalMode::Texture && current_group != nullptr) {
+		draw_textured(camera.make_projection(), cam_to_world, clip_plane, default_draw_recursion_max);
+	} else {
+		if (recursion_budget.enabled) plan_recursion(camera.make_projection(), cam_to_world, clip_plane, default_draw_recursion_max);
+		draw(camera.make_projection(), cam_to_world, clip_plane, default_draw_recursion_max);
+	}
+
+	//leave nothing bound, as the rest of the code expects:
+	gl_state.reset();
+	glBindBufferBase(GL_UNIFORM_BUFFER, ViewBlockBinding, 0);
+	glDisable(GL_SCISSOR_TEST);
+
+	GL_ERRORS();
 }
 
 // https://th0mas.nl/2013/05/19/rendering-recursive-portals-with-opengl/
 // https://github.com/ThomasRinsma/opengl-game-test/blob/8363bbf/src/scene.cc
-void Scene::draw(glm::mat4 const &cam_projection, Transform const &cam_transform, glm::vec4 const &clip_plane, GLint max_recursion_lvl, GLint recursion_lvl, Portal const *from) const {
+void Scene::draw(glm::mat4 const &cam_projection, glm::mat4x3 const &cam_to_world, glm::vec4 const &clip_plane, GLint max_recursion_lvl, GLint recursion_lvl, Portal const *from, ScreenRect const &view_rect, GLuint entry_query, uint32_t plan_node) const {
 
 	//Calculate world_to_clip and world_to_light matrices for this case
-	glm::mat4 const &world_to_clip = cam_projection * glm::mat4(cam_transform.make_world_to_local());
+	glm::vec3 const cam_position = cam_to_world[3];
+	// (views out of a portal may fold its clipping plane into the projection instead of clipping against it per vertex)
+	bool oblique = false;
+	glm::mat4 const &world_to_clip = (from == nullptr ? cam_projection : view_projection(cam_projection, cam_to_world, clip_plane, &oblique)) * glm::inverse(glm::mat4(cam_to_world));
 	static glm::mat4x3 const &world_to_light = glm::mat4x3(1.0f);
 
+	//this view can only be seen through view_rect, so cull (and scissor) against just that part of the screen:
+	Frustum const frustum(world_to_clip, view_rect);
+
 	// rare instance in which no current_group provided, so don't draw any portals
 	if (from == nullptr && current_group == nullptr) {
 		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
@@ -131,19 +1456,68 @@ void Scene::draw(glm::mat4 const &cam_projection, Transform const &cam_transform
 		glStencilMask(0x00);
 		glEnable(GL_DEPTH_TEST);
 		glDisable(GL_STENCIL_TEST);
-		draw_non_portals(world_to_clip, world_to_light, true, clip_plane);
+		draw_non_portals(world_to_clip, frustum, recursion_lvl, nullptr, world_to_light, !oblique, clip_plane);
 		return; //probably shouldn't happen, but maybe we'll want sometimes
 	}
 
 	std::vector<Portal*> const &local_portals = from == nullptr ? *current_group : portal_groups.at(from->group);
-	
+	// The cell this view is in is the one its portals belong to
+	std::string const *cell = from != nullptr ? &from->group : (local_portals.empty() ? nullptr : &local_portals.front()->group);
+
+	// Portals to occlusion-query once this level is drawn (PortalOcclusion::LastFrame)
+	std::vector< Portal const * > to_query;
+
+	// Gather the portals that can be seen from here, with their screen rectangles
+	// (with a budget, plan_recursion has already sized them up, in the camera's pixels)
+	struct Candidate {
+		Portal const *portal;
+		ScreenRect rect;
+	};
+	std::vector< Candidate > candidates;
 	for (auto const *p : local_portals) {
 		if (p == from) continue;
 		if (p->dest == nullptr) continue;
 		if (!p->active) continue;
-		if (!is_portal_visible(world_to_clip, *p)) continue;
+		if (!is_portal_visible(frustum, *p)) continue;
+
+		ScreenRect const p_rect = get_portal_rect(world_to_clip, *p, view_rect);
+		if (p_rect.empty()) continue;
+
+		// Skip portals that were completely hidden from this spot last frame
+		// (they still get queried below, so they come back as soon as they show)
+		if (portal_occlusion == PortalOcclusion::LastFrame) {
+			to_query.emplace_back(p);
+			auto f = portal_queries.find(PortalSpot{from, p, level_offset + recursion_lvl});
+			if (f != portal_queries.end() && !f->second.visible) {
+				occlusion_stats.skipped += 1;
+				continue;
+			}
+		}
+
+		candidates.emplace_back(Candidate{p, p_rect});
+	}
+
+	for (auto const &candidate : candidates) {
+		Portal const *p = candidate.portal;
+		ScreenRect const &p_rect = candidate.rect;
+
+		// Should we look through this portal, or just fill it with the clear color?
+		// (with a budget, plan_recursion already decided, breadth-first; only the view count and time limit are checked here)
+		uint32_t const child = (recursion_budget.enabled ? planned_view(plan_node, p) : NotPlanned);
+		bool open = true;
+		if (recursion_budget.enabled) {
+			if (child != NotPlanned) {
+				open = open_planned_view();
+			} else {
+				open = false;
+				budget_stats.stopped += 1;
+			}
+		}
 
-		glm::vec4 const &p_clip_plane = p->get_clipping_plane(cam_transform.position);
+		// Everything until we come back out of this portal happens within its screen rectangle
+		set_scissor(p_rect);
+
+		glm::vec4 const &p_clip_plane = portal_frame(*p).clipping_plane(cam_position);
 
 		// Disable color and depth drawing
 		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
@@ -169,7 +1543,14 @@ void Scene::draw(glm::mat4 const &cam_projection, Transform const &cam_transform
 		glStencilMask(0xFF);
 
 		// Draw portal into stencil buffer
+		// (counting the samples that made it, so the GPU can skip everything behind a hidden portal)
+		GLuint query = 0;
+		if (portal_occlusion == PortalOcclusion::Conditional) {
+			query = acquire_portal_query(PortalSpot{from, p, level_offset + recursion_lvl});
+			glBeginQuery(GL_ANY_SAMPLES_PASSED, query);
+		}
 		draw_one(*p->drawable, world_to_clip, world_to_light, 2, clip_plane, p_clip_plane);
+		if (query) glEndQuery(GL_ANY_SAMPLES_PASSED);
 
 		// Enable color and enable depth drawing
 		// (We enable color because draw_fullscreen_tri will also set the inside of portal to the clear color)
@@ -196,7 +1577,9 @@ void Scene::draw(glm::mat4 const &cam_projection, Transform const &cam_transform
 		// Now set depth range to (1,1), leaving a "hole" for new objects through the portal.
 		// This way we effectively clear depth only inside the portal.
 		glDepthRange(1, 1);
+		if (query) glBeginConditionalRender(query, GL_QUERY_WAIT);
 		draw_fullscreen_tri();
+		if (query) glEndConditionalRender();
 
 		// Cleanup from depth clear hack
 		glDepthRange(0, 1);
@@ -204,23 +1587,39 @@ void Scene::draw(glm::mat4 const &cam_projection, Transform const &cam_transform
 
 
 		// Calculate new camera transform as if player was already teleported
-		glm::mat4 const &portal_dest_mat = glm::mat4(p->dest->drawable->transform->make_local_to_world()) * glm::mat4(p->drawable->transform->make_world_to_local());
-		Transform const &new_cam_transform = Transform(portal_dest_mat * glm::vec4(cam_transform.position, 1), 
-			portal_dest_mat * glm::mat4(cam_transform.rotation), cam_transform.scale);
-		glm::mat4 const &new_world_to_clip = cam_projection * glm::mat4(new_cam_transform.make_world_to_local());
+		glm::mat4 const &portal_dest_mat = portal_transfer(*p);
+		glm::mat4x3 const &new_cam_to_world = portal_dest_mat * glm::mat4(cam_to_world);
+		glm::vec3 const new_cam_position = new_cam_to_world[3];
+		glm::vec4 const new_clip_plane = portal_frame(*p->dest).clipping_plane(new_cam_position);
 
-		if (recursion_lvl == max_recursion_lvl) {
+		if (!open) {
+			// Out of budget (or too small to matter): the clear fill above is all this portal shows
+		}
+		else if (level_scale(level_offset + recursion_lvl + 1) < target_scale) {
+			// Draw the view (and everything inside it) at reduced resolution, then composite it into the stencil region
+			draw_scaled(level_scale(level_offset + recursion_lvl + 1), cam_projection, new_cam_to_world, new_clip_plane,
+				recursion_lvl, max_recursion_lvl, p->dest, p_rect, query, child);
+		}
+		else if (recursion_lvl == max_recursion_lvl) {
 			// Base case, render inside of inner portal
 
 			// Draw scene objects with destView, limited to stencil buffer
-			// use an edited projection matrix to set the near plane to the portal plane
-			draw_non_portals(new_world_to_clip, world_to_light, true, p->dest->get_clipping_plane(new_cam_transform.position));
+			// (PortalClip::ObliqueNear uses an edited projection matrix to set the near plane to the portal plane)
+			bool new_oblique = false;
+			glm::mat4 const new_world_to_clip = view_projection(cam_projection, new_cam_to_world, new_clip_plane, &new_oblique) * glm::inverse(glm::mat4(new_cam_to_world));
+			if (query) glBeginConditionalRender(query, GL_QUERY_WAIT);
+			draw_non_portals(new_world_to_clip, Frustum(new_world_to_clip, p_rect), recursion_lvl + 1, &p->dest->group, world_to_light, !new_oblique, new_clip_plane);
+			if (query) glEndConditionalRender();
 		}
 		else {
 			// Recursion case
 
 			// Pass our new view matrix and the clipped projection matrix (see above)
-			draw(cam_projection, new_cam_transform, p->dest->get_clipping_plane(new_cam_transform.position), max_recursion_lvl, recursion_lvl + 1, p->dest);
+			// (conditional rendering can't nest, so the next level applies the query to its own non-recursive parts)
+			draw(cam_projection, new_cam_to_world, new_clip_plane, max_recursion_lvl, recursion_lvl + 1, p->dest, p_rect, query, child);
+
+			// (recursion moves the scissor around, so restore it for the cleanup below)
+			set_scissor(p_rect);
 		}
 
 		// Disable color drawing
@@ -245,10 +1644,14 @@ void Scene::draw(glm::mat4 const &cam_projection, Transform const &cam_transform
 		glStencilOp(GL_KEEP, GL_KEEP, GL_DECR);
 		
 		// Draw portal into depth and stencil buffer
+		if (query) glBeginConditionalRender(query, GL_QUERY_WAIT);
 		draw_one(*p->drawable, world_to_clip, world_to_light, 2, clip_plane, p_clip_plane);
+		if (query) glEndConditionalRender();
 
 		// Reset depth func to less
 		glDepthFunc(GL_LESS);
+
+		set_scissor(view_rect);
 	}
 
 	// Draw at stencil >= recursionlevel
@@ -265,16 +1668,99 @@ void Scene::draw(glm::mat4 const &cam_projection, Transform const &cam_transform
 	glEnable(GL_DEPTH_TEST);
 
 	// Draw scene objects normally, only at recursionLevel
-	draw_non_portals(world_to_clip, world_to_light, true, clip_plane);
+	if (entry_query) glBeginConditionalRender(entry_query, GL_QUERY_WAIT);
+	draw_non_portals(world_to_clip, frustum, recursion_lvl, cell, world_to_light, !oblique, clip_plane);
+	if (entry_query) glEndConditionalRender();
+
+	// Now that everything at this level is in the depth buffer, check which portals can actually be seen
+	// (only where this level shows, and against the portal's own depth where it was drawn, hence LEQUAL)
+	if (!to_query.empty()) {
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		glDepthMask(GL_FALSE);
+		glEnable(GL_STENCIL_TEST);
+		glStencilFunc(GL_EQUAL, recursion_lvl, 0xFF);
+		glDepthFunc(GL_LEQUAL);
+		for (auto const *p : to_query) {
+			GLuint query = acquire_portal_query(PortalSpot{from, p, level_offset + recursion_lvl});
+			glBeginQuery(GL_ANY_SAMPLES_PASSED, query);
+			draw_one(*p->drawable, world_to_clip, world_to_light, 2, clip_plane, portal_frame(*p).clipping_plane(cam_position));
+			glEndQuery(GL_ANY_SAMPLES_PASSED);
+		}
+		glDepthFunc(GL_LESS);
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		glDepthMask(GL_TRUE);
+	}
 }
 
-void Scene::draw_non_portals(glm::mat4 const &world_to_clip, glm::mat4x3 const &world_to_light, bool const &use_clip, glm::vec4 const &clip_plane) const {
-	for (auto const &drawable : drawables) {
-		draw_one(drawable, world_to_clip, world_to_light, use_clip, clip_plane);
+void Scene::draw_non_portals(glm::mat4 const &world_to_clip, Frustum const &frustum, GLint recursion_lvl, std::string const *cell, glm::mat4x3 const &world_to_light, bool const &use_clip, glm::vec4 const &clip_plane) const {
+	bool const has_clip_plane = (clip_plane != glm::vec4(0.0f));
+	//pixels per world unit at unit distance: the projection's vertical scale (the y row of world_to_clip, which oblique
+	// clipping leaves alone) times half the viewport height:
+	float const pixel_scale = glm::length(glm::vec3(world_to_clip[0][1], world_to_clip[1][1], world_to_clip[2][1])) * 0.5f * float(draw_viewport.w);
+	auto draw_culled = [&](Drawable const &drawable) {
+		if (drawable.has_bounds() && (!frustum.intersects_box(drawable.world_min, drawable.world_max)
+		 || (has_clip_plane && box_behind_plane(clip_plane, drawable.world_min, drawable.world_max)))) {
+			cull_stats.count(recursion_lvl, true);
+			return;
+		}
+		cull_stats.count(recursion_lvl, false);
+		uint32_t const lod = select_lod(drawable, world_to_clip, pixel_scale, level_offset + recursion_lvl);
+		Drawable::Pipeline const &pipeline = drawable.pipeline;
+		lod_stats.count(recursion_lvl, (lod ? pipeline.lods[lod - 1].count : pipeline.count) / 3, pipeline.count / 3);
+		render_queue.push(drawable, lod);
+	};
+
+	//collect what survives culling, then draw it sorted (and batched) by GL state:
+	render_queue.clear();
+	auto flush = [&]() {
+		draw_render_queue(world_to_clip, world_to_light, use_clip ? 1 : 0, clip_plane);
+	};
+
+	//no cell (or cells not built yet): draw everything
+	if (cell == nullptr || (cells.empty() && shared_drawables.empty())) {
+		for (auto const &drawable : drawables) {
+			draw_culled(drawable);
+		}
+		flush();
+		return;
 	}
+
+	for (auto const *drawable : shared_drawables) {
+		draw_culled(*drawable);
+	}
+	auto f = cells.find(*cell);
+	if (f != cells.end()) {
+		for (auto const *drawable : f->second) {
+			draw_culled(*drawable);
+		}
+	}
+	flush();
+}
+
+uint32_t Scene::select_lod(Drawable const &drawable, glm::mat4 const &world_to_clip, float pixel_scale, GLint recursion_lvl) const {
+	Drawable::Pipeline const &pipeline = drawable.pipeline;
+	if (!lod_selection.enabled || pipeline.lod_count == 0 || !drawable.has_bounds()) return 0;
+
+	//distance along the view direction to the nearest the bounds could be:
+	glm::vec3 const center = 0.5f * (drawable.world_min + drawable.world_max);
+	float const radius = 0.5f * glm::length(drawable.world_max - drawable.world_min);
+	float const depth = (world_to_clip * glm::vec4(center, 1.0f)).w - radius;
+	if (depth <= 0.0f) return 0; //(bounds reach the camera)
+
+	//errors are in object space, so scale them by the largest axis scale of the drawable's transform:
+	glm::mat4x3 const to_world = transforms.make_local_to_world(drawable.transform);
+	float const object_scale = std::max(glm::length(to_world[0]), std::max(glm::length(to_world[1]), glm::length(to_world[2])));
+
+	float const pixels_per_unit = object_scale * pixel_scale / depth;
+	float const allowed = lod_selection.max_error_pixels * std::pow(lod_selection.level_factor, float(recursion_lvl));
+	uint32_t lod = 0;
+	while (lod < pipeline.lod_count && pipeline.lods[lod].error * pixels_per_unit <= allowed) {
+		++lod;
+	}
+	return lod;
 }
 
-void Scene::draw_one(Drawable const &drawable, glm::mat4 const &world_to_clip, glm::mat4x3 const &world_to_light, uint8_t const &clip_plane_count, glm::vec4 const &clip_plane, glm::vec4 const &self_clip_plane) const {
+void Scene::draw_one(Drawable const &drawable, glm::mat4 const &world_to_clip, glm::mat4x3 const &world_to_light, uint8_t const &clip_plane_count, glm::vec4 const &clip_plane, glm::vec4 const &self_clip_plane, uint32_t instance_count, uint32_t instance_base, uint32_t lod, GLuint texture0) const {
 	//Reference to drawable's pipeline for convenience:
 	Scene::Drawable::Pipeline const &pipeline = drawable.pipeline;
 
@@ -285,98 +1771,112 @@ void Scene::draw_one(Drawable const &drawable, glm::mat4 const &world_to_clip, g
 	//skip any drawables that don't contain any vertices:
 	if (pipeline.count == 0) return;
 
-	if (clip_plane_count > 1){
-		glEnable(GL_CLIP_DISTANCE1);
-		glEnable(GL_CLIP_DISTANCE0);
-	}
-	else if (clip_plane_count > 0) {
-		glEnable(GL_CLIP_DISTANCE0);
-	}
-
+	//(all binds go through gl_state, which skips the ones that wouldn't change anything)
+	gl_state.set_clip_distances(clip_plane_count);
 
 	//Set shader program:
-	glUseProgram(pipeline.program);
+	gl_state.use_program(pipeline.program);
 
 	//Set attribute sources:
-	glBindVertexArray(pipeline.vao);
+	gl_state.bind_vertex_array(pipeline.vao);
 
 	//Configure program uniforms:
 
-	//the object-to-world matrix is used in all three of these uniforms:
-	assert(drawable.transform); //drawables *must* have a transform
-	glm::mat4x3 object_to_world = drawable.transform->make_local_to_world();
+	if (pipeline.OBJECT_INDEX_int != -1U) {
+		//transforms come from the per-view block and per-object buffer, so only the index changes per draw:
+		set_view(world_to_clip, clip_plane);
+		//(a negative index points the program at this draw's run in the instance buffer)
+		glUniform1i(pipeline.OBJECT_INDEX_int, instance_count > 0 ? -1 - GLint(instance_base) : GLint(drawable.object_index));
+		++gl_state.issued;
+
+		//(only portal meshes clip themselves, so this one stays a plain uniform)
+		if (clip_plane_count > 1 && pipeline.SELF_CLIP_PLANE_vec4 != -1U) {
+			glUniform4fv(pipeline.SELF_CLIP_PLANE_vec4, 1, glm::value_ptr(self_clip_plane));
+			++gl_state.issued;
+		}
+	} else {
+		//the object-to-world matrix is used in all three of these uniforms:
+		assert(drawable.transform); //drawables *must* have a transform
+		glm::mat4x3 object_to_world = transforms.make_local_to_world(drawable.transform);
+
+		//OBJECT_TO_CLIP takes vertices from object space to clip space:
+		if (pipeline.OBJECT_TO_CLIP_mat4 != -1U) {
+			glm::mat4 object_to_clip = world_to_clip * glm::mat4(object_to_world);
+			glUniformMatrix4fv(pipeline.OBJECT_TO_CLIP_mat4, 1, GL_FALSE, glm::value_ptr(object_to_clip));
+			++gl_state.issued;
+		}
 
-	//OBJECT_TO_CLIP takes vertices from object space to clip space:
-	if (pipeline.OBJECT_TO_CLIP_mat4 != -1U) {
-		glm::mat4 object_to_clip = world_to_clip * glm::mat4(object_to_world);
-		glUniformMatrix4fv(pipeline.OBJECT_TO_CLIP_mat4, 1, GL_FALSE, glm::value_ptr(object_to_clip));
-	}
+		//the object-to-light matrix is used in the next two uniforms:
+		glm::mat4x3 object_to_light = world_to_light * glm::mat4(object_to_world);
 
-	//the object-to-light matrix is used in the next two uniforms:
-	glm::mat4x3 object_to_light = world_to_light * glm::mat4(object_to_world);
+		//OBJECT_TO_CLIP takes vertices from object space to light space:
+		if (pipeline.OBJECT_TO_LIGHT_mat4x3 != -1U) {
+			glUniformMatrix4x3fv(pipeline.OBJECT_TO_LIGHT_mat4x3, 1, GL_FALSE, glm::value_ptr(object_to_light));
+			++gl_state.issued;
+		}
 
-	//OBJECT_TO_CLIP takes vertices from object space to light space:
-	if (pipeline.OBJECT_TO_LIGHT_mat4x3 != -1U) {
-		glUniformMatrix4x3fv(pipeline.OBJECT_TO_LIGHT_mat4x3, 1, GL_FALSE, glm::value_ptr(object_to_light));
-	}
+		//NORMAL_TO_CLIP takes normals from object space to light space:
+		if (pipeline.NORMAL_TO_LIGHT_mat3 != -1U) {
+			glm::mat3 normal_to_light = glm::inverse(glm::transpose(glm::mat3(object_to_light)));
+			glUniformMatrix3fv(pipeline.NORMAL_TO_LIGHT_mat3, 1, GL_FALSE, glm::value_ptr(normal_to_light));
+			++gl_state.issued;
+		}
 
-	//NORMAL_TO_CLIP takes normals from object space to light space:
-	if (pipeline.NORMAL_TO_LIGHT_mat3 != -1U) {
-		glm::mat3 normal_to_light = glm::inverse(glm::transpose(glm::mat3(object_to_light)));
-		glUniformMatrix3fv(pipeline.NORMAL_TO_LIGHT_mat3, 1, GL_FALSE, glm::value_ptr(normal_to_light));
-	}
+		if (pipeline.CLIP_PLANE_vec4 != -1U) {
+			glUniform4fv(pipeline.CLIP_PLANE_vec4, 1, glm::value_ptr(clip_plane));
+			++gl_state.issued;
+		}
 
-	if (pipeline.CLIP_PLANE_vec4 != -1U) {
-		glUniform4fv(pipeline.CLIP_PLANE_vec4, 1, glm::value_ptr(clip_plane));
+		if (pipeline.SELF_CLIP_PLANE_vec4 != -1U) {
+			glUniform4fv(pipeline.SELF_CLIP_PLANE_vec4, 1, glm::value_ptr(self_clip_plane));
+			++gl_state.issued;
+		}
 	}
 
-	if (pipeline.SELF_CLIP_PLANE_vec4 != -1U) {
-		glUniform4fv(pipeline.SELF_CLIP_PLANE_vec4, 1, glm::value_ptr(self_clip_plane));
-	}
+	//vertex decoding (kept current even for float meshes, so values from a quantized mesh don't linger in the program):
+	gl_state.set_vertex_decode(pipeline);
 
 	//set any requested custom uniforms:
 	if (pipeline.set_uniforms) pipeline.set_uniforms();
 
 	//set up textures:
+	// (units the pipeline leaves empty get texture 0, as they would have before state was shared between draws)
 	for (uint32_t i = 0; i < Drawable::Pipeline::TextureCount; ++i) {
-		if (pipeline.textures[i].texture != 0) {
-			glActiveTexture(GL_TEXTURE0 + i);
-			glBindTexture(pipeline.textures[i].target, pipeline.textures[i].texture);
-		}
+		if (i == 0 && texture0 != 0) gl_state.bind_texture(0, GL_TEXTURE_2D, texture0);
+		else gl_state.bind_texture(i, pipeline.textures[i].target, pipeline.textures[i].texture);
 	}
 
 	//draw the object:
-	glDrawArrays(pipeline.type, pipeline.start, pipeline.count);
-
-	//un-bind textures:
-	for (uint32_t i = 0; i < Drawable::Pipeline::TextureCount; ++i) {
-		if (pipeline.textures[i].texture != 0) {
-			glActiveTexture(GL_TEXTURE0 + i);
-			glBindTexture(pipeline.textures[i].target, 0);
+	if (pipeline.index_type != GL_NONE) {
+		assert(lod <= pipeline.lod_count);
+		GLuint const start = (lod ? pipeline.lods[lod - 1].start : pipeline.start);
+		GLuint const count = (lod ? pipeline.lods[lod - 1].count : pipeline.count);
+		GLsizei const index_size = (pipeline.index_type == GL_UNSIGNED_SHORT ? 2 : 4);
+		void const *first = (GLbyte *)0 + size_t(start) * index_size;
+		if (instance_count > 0) {
+			assert(pipeline.OBJECT_INDEX_int != -1U && "only programs that read per-object data can be instanced");
+			glDrawElementsInstanced(pipeline.type, count, pipeline.index_type, first, instance_count);
+		} else {
+			glDrawElements(pipeline.type, count, pipeline.index_type, first);
 		}
+	} else if (instance_count > 0) {
+		assert(pipeline.OBJECT_INDEX_int != -1U && "only programs that read per-object data can be instanced");
+		glDrawArraysInstanced(pipeline.type, pipeline.start, pipeline.count, instance_count);
+	} else {
+		glDrawArrays(pipeline.type, pipeline.start, pipeline.count);
 	}
-	glActiveTexture(GL_TEXTURE0);
-
-	glUseProgram(0);
-	glBindVertexArray(0);
-
-	if (clip_plane_count > 1){
-		glDisable(GL_CLIP_DISTANCE1);
-		glDisable(GL_CLIP_DISTANCE0);
-	}
-	else if (clip_plane_count > 0) {
-		glDisable(GL_CLIP_DISTANCE0);
-	}
+	++gl_state.issued;
+	++gl_state.draws;
 
-	GL_ERRORS();
+	//(nothing is unbound here; draw(Camera) resets gl_state once the whole scene is drawn)
 }
 
 void Scene::draw_fullscreen_tri() const {
 	if (full_tri_program.program == 0) {
 		return;
 	}
-	glUseProgram(full_tri_program.program);
-	glBindVertexArray(full_tri_program.vao);
+	gl_state.use_program(full_tri_program.program);
+	gl_state.bind_vertex_array(full_tri_program.vao);
 
 	//set shader to draw clear color
 	GLfloat clear_color[4];
@@ -384,61 +1884,43 @@ void Scene::draw_fullscreen_tri() const {
 	glUniform4fv(full_tri_program.CLEAR_COLOR_vec4, 1, clear_color);
 
 	glDrawArrays(GL_TRIANGLES, 0, 3);
-	glUseProgram(0);
-	glBindVertexArray(0);
-
-	GL_ERRORS();
+	gl_state.issued += 3;
+	gl_state.draws += 1;
 }
 
-bool Scene::is_portal_visible(glm::mat4 const &world_to_clip, Portal const &portal) const {
-	glm::mat4 const &portal_to_clip = world_to_clip * glm::mat4(portal.drawable->transform->make_local_to_world());
-
-	if (portal_to_clip[3][3] == 0) return false;
-	// https://bruop.github.io/frustum_culling/
-
-	// Get all verts of bbox, in clip space
-	glm::vec4 const vertices[8] = {
-		portal_to_clip * glm::vec4(portal.tp_box.min, 1), 
-		portal_to_clip * glm::vec4(portal.tp_box.min.x, portal.tp_box.min.y, portal.tp_box.max.z, 1), 
-		portal_to_clip * glm::vec4(portal.tp_box.min.x, portal.tp_box.max.y, portal.tp_box.min.z, 1), 
-		portal_to_clip * glm::vec4(portal.tp_box.min.x, portal.tp_box.max.y, portal.tp_box.max.z, 1), 
-		portal_to_clip * glm::vec4(portal.tp_box.max.x, portal.tp_box.min.y, portal.tp_box.min.z, 1), 
-		portal_to_clip * glm::vec4(portal.tp_box.max.x, portal.tp_box.min.y, portal.tp_box.max.z, 1), 
-		portal_to_clip * glm::vec4(portal.tp_box.max.x, portal.tp_box.max.y, portal.tp_box.min.z, 1), 
-		portal_to_clip * glm::vec4(portal.tp_box.max, 1)
-	};
+bool Scene::is_portal_visible(Frustum const &frustum, Portal const &portal) const {
+	PortalFrame const &f = portal_frame(portal);
+	return frustum.intersects_box(f.box_min, f.box_max);
+}
 
-	// Check if all verts lie outside any one plane
-	bool outside_plane = true;
-	// x, y
-	for (uint8_t i = 0; i < 2; i++) {
-		for (auto const &vert : vertices) {
-			if (-vert.w <= vert[i]) {
-				outside_plane = false;
-				break;
-			}
-		}
-		if (outside_plane) {
-			return false;
-		}
-		for (auto const &vert : vertices) {
-			if (vert.w >= vert[i]) {
-				outside_plane = false;
-				break;
-			}
-		}
-		if (outside_plane) {
-			return false;
-		}
-	}
-	// z
-	for (auto const &vert : vertices) {
-		if (0 <= vert.w) {
-			return true;
-		}
+Scene::ScreenRect Scene::get_portal_rect(glm::mat4 const &world_to_clip, Portal const &portal, ScreenRect const &view_rect) const {
+	glm::mat4 const &portal_to_clip = world_to_clip * glm::mat4(portal_frame(portal).to_world);
+
+	ScreenRect rect(glm::vec2(std::numeric_limits< float >::infinity()), glm::vec2(-std::numeric_limits< float >::infinity()));
+	for (uint32_t i = 0; i < 8; ++i) {
+		glm::vec3 const corner = glm::vec3(
+			(i & 1) ? portal.tp_box.max.x : portal.tp_box.min.x,
+			(i & 2) ? portal.tp_box.max.y : portal.tp_box.min.y,
+			(i & 4) ? portal.tp_box.max.z : portal.tp_box.min.z
+		);
+		glm::vec4 const clip = portal_to_clip * glm::vec4(corner, 1.0f);
+		// A corner at or behind the eye doesn't project sensibly, so fall back to the whole view:
+		if (clip.w <= 1e-5f) return view_rect;
+		glm::vec2 const ndc = glm::vec2(clip) / clip.w;
+		rect.min = glm::min(rect.min, ndc);
+		rect.max = glm::max(rect.max, ndc);
 	}
 
-	return false;
+	return rect.intersect(view_rect);
+}
+
+void Scene::set_scissor(ScreenRect const &rect) const {
+	glm::vec2 const origin = glm::vec2(draw_viewport.x, draw_viewport.y);
+	glm::vec2 const size = glm::vec2(draw_viewport.z, draw_viewport.w);
+	// round outward so partially-covered pixels stay inside:
+	glm::ivec2 const min = glm::ivec2(glm::floor(origin + (0.5f * rect.min + 0.5f) * size));
+	glm::ivec2 const max = glm::ivec2(glm::ceil(origin + (0.5f * rect.max + 0.5f) * size));
+	glScissor(min.x, min.y, std::max(0, max.x - min.x), std::max(0, max.y - min.y));
 }
 
 Scene::Texture::Texture(std::string const &filename) {
@@ -552,13 +2034,13 @@ void Scene::ScreenImage::draw(float aspect) {
 }
 
 void Scene::load(std::string const &filename,
-	std::function< void(Scene &, Transform *, std::string const &) > const &on_drawable,
-	std::function< void(Scene &, Transform *, std::string const &, std::string const &, std:: string const &, std::string const &) > const &on_portal, 
-	std::function< void(Scene &, Transform *, std::string const &) > const &on_button) {
+	std::function< void(Scene &, Transform, std::string const &) > const &on_drawable,
+	std::function< void(Scene &, Transform, std::string const &, std::string const &, std:: string const &, std::string const &) > const &on_portal, 
+	std::function< void(Scene &, Transform, std::string const &) > const &on_button) {
 
-	std::ifstream file(filename, std::ios::binary);
+	MappedChunks file(filename);
 
-	std::vector< char > names;
+	ChunkSpan< char > names;
 	read_chunk(file, "str0", &names);
 
 	struct HierarchyEntry {
@@ -570,7 +2052,7 @@ void Scene::load(std::string const &filename,
 		glm::vec3 scale;
 	};
 	static_assert(sizeof(HierarchyEntry) == 4 + 4 + 4 + 4*3 + 4*4 + 4*3, "HierarchyEntry is packed.");
-	std::vector< HierarchyEntry > hierarchy;
+	ChunkSpan< HierarchyEntry > hierarchy;
 	read_chunk(file, "xfh0", &hierarchy);
 
 	struct PortalEntry {
@@ -585,7 +2067,7 @@ void Scene::load(std::string const &filename,
 		uint32_t group_end;
 	};
 	static_assert(sizeof(PortalEntry) == 4 + 4 + 4 + 4 + 4 + 4 + 4 + 4 + 4, "PortalEntry is packed.");
-	std::vector< PortalEntry > portal_meshes;
+	ChunkSpan< PortalEntry > portal_meshes;
 	read_chunk(file, "prt0", &portal_meshes);
 
 	struct ButtonEntry {
@@ -594,7 +2076,7 @@ void Scene::load(std::string const &filename,
 		uint32_t name_end;
 	};
 	static_assert(sizeof(ButtonEntry) == 4 + 4 + 4, "ButtonEntry is packed.");
-	std::vector< ButtonEntry > button_meshes;
+	ChunkSpan< ButtonEntry > button_meshes;
 	read_chunk(file, "btn0", &button_meshes);
 
 	struct MeshEntry {
@@ -603,7 +2085,7 @@ void Scene::load(std::string const &filename,
 		uint32_t name_end;
 	};
 	static_assert(sizeof(MeshEntry) == 4 + 4 + 4, "MeshEntry is packed.");
-	std::vector< MeshEntry > meshes;
+	ChunkSpan< MeshEntry > meshes;
 	read_chunk(file, "msh0", &meshes);
 
 	struct CameraEntry {
@@ -613,7 +2095,7 @@ void Scene::load(std::string const &filename,
 		float clip_near, clip_far;
 	};
 	static_assert(sizeof(CameraEntry) == 4 + 4 + 4 + 4 + 4, "CameraEntry is packed.");
-	std::vector< CameraEntry > loaded_cameras;
+	ChunkSpan< CameraEntry > loaded_cameras;
 	read_chunk(file, "cam0", &loaded_cameras);
 
 	struct LightEntry {
@@ -625,35 +2107,33 @@ void Scene::load(std::string const &filename,
 		float fov;
 	};
 	static_assert(sizeof(LightEntry) == 4 + 1 + 3 + 4 + 4 + 4, "LightEntry is packed.");
-	std::vector< LightEntry > loaded_lights;
+	ChunkSpan< LightEntry > loaded_lights;
 	read_chunk(file, "lmp0", &loaded_lights);
 
 
 	//--------------------------------
 	//Now that file is loaded, create transforms for hierarchy entries:
 
-	std::vector< Transform * > hierarchy_transforms;
+	std::vector< Transform > hierarchy_transforms;
 	hierarchy_transforms.reserve(hierarchy.size());
 
 	for (auto const &h : hierarchy) {
-		transforms.emplace_back();
-		Transform *t = &transforms.back();
+		Transform parent;
 		if (h.parent != -1U) {
 			if (h.parent >= hierarchy_transforms.size()) {
 				throw std::runtime_error("scene file '" + filename + "' did not contain transforms in topological-sort order.");
 			}
-			t->parent = hierarchy_transforms[h.parent];
+			parent = hierarchy_transforms[h.parent];
 		}
 
-		if (h.name_begin <= h.name_end && h.name_end <= names.size()) {
-			t->name = std::string(names.begin() + h.name_begin, names.begin() + h.name_end);
-		} else {
+		if (!(h.name_begin <= h.name_end && h.name_end <= names.size())) {
 				throw std::runtime_error("scene file '" + filename + "' contains hierarchy entry with invalid name indices");
 		}
+		Transform t = transforms.create(std::string(names.begin() + h.name_begin, names.begin() + h.name_end), parent);
 
-		t->position = h.position;
-		t->rotation = h.rotation;
-		t->scale = h.scale;
+		transforms.position(t) = h.position;
+		transforms.rotation(t) = h.rotation;
+		transforms.scale(t) = h.scale;
 
 		hierarchy_transforms.emplace_back(t);
 	}
@@ -765,7 +2245,7 @@ void Scene::load(std::string const &filename,
 	//load any extra that a subclass wants:
 	load_extra(file, names, hierarchy_transforms);
 
-	if (file.peek() != EOF) {
+	if (!file.at_end()) {
 		std::cerr << "WARNING: trailing data in scene file '" << filename << "'" << std::endl;
 	}
 
@@ -775,9 +2255,9 @@ void Scene::load(std::string const &filename,
 
 //-------------------------
 
-Scene::Scene(std::string const &filename, std::function< void(Scene &, Transform *, std::string const &) > const &on_drawable,
-	std::function< void(Scene &, Transform *, std::string const &, std::string const &, std::string const &, std::string const &) > const &on_portal, 
-	std::function< void(Scene &, Transform *, std::string const &) > const &on_button) {
+Scene::Scene(std::string const &filename, std::function< void(Scene &, Transform, std::string const &) > const &on_drawable,
+	std::function< void(Scene &, Transform, std::string const &, std::string const &, std::string const &, std::string const &) > const &on_portal, 
+	std::function< void(Scene &, Transform, std::string const &) > const &on_button) {
 	load(filename, on_drawable, on_portal, on_button);
 }
 
@@ -785,70 +2265,55 @@ Scene::Scene(Scene const &other) {
 	set(other);
 }
 
+Scene::~Scene() {
+	if (object_data_tex != 0) glDeleteTextures(1, &object_data_tex);
+	if (object_data_buffer != 0) glDeleteBuffers(1, &object_data_buffer);
+	if (view_buffer != 0) glDeleteBuffers(1, &view_buffer);
+	if (instance_data_tex != 0) glDeleteTextures(1, &instance_data_tex);
+	if (instance_data_buffer != 0) glDeleteBuffers(1, &instance_data_buffer);
+	for (auto &pq : portal_queries) {
+		if (!pq.second.queries.empty()) glDeleteQueries(GLsizei(pq.second.queries.size()), pq.second.queries.data());
+	}
+	for (auto &t : portal_view_targets) {
+		t.release();
+	}
+	if (blank_view_tex != 0) glDeleteTextures(1, &blank_view_tex);
+	for (auto &t : scaled_targets) {
+		t.release();
+	}
+}
+
 Scene &Scene::operator=(Scene const &other) {
 	set(other);
 	return *this;
 }
 
-void Scene::set(Scene const &other, std::unordered_map< Transform const *, Transform * > *transform_map_) {
-
-	std::unordered_map< Transform const *, Transform * > t2t_temp;
-	std::unordered_map< Transform const *, Transform * > &transform_to_transform = *(transform_map_ ? transform_map_ : &t2t_temp);
-
-	transform_to_transform.clear();
-
-	//null transform maps to itself:
-	transform_to_transform.insert(std::make_pair(nullptr, nullptr));
+void Scene::set(Scene const &other) {
+	//Copy transforms; handles index into these arrays, so no pointer fixup is needed:
+	transforms = other.transforms;
 
-	//Copy transforms and store mapping:
-	transforms.clear();
-	for (auto const &t : other.transforms) {
-		transforms.emplace_back();
-		transforms.back().name = t.name;
-		transforms.back().position = t.position;
-		transforms.back().rotation = t.rotation;
-		transforms.back().scale = t.scale;
-		transforms.back().parent = t.parent; //will update later
-
-		//store mapping between transforms old and new:
-		auto ret = transform_to_transform.insert(std::make_pair(&t, &transforms.back()));
-		assert(ret.second);
-	}
-
-	//update transform parents:
-	for (auto &t : transforms) {
-		t.parent = transform_to_transform.at(t.parent);
-	}
-
-	//copy other's drawables, updating transform pointers:
-	drawables = std::list<Scene::Drawable>();
-	for (auto &d : other.drawables) {
-		drawables.emplace_back(transform_to_transform.at(d.transform));
-		drawables.back().pipeline = d.pipeline;
-	}
-
-	//copy other's cameras, updating transform pointers:
+	//copy other's drawables, cameras, and lights (their transform handles are valid in the copy):
+	drawables = other.drawables;
 	cameras = other.cameras;
-	for (auto &c : cameras) {
-		c.transform = transform_to_transform.at(c.transform);
-	}
-
-	//copy other's lights, updating transform pointers:
 	lights = other.lights;
-	for (auto &l : lights) {
-		l.transform = transform_to_transform.at(l.transform);
-	}
 
-	//copy other's portals, updating drawable pointers:
+	//copy other's portals:
 	portals = other.portals;
+	portal_groups.clear();
 	for (auto &p : portals) {
-		p.second->drawable->transform = transform_to_transform.at(p.second->drawable->transform);
 		portal_groups[p.second->group].emplace_back(p.second);
 	}
 
 	//copy other's buttons
 	buttons = other.buttons;
-	for (auto &b : buttons) {
-		b.drawable->transform = transform_to_transform.at(b.drawable->transform);
-	}
+
+	//travelers' transform handles are valid in the copy too (their tracking state starts over):
+	travel = PortalTravel();
+	travel.travelers = other.travel.travelers;
+
+	//cell lists point at drawables, so rebuild them for the copies:
+	cell_bounds = other.cell_bounds;
+	cells.clear();
+	shared_drawables.clear();
+	if (!other.cells.empty() || !other.shared_drawables.empty()) rebuild_cells();
 }
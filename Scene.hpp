@@ -16,52 +16,149 @@
 #include <glm/gtc/quaternion.hpp>
 
 #include "gl_compile_program.hpp"
+#include "mapped_chunk.hpp"
 
 #include <list>
+#include <algorithm>
 #include <memory>
 #include <functional>
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <map>
+#include <chrono>
+#include <limits>
 
 struct ColorTextureProgram;
 
 struct Scene {
+	//Transforms are referred to by stable handles into the scene's TransformStore (below):
+	// (handles stay valid when the store reorders itself and when a scene is copied)
 	struct Transform {
-		//Transform names are useful for debugging and looking up locations in a loaded scene:
-		std::string name;
+		uint32_t id; //index into the store's handle table; -1U for "no transform"
 
-		//The core function of a transform is to store a transformation in the world:
-		glm::vec3 position = glm::vec3(0.0f, 0.0f, 0.0f);
-		glm::quat rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f); //n.b. wxyz init order
-		glm::vec3 scale = glm::vec3(1.0f, 1.0f, 1.0f);
+		Transform() : id(-1U) { }
+		explicit Transform(uint32_t id_) : id(id_) { }
 
-		//The transform above may be relative to some parent transform:
-		Transform *parent = nullptr;
+		explicit operator bool() const { return id != -1U; }
+		bool operator==(Transform const &o) const { return id == o.id; }
+		bool operator!=(Transform const &o) const { return id != o.id; }
 
-		//It is often convenient to construct matrices representing this transformation:
-		// ..relative to its parent:
-		glm::mat4x3 make_local_to_parent() const;
-		glm::mat4x3 make_parent_to_local() const;
-		// ..relative to the world:
-		glm::mat4x3 make_local_to_world() const;
-		glm::mat4x3 make_world_to_local() const;
+		//It is often convenient to construct matrices representing a transformation:
+		static glm::mat4x3 make_local_to_parent(glm::vec3 const &position, glm::quat const &rotation, glm::vec3 const &scale);
+		static glm::mat4x3 make_parent_to_local(glm::vec3 const &position, glm::quat const &rotation, glm::vec3 const &scale);
+	};
+
+	//Structure-of-arrays storage for all of a scene's transforms:
+	// - hot data (position, rotation, scale, parent, cached world matrices) lives in contiguous arrays indexed by "slot"
+	// - slots are kept in topological order (parent slot < child slot), so the hierarchy resolves in one linear sweep
+	// - names are cold data, stored separately and indexed by handle
+	struct TransformStore {
+		//add a new transform (at the end, so existing slots don't move), returns its handle:
+		Transform create(std::string const &name = "", Transform parent = Transform());
 
-		//since hierarchy is tracked through pointers, copy-constructing a transform  is not advised:
-		Transform(Transform const &) = delete;
-		//if we delete some constructors, we need to let the compiler know that the default constructor is still okay:
-		Transform() = default;
+		uint32_t size() const { return uint32_t(positions.size()); }
+		//handles are allocated sequentially, so Transform(0) ... Transform(size()-1) are all valid.
+
+		//look up the first transform with a given name (returns an invalid handle if not found):
+		Transform find(std::string const &name) const;
+
+		//The core function of a transform is to store a transformation in the world:
+		// (non-const accessors mark the transform dirty so cached world matrices are rebuilt;
+		//  use the get_ versions to read through a non-const store without dirtying anything)
+		glm::vec3 const &position(Transform t) const { return positions[slot(t)]; }
+		glm::quat const &rotation(Transform t) const { return rotations[slot(t)]; }
+		glm::vec3 const &scale(Transform t) const { return scales[slot(t)]; }
+		glm::vec3 const &get_position(Transform t) const { return positions[slot(t)]; }
+		glm::quat const &get_rotation(Transform t) const { return rotations[slot(t)]; }
+		glm::vec3 const &get_scale(Transform t) const { return scales[slot(t)]; }
+		glm::vec3 &position(Transform t) { return positions[mark_dirty(t)]; }
+		glm::quat &rotation(Transform t) { return rotations[mark_dirty(t)]; }
+		glm::vec3 &scale(Transform t) { return scales[mark_dirty(t)]; }
+
+		//Transform names are useful for debugging and looking up locations in a loaded scene:
+		std::string const &name(Transform t) const { return names[check(t).id]; }
+		std::string &name(Transform t) { return names[check(t).id]; }
 
-		Transform(glm::vec3 const &position_, glm::quat const &rotation_, glm::vec3 const &scale_) : position(position_), rotation(rotation_), scale(scale_) {}
+		//The transform may be relative to some parent transform:
+		Transform parent(Transform t) const;
+		// note: will re-sort slots if needed to keep parents before children; throws on cycles
+		void set_parent(Transform t, Transform parent);
 
-		//make a global transform representation from an existing transform. Really helpful for rendering purposes (probably not good elsewhere)
-		void make_global(Transform const &from);
+		//Matrices for a transformation:
+		// ..relative to its parent:
+		glm::mat4x3 make_local_to_parent(Transform t) const;
+		glm::mat4x3 make_parent_to_local(Transform t) const;
+		// ..relative to the world (read from cache; resolves stale entries first):
+		glm::mat4x3 make_local_to_world(Transform t) const;
+		glm::mat4x3 make_world_to_local(Transform t) const;
+		//..and a number that changes whenever those world matrices do (for caching things derived from them):
+		uint64_t world_version(Transform t) const;
+
+		//Per-frame resolve pass: one linear sweep from the first dirty slot, propagating dirtiness parent -> child:
+		void update() const;
+
+		//--- internals ---
+		//hot data, indexed by slot:
+		std::vector< glm::vec3 > positions;
+		std::vector< glm::quat > rotations;
+		std::vector< glm::vec3 > scales;
+		std::vector< uint32_t > parents; //parent slot, or -1U for none
+
+		//cached world matrices, indexed by slot:
+		mutable std::vector< glm::mat4x3 > local_to_world;
+		mutable std::vector< glm::mat4x3 > world_to_local;
+		mutable std::vector< uint8_t > dirty; //slot's local data changed since the last sweep
+		mutable uint32_t first_dirty = 0; //everything before this slot is up to date
+		mutable std::vector< uint64_t > world_versions; //sweep that last rebuilt the slot's world matrices
+		mutable uint64_t sweeps = 0;
+
+		//cold data, indexed by handle:
+		std::vector< std::string > names;
+
+		//stable handle <-> slot mapping:
+		std::vector< uint32_t > handle_to_slot;
+		std::vector< uint32_t > slot_to_handle;
+
+		Transform const &check(Transform const &t) const {
+			assert(t.id < handle_to_slot.size() && "transform handle is not from this store");
+			return t;
+		}
+		uint32_t slot(Transform t) const { return handle_to_slot[check(t).id]; }
+		uint32_t mark_dirty(Transform t) {
+			uint32_t s = slot(t);
+			dirty[s] = 1;
+			first_dirty = std::min(first_dirty, s);
+			return s;
+		}
+		//re-order slots so that parents come before children:
+		void sort_topologically();
 	};
 
 	struct Drawable {
 		//a 'Drawable' attaches attribute data to a transform:
-		Drawable(Transform *transform_) : transform(transform_) { assert(transform); }
-		Transform * transform;
+		Drawable(Transform transform_) : transform(transform_) { assert(transform); }
+		Transform transform;
+
+		//object-space bounding box (usually copied from Mesh::min/max), used for view culling:
+		// (the default, empty box means "bounds unknown"; such drawables are never culled)
+		glm::vec3 min = glm::vec3( std::numeric_limits< float >::infinity());
+		glm::vec3 max = glm::vec3(-std::numeric_limits< float >::infinity());
+		bool has_bounds() const { return min.x <= max.x && min.y <= max.y && min.z <= max.z; }
+
+		//world-space bounding box, refreshed once per frame by Scene::update_bounds():
+		mutable glm::vec3 world_min = glm::vec3(0.0f);
+		mutable glm::vec3 world_max = glm::vec3(0.0f);
+
+		//slot in the per-object data buffer, assigned once per frame by Scene::upload_object_data():
+		mutable uint32_t object_index = 0;
+
+		//cell (portal group name) this drawable lives in, as given by scene data or game code:
+		// (if empty, Scene::update_cells() puts it in every cell its world bounds overlap, or in every view if there are none)
+		std::string cell;
+		//cells found from world bounds by Scene::update_cells(), and the transform's world version when they were found:
+		std::vector< std::string > bounded_cells;
+		uint64_t bounded_cells_version = -1ULL;
 
 		//Contains all the data needed to run the OpenGL pipeline:
 		struct Pipeline {
@@ -73,6 +170,24 @@ struct Scene {
 			GLenum type = GL_TRIANGLES; //what sort of primitive to draw; passed to glDrawArrays
 			GLuint start = 0; //first vertex to draw; passed to glDrawArrays
 			GLuint count = 0; //number of vertices to draw; passed to glDrawArrays
+			//if not GL_NONE, start and count are instead a range of the vao's element buffer, drawn with glDrawElements:
+			GLenum index_type = GL_NONE; //GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+
+			//coarser versions of the mesh (copied from Mesh::lods; ranges of the vao's element buffer), finest first:
+			// (chosen per view by Scene::select_lod)
+			struct LOD {
+				GLuint start = 0;
+				GLuint count = 0;
+				float error = 0.0f; //farthest (in object space) any vertex was moved to make this level
+			};
+			enum : uint32_t { MaxLODs = 4 };
+			LOD lods[MaxLODs];
+			uint32_t lod_count = 0;
+
+			//vertex decoding for quantized meshes (copied from Mesh; see MeshBuffer::VertexDecodeGLSL):
+			glm::vec3 position_offset = glm::vec3(0.0f);
+			glm::vec3 position_scale = glm::vec3(1.0f);
+			bool octahedral_normals = false;
 
 			//uniforms:
 			GLuint OBJECT_TO_CLIP_mat4 = -1U; //uniform location for object to clip space matrix
@@ -83,6 +198,19 @@ struct Scene {
 
 			GLuint SELF_CLIP_PLANE_vec4 = -1U; //uniform location for second clip plane, used only by portal meshes to clip themselves (avoids edge case)
 
+			//uniform locations for the vertex decoding values above:
+			GLuint POSITION_OFFSET_vec3 = -1U;
+			GLuint POSITION_SCALE_vec3 = -1U;
+			GLuint OCTAHEDRAL_NORMALS_bool = -1U;
+
+			//programs that read transforms from the scene's per-view uniform block and per-object buffer (see Scene::ViewBlockBinding)
+			// set this instead of the OBJECT_TO_* / NORMAL_TO_* / CLIP_PLANE uniforms above:
+			GLuint OBJECT_INDEX_int = -1U; //uniform location for index into per-object data
+
+			//uniform location for drawing a portal's offscreen view (texture 0) in screen space, in PortalMode::Texture:
+			// (x,y,w,h of the viewport the view was rendered for; w == 0 means draw normally)
+			GLuint PORTAL_VIEWPORT_vec4 = -1U;
+
 			std::function< void() > set_uniforms; //(optional) function to set any other useful uniforms
 
 			//texture objects to bind for the first TextureCount textures:
@@ -96,8 +224,8 @@ struct Scene {
 
 	struct Camera {
 		//a 'Camera' attaches camera data to a transform:
-		Camera(Transform *transform_) : transform(transform_) { assert(transform); }
-		Transform * transform;
+		Camera(Transform transform_) : transform(transform_) { assert(transform); }
+		Transform transform;
 		//NOTE: cameras are directed along their -z axis
 
 		//perspective camera parameters:
@@ -110,8 +238,8 @@ struct Scene {
 
 	struct Light {
 		//a 'Light' attaches light data to a transform:
-		Light(Transform *transform_) : transform(transform_) { assert(transform); }
-		Transform * transform;
+		Light(Transform transform_) : transform(transform_) { assert(transform); }
+		Transform transform;
 		//NOTE: directional, spot, and hemisphere lights are directed along their -z axis
 
 		enum Type : char {
@@ -185,6 +313,67 @@ struct Scene {
 		return true;
 	}
 
+	//An axis-aligned region of the screen, in normalized device coordinates ([-1,1]x[-1,1] is the whole view):
+	struct ScreenRect {
+		ScreenRect() : min(-1.0f), max(1.0f) {}
+		ScreenRect(glm::vec2 const &min_, glm::vec2 const &max_) : min(min_), max(max_) {}
+		glm::vec2 min;
+		glm::vec2 max;
+		bool empty() const { return !(min.x < max.x && min.y < max.y); }
+		ScreenRect intersect(ScreenRect const &other) const {
+			return ScreenRect(glm::max(min, other.min), glm::min(max, other.max));
+		}
+	};
+
+	//A view frustum, stored as planes (xyz: inward-facing normal, w: offset) extracted from a world-to-clip matrix:
+	struct Frustum {
+		Frustum() = default;
+		explicit Frustum(glm::mat4 const &world_to_clip);
+		//frustum narrowed to only the part of the view inside 'rect':
+		Frustum(glm::mat4 const &world_to_clip, ScreenRect const &rect);
+		// left, right, bottom, top, near, far
+		// (far is degenerate -- and so always passes -- for the infinite projections cameras use)
+		glm::vec4 planes[6];
+
+		//conservative test: returns false only if the box is entirely outside one of the planes:
+		bool intersects_box(glm::vec3 const &min, glm::vec3 const &max) const {
+			for (auto const &plane : planes) {
+				//corner of the box furthest along the plane normal:
+				glm::vec3 far_corner = glm::vec3(
+					plane.x > 0.0f ? max.x : min.x,
+					plane.y > 0.0f ? max.y : min.y,
+					plane.z > 0.0f ? max.z : min.z
+				);
+				if (glm::dot(glm::vec3(plane), far_corner) + plane.w < 0.0f) return false;
+			}
+			return true;
+		}
+	};
+
+	//transform an object-space box to a (conservative) world-space axis-aligned box:
+	static void transform_box(glm::mat4x3 const &to_world, glm::vec3 const &min, glm::vec3 const &max, glm::vec3 *world_min, glm::vec3 *world_max) {
+		assert(world_min && world_max);
+		// (center/extent form: the extent of the rotated box is the absolute matrix times the extent)
+		glm::vec3 center = to_world * glm::vec4(0.5f * (min + max), 1.0f);
+		glm::vec3 extent = 0.5f * (max - min);
+		glm::vec3 world_extent =
+			  glm::abs(to_world[0]) * extent.x
+			+ glm::abs(to_world[1]) * extent.y
+			+ glm::abs(to_world[2]) * extent.z;
+		*world_min = center - world_extent;
+		*world_max = center + world_extent;
+	}
+
+	//is the box entirely on the negative side of 'plane' (so anything clipped by that plane can skip it)?
+	static bool box_behind_plane(glm::vec4 const &plane, glm::vec3 const &min, glm::vec3 const &max) {
+		glm::vec3 far_corner = glm::vec3(
+			plane.x > 0.0f ? max.x : min.x,
+			plane.y > 0.0f ? max.y : min.y,
+			plane.z > 0.0f ? max.z : min.z
+		);
+		return glm::dot(glm::vec3(plane), far_corner) + plane.w < 0.0f;
+	}
+
 	struct Portal {
 		Portal() : active(false) {}
 		Portal(Drawable *drawable_, BoxCollider tp_box_, std::string on_walkmesh_, std::string group_) : 
@@ -199,14 +388,31 @@ struct Scene {
 		std::string on_walkmesh;
 		Portal *dest = nullptr;
 		std::string group;
-		bool player_tracked = false;
-		bool player_in_front = false;
-		glm::vec3 player_last_pos = glm::vec3(0);
-		bool sleeping = false;
+		//(per-traveler crossing state lives in Scene::travel, so any number of things can use the same portal)
 
 		bool active = true;
 
-		glm::vec4 get_clipping_plane(glm::vec3 view_pos) const;
+		mutable uint32_t frame = -1U; //index in Scene::portal_frames
+	};
+
+	//World-space data for one portal, cached until the portal (or its destination) moves:
+	struct PortalFrame {
+		Portal *portal = nullptr;
+		glm::mat4x3 to_world = glm::mat4x3(1.0f);
+		glm::mat4x3 to_local = glm::mat4x3(1.0f);
+		glm::mat4 to_dest = glm::mat4(1.0f); //world-to-world transform for something passing through to portal->dest
+		glm::vec3 origin = glm::vec3(0.0f);
+		glm::vec3 forward = glm::vec3(0.0f, 1.0f, 0.0f); //unit normal of the portal plane (local +y)
+		glm::vec3 box_min = glm::vec3(0.0f), box_max = glm::vec3(0.0f); //world bounds of tp_box
+		glm::vec3 tracking_min = glm::vec3(0.0f), tracking_max = glm::vec3(0.0f); //world bounds of tracking_box
+		//world versions (see TransformStore::world_version) of the portal and its destination when this was computed:
+		uint64_t version = -1ULL, dest_version = -1ULL;
+
+		//plane in the middle of the portal, facing away from view_pos (used to clip views through the portal):
+		glm::vec4 clipping_plane(glm::vec3 const &view_pos) const {
+			glm::vec3 const normal = (glm::dot(forward, view_pos - origin) >= 0.0f ? -forward : forward);
+			return glm::vec4(normal, -glm::dot(origin, normal));
+		}
 	};
 
 	struct Button {
@@ -224,7 +430,7 @@ struct Scene {
 	};
 
 	//Scenes, of course, may have many of the above objects:
-	std::list< Transform > transforms;
+	TransformStore transforms;
 	std::list< Drawable > drawables;
 	std::list< Camera > cameras;
 	std::list< Light > lights;
@@ -233,32 +439,473 @@ struct Scene {
 	std::vector<Portal*> *current_group = nullptr;
 	std::vector< Button > buttons;
 
+	//One frame per portal with a drawable, in a flat array (Portal::frame indexes it):
+	// (draw() and teleport code call update_portal_frames(), which recomputes only frames whose portals moved)
+	mutable std::vector< PortalFrame > portal_frames;
+	mutable uint64_t portal_frames_version = 0; //changes whenever any frame (or the list) does
+	mutable uint64_t portal_frames_listing = 0; //changes only when the list does (i.e., when Portal::frame indices change)
+	void update_portal_frames() const;
+	PortalFrame const &portal_frame(Portal const &portal) const {
+		assert(portal.frame < portal_frames.size() && portal_frames[portal.frame].portal == &portal && "portal frames are out of date");
+		return portal_frames[portal.frame];
+	}
+
+	//Uniform grid over the portals' world tracking boxes, so proximity tests only look at nearby portals:
+	// (rebuilt by update_portal_frames() whenever a portal moves; any number of entities can query it)
+	struct PortalGrid {
+		float cell_size = 4.0f;
+		std::unordered_map< uint64_t, std::vector< uint32_t > > cells; //packed cell coordinates -> indices in portal_frames
+		uint64_t built_version = -1ULL; //portal_frames_version the grid was built from
+
+		glm::ivec3 cell_of(glm::vec3 const &point) const { return glm::ivec3(glm::floor(point / cell_size)); }
+		static uint64_t key(glm::ivec3 const &cell) {
+			//21 bits per axis is plenty for any level:
+			return (uint64_t(uint32_t(cell.x) & 0x1fffff) << 42) | (uint64_t(uint32_t(cell.y) & 0x1fffff) << 21) | uint64_t(uint32_t(cell.z) & 0x1fffff);
+		}
+		void build(std::vector< PortalFrame > const &frames);
+		//indices of the portal frames whose tracking boxes might contain 'point':
+		std::vector< uint32_t > const &near(glm::vec3 const &point) const;
+	};
+	mutable PortalGrid portal_grid;
+
+	//Anything that can go through portals -- the player, props, NPCs, ... -- registers as a traveler:
+	struct PortalTravel {
+		struct Traveler {
+			Transform transform; //should be a root transform, since crossing sets its position and rotation directly
+			glm::vec3 center = glm::vec3(0.0f); //local point that has to pass through a portal (e.g., the middle of its bounds)
+			bool active = true;
+		};
+		std::vector< Traveler > travelers; //indexed by traveler id
+		//returns the new traveler's id:
+		uint32_t add(Transform transform, glm::vec3 const &min = glm::vec3(0.0f), glm::vec3 const &max = glm::vec3(0.0f)) {
+			travelers.emplace_back(Traveler{transform, 0.5f * (min + max), true});
+			return uint32_t(travelers.size() - 1);
+		}
+
+		//crossing state for each (traveler, portal) pair that's near enough to matter, sorted by traveler then frame:
+		struct Track {
+			uint32_t traveler;
+			uint32_t frame; //index in portal_frames
+			glm::vec3 last_pos; //traveler's point in portal space, last step
+			uint8_t tracked; //inside the tracking box last step?
+			uint8_t in_front; //on the portal's +y side?
+			uint8_t sleeping; //just arrived through this portal, so don't send it straight back
+		};
+		std::vector< Track > tracks;
+		uint64_t listing = 0; //portal_frames_listing the tracks' frame indices refer to
+
+		struct Crossing {
+			uint32_t traveler;
+			Portal *portal; //went in here (and came out at portal->dest)
+		};
+
+		//per-step scratch, kept around so stepping doesn't allocate:
+		struct Pair {
+			uint32_t traveler;
+			uint32_t frame;
+		};
+		std::vector< glm::vec3 > points; //per traveler, world space
+		std::vector< Pair > pairs; //(traveler, nearby portal) candidates
+		std::vector< glm::vec3 > offsets; //per pair, traveler's point in portal space
+		std::vector< Track > next_tracks;
+		std::vector< Crossing > crossed; //this step's crossings, in traveler order
+	} travel;
+
+	//Move every traveler that passed through a portal since the last step to the other side, in one batched pass
+	// (crossings, in traveler order, are appended to 'crossings' for game-specific follow-up):
+	void step_travelers(std::vector< PortalTravel::Crossing > *crossings = nullptr);
+
+	//Drawables grouped by cell (one cell per portal group), so a view only walks the drawables in the cell it looks into:
+	// (built by assign_cells(); until then every view draws every drawable)
+	// a drawable whose bounds overlap several cells is listed in each of them
+	std::unordered_map< std::string, std::vector< Drawable const * > > cells;
+	std::vector< Drawable const * > shared_drawables; //drawables in no cell, drawn in every view
+
+	//World-space extent of each cell, by portal group name:
+	std::unordered_map< std::string, BoxCollider > cell_bounds;
+
+	//Set up cell_bounds and place drawables in cells, then rebuild the cell lists:
+	// - a drawable under a transform named after a portal group (e.g., a Blender empty "Start") gets that cell;
+	// - each cell's bounds are 'bounds' (for things the scene doesn't hold, like walkmeshes) grown to cover
+	//   the cell's portals and the drawables placed in it by name;
+	// - any other drawable goes in every cell its world bounds overlap (see update_cells), or, if none, is shared.
+	void assign_cells(std::unordered_map< std::string, BoxCollider > const &bounds = {});
+	//Re-place drawables without a given cell whose transforms moved since they were last placed:
+	// (call once per frame after moving things; only moved drawables are tested, and lists are rebuilt only if membership changed)
+	// returns true if the cell lists changed
+	bool update_cells();
+	void rebuild_cells();
+
+	//Per-frame resolve pass that rebuilds any stale cached world matrices in one sweep:
+	// (called by draw(), so later lookups during the frame just read the cache)
+	void update_transforms() const { transforms.update(); }
+
+	//Refresh every drawable's world-space bounding box (also called by draw(), after update_transforms()):
+	void update_bounds() const;
+
+	//Counts of drawables submitted and culled at each portal recursion level (index 0 is the camera's own view):
+	// (reset at the start of each draw(Camera))
+	struct CullStats {
+		std::vector< uint32_t > drawn;
+		std::vector< uint32_t > culled;
+		void reset() { drawn.clear(); culled.clear(); }
+		void count(GLint recursion_lvl, bool was_culled) {
+			if (drawn.size() <= size_t(recursion_lvl)) {
+				drawn.resize(recursion_lvl + 1, 0);
+				culled.resize(recursion_lvl + 1, 0);
+			}
+			(was_culled ? culled : drawn)[recursion_lvl] += 1;
+		}
+	};
+	mutable CullStats cull_stats;
+
+	//Level of detail: drawables with coarser meshes (Drawable::Pipeline::lods) use the coarsest one
+	// whose error would cover at most max_error_pixels on screen, at the nearest point of the drawable's bounds.
+	// Views further down the portal recursion accept level_factor times more error per level
+	// (they're seen small, and often at reduced resolution), so deep views cost a fraction of the triangles.
+	// Coarser meshes can change how things look, so this is off by default (F7 in PlayMode turns it on).
+	struct LODSelection {
+		bool enabled = false;
+		float max_error_pixels = 1.0f;
+		float level_factor = 2.0f;
+	} lod_selection;
+	//returns 0 for the full mesh, otherwise 1 + index in drawable.pipeline.lods
+	// (pixel_scale is how many pixels one world unit covers at a distance of one unit; recursion_lvl is in the camera's terms)
+	uint32_t select_lod(Drawable const &drawable, glm::mat4 const &world_to_clip, float pixel_scale, GLint recursion_lvl) const;
+
+	//Triangles submitted at each recursion level, and how many the full-detail meshes would have had:
+	// (reset at the start of each draw(Camera))
+	struct LODStats {
+		std::vector< uint64_t > drawn;
+		std::vector< uint64_t > full;
+		void reset() { drawn.clear(); full.clear(); }
+		void count(GLint recursion_lvl, uint64_t drawn_triangles, uint64_t full_triangles) {
+			if (drawn.size() <= size_t(recursion_lvl)) {
+				drawn.resize(recursion_lvl + 1, 0);
+				full.resize(recursion_lvl + 1, 0);
+			}
+			drawn[recursion_lvl] += drawn_triangles;
+			full[recursion_lvl] += full_triangles;
+		}
+	};
+	mutable LODStats lod_stats;
+
+	//Shadow copy of the GL binding state the scene touches while drawing, so redundant calls can be skipped:
+	// (only trusted inside draw(Camera), which invalidates it on entry and unbinds everything on exit)
+	struct GLStateCache {
+		enum : GLuint { Unknown = -1U };
+		void invalidate(); //forget what is bound (next calls always go through)
+		void reset(); //unbind everything this cache bound, leaving GL in its default binding state
+
+		void use_program(GLuint program);
+		void bind_vertex_array(GLuint vao);
+		void bind_texture(uint32_t unit, GLenum target, GLuint texture);
+		void set_clip_distances(uint8_t count); //enables GL_CLIP_DISTANCE0 .. count-1, disables the rest
+		//upload the pipeline's vertex decoding uniforms to its program (which must be in use), where they changed:
+		void set_vertex_decode(Drawable::Pipeline const &pipeline);
+
+		GLuint program = Unknown;
+		GLuint vao = Unknown;
+		GLuint active_unit = Unknown;
+		struct {
+			GLenum target = GL_TEXTURE_2D;
+			GLuint texture = Unknown;
+		} textures[Drawable::Pipeline::TextureCount + 2]; //(pipeline textures, then the per-object and per-instance data buffers)
+		uint8_t clip_distances = 0xff; //0xff == unknown
+		//uniforms stay with their program, so vertex decoding values are tracked per program:
+		struct VertexDecode {
+			glm::vec3 position_offset = glm::vec3(0.0f);
+			glm::vec3 position_scale = glm::vec3(1.0f);
+			bool octahedral_normals = false;
+		};
+		std::unordered_map< GLuint, VertexDecode > vertex_decode; //(programs not listed are unknown)
+
+		//GL calls made (binds, uniforms, draws) and binds skipped since the last invalidate():
+		uint32_t issued = 0;
+		uint32_t skipped = 0;
+		uint32_t draws = 0; //(just the draw calls)
+	};
+	mutable GLStateCache gl_state;
+
+	//Drawables collected for one view, sorted so that ones sharing a program / vertex array / textures (and then mesh) draw back-to-back:
+	// (one queue is reused by every view, since views at different recursion levels never fill it at the same time)
+	// Runs of drawables that share all of that draw as one instanced call; see draw_render_queue().
+	struct RenderQueue {
+		struct Item {
+			uint64_t key;
+			Drawable const *drawable;
+			uint32_t lod; //0 for the full mesh, otherwise 1 + index in the pipeline's lods
+		};
+		std::vector< Item > items;
+		//consecutive items that draw as one call:
+		struct Run {
+			size_t begin, end;
+			uint32_t instance_base; //(start of the run's objects in 'instances', if it has more than one item)
+		};
+		std::vector< Run > runs;
+		std::vector< int32_t > instances; //object indices of batched drawables, uploaded to instance_data_buffer
+		void clear() { items.clear(); runs.clear(); instances.clear(); }
+		void push(Drawable const &drawable, uint32_t lod = 0);
+		void sort();
+	};
+	mutable RenderQueue render_queue;
+
+	//can these two drawables be drawn by the same instanced call?
+	static bool can_batch(Drawable::Pipeline const &a, Drawable::Pipeline const &b);
+
+	//draw (and then clear) render_queue:
+	void draw_render_queue(glm::mat4 const &world_to_clip, glm::mat4x3 const &world_to_light, uint8_t clip_plane_count, glm::vec4 const &clip_plane) const;
+
+	//Occlusion queries let recursion skip portals that are in the frustum but hidden behind something:
+	enum class PortalOcclusion : uint8_t {
+		Off, //recurse into every portal in the frustum
+		Conditional, //query the portal's stencil mask as it's written; the GPU skips the view behind it if no samples passed
+		LastFrame, //query each portal after its level is drawn; next frame, skip (on the CPU) portals whose query saw nothing
+	};
+	// (Conditional never shows anything wrong, but only saves GPU work, and only sees what was drawn before the portal
+	//  -- mostly parent portals' outlines. LastFrame also catches walls in the portal's own cell and saves CPU work,
+	//  but a portal coming out from behind a wall is shown empty for a frame.)
+	PortalOcclusion portal_occlusion = PortalOcclusion::Conditional;
+
+	struct OcclusionStats {
+		uint32_t queries = 0; //queries issued this frame
+		uint32_t skipped = 0; //recursions skipped this frame (PortalOcclusion::LastFrame only)
+	};
+	mutable OcclusionStats occlusion_stats;
+
+	//Queries (and texture-mode views) are kept per portal per "spot" it is seen from (the portal the view came through, and recursion level):
+	struct PortalSpot {
+		Portal const *from;
+		Portal const *portal;
+		GLint recursion_lvl;
+		bool operator<(PortalSpot const &o) const {
+			if (from != o.from) return std::less< Portal const * >()(from, o.from);
+			if (portal != o.portal) return std::less< Portal const * >()(portal, o.portal);
+			return recursion_lvl < o.recursion_lvl;
+		}
+	};
+	struct PortalQueries {
+		std::vector< GLuint > queries; //(one per time the spot was reached in a frame)
+		uint32_t used = 0; //queries used this frame
+		bool visible = true; //did any of last frame's queries pass samples? (true if unknown)
+	};
+	mutable std::map< PortalSpot, PortalQueries > portal_queries;
+	GLuint acquire_portal_query(PortalSpot const &key) const;
+	void collect_portal_queries() const; //read last frame's results (without waiting) and recycle the pool
+
+	//Transform data shared by every draw, for programs that set Pipeline::OBJECT_INDEX_int:
+	// - per-view: a uniform block at ViewBlockBinding,
+	//     layout(std140) uniform View { mat4 WORLD_TO_CLIP; vec4 CLIP_PLANE; };
+	//   rewritten only when a draw's view differs from the last one;
+	// - per-object: a buffer texture on unit ObjectDataUnit holding ObjectDataTexels RGBA32F texels per object:
+	//     the rows of object-to-world (3 texels), then the columns of normal-to-world (3 texels, w unused);
+	//   written once per frame by upload_object_data().
+	// - per-instance: a buffer texture on unit InstanceDataUnit holding R32I object indices, written once per view.
+	//   A negative OBJECT_INDEX marks an instanced draw: instance i uses the object at INSTANCES[-OBJECT_INDEX - 1 + i].
+	// (such programs work in world space, i.e., they assume world_to_light is the identity, as it is in draw())
+	enum : GLuint {
+		ViewBlockBinding = 0,
+		ObjectDataUnit = Drawable::Pipeline::TextureCount,
+		InstanceDataUnit = Drawable::Pipeline::TextureCount + 1,
+		ObjectDataTexels = 6,
+	};
+	void upload_object_data() const;
+	void set_view(glm::mat4 const &world_to_clip, glm::vec4 const &clip_plane) const;
+
+	//GL objects backing the above (created on first draw; not shared by scene copies):
+	mutable GLuint view_buffer = 0;
+	mutable GLuint object_data_buffer = 0;
+	mutable GLuint object_data_tex = 0;
+	mutable GLuint instance_data_buffer = 0;
+	mutable GLuint instance_data_tex = 0;
+	mutable std::vector< glm::vec4 > object_data; //staging for object_data_buffer
+	mutable std::vector< glm::vec4 > previous_object_data; //last frame's, to notice when anything moved
+	mutable std::vector< GLuint > pipeline_data, previous_pipeline_data; //programs, ranges, and textures drawn (likewise)
+	mutable uint64_t contents_version = 0; //bumped whenever object data or pipelines change from one frame to the next
+	mutable bool view_current = false; //does view_buffer hold current_view_*?
+	mutable glm::mat4 current_view_world_to_clip = glm::mat4(1.0f);
+	mutable glm::vec4 current_view_clip_plane = glm::vec4(0.0f);
+
 	//The "draw" function provides a convenient way to pass all the things in a scene to OpenGL:
 	void draw(Camera const &camera) const;
+	//...the camera may also live in some other scene's transforms (e.g., a viewer's camera-only scene):
+	void draw(Camera const &camera, TransformStore const &camera_transforms) const;
 
 	//This is the actual recursive portal render function
 	void draw(glm::mat4 const &cam_projection, 
-		Transform const &cam_transform, 
-		glm::vec4 const &clip_plane = glm::vec4(0), 
+		glm::mat4x3 const &cam_to_world, 
+		glm::vec4 const &clip_plane, 
 		GLint max_recursion_lvl = 0, 
 		GLint recursion_lvl = 0,
-		Portal const *from = nullptr) const;
+		Portal const *from = nullptr,
+		ScreenRect const &view_rect = ScreenRect(),
+		GLuint entry_query = 0, //(with PortalOcclusion::Conditional: query for the portal this view is seen through)
+		uint32_t plan_node = 0) const; //(with a recursion budget: this view's node in budget_plan)
 	
 	// Technically can't draw beyond 255 here but feel free to go above to waste resources
 	GLint default_draw_recursion_max = 4;
 
-	//This helper function draws normal drawables
+	//How portals show what's behind them:
+	enum class PortalMode : uint8_t {
+		Stencil, //redraw each view through each portal every frame, masked by the stencil buffer
+		Texture, //draw each view into its own offscreen target, then texture the portal mesh with it
+	};
+	// In texture mode, each path of portals from the camera gets its own view (so a portal seen along two paths
+	//  shows what each path's camera sees), drawn into a target from a small pool and sized to the portal's rectangle
+	//  on screen. Views whose camera and scene contents haven't changed are reused from earlier frames.
+	//  Portals past the depth cap, the recursion budget, or max_portal_views show the clear color.
+	// (needs pipelines with PORTAL_VIEWPORT_vec4 on portal meshes; others draw as plain meshes)
+	PortalMode portal_mode = PortalMode::Stencil;
+
+	//An offscreen color + depth/stencil target:
+	struct OffscreenTarget {
+		GLuint framebuffer = 0;
+		GLuint color_tex = 0;
+		GLuint depth_rb = 0;
+		glm::uvec2 size = glm::uvec2(0);
+		void release();
+	};
+	//(re)allocate a target to match 'size':
+	void prepare_target(OffscreenTarget &target, glm::uvec2 const &size) const;
+
+	//Portals crossed to reach a view, nearest the camera first:
+	using PortalPath = std::vector< Portal const * >;
+	//The last image drawn of the view at the end of a path:
+	struct PortalView {
+		uint32_t target = -1U; //index in portal_view_targets (-1U if the image has been dropped)
+		glm::uvec2 extent = glm::uvec2(0); //part of the target the image covers (from its lower-left corner)
+		//what the image was drawn with (to decide if it can be reused):
+		glm::mat4 world_to_clip = glm::mat4(1.0f);
+		glm::vec4 clip_plane = glm::vec4(0.0f);
+		uint64_t contents_version = 0;
+		uint64_t sampled_serial = 0; //newest serial among the views it shows in its own portals
+		uint64_t serial = 0; //when it was last drawn (from portal_view_serial)
+		uint64_t used_frame = 0; //last frame it was wanted (views unused for a while are forgotten)
+	};
+	mutable std::map< PortalPath, PortalView > portal_views;
+	mutable std::vector< OffscreenTarget > portal_view_targets; //pool shared by all portal views (grows only)
+	uint32_t max_portal_views = 16; //most portal views drawn per frame (and so most targets allocated)
+	mutable uint64_t portal_view_serial = 0;
+	mutable uint64_t frame_number = 0;
+	mutable GLuint blank_view_tex = 0; //1x1 clear color, for portals with no view
+	float portal_view_tolerance = 1e-5f; //largest camera matrix change that still counts as "the same view"
+
+	struct PortalViewStats {
+		uint32_t drawn = 0; //views drawn this frame
+		uint32_t reused = 0; //views reused from earlier frames
+	};
+	mutable PortalViewStats portal_view_stats;
+
+	//Cached views notice moved objects and changed pipelines (programs, textures, ranges) on their own;
+	// call this after changing the contents of a texture in place:
+	void invalidate_portal_views() { contents_version += 1; }
+
+	//texture-mode counterpart of the recursive draw:
+	void draw_textured(glm::mat4 const &cam_projection, glm::mat4x3 const &cam_to_world, glm::vec4 const &clip_plane, GLint max_recursion_lvl) const;
+	//draw a portal mesh showing a view's image (or the clear color, if target is null); 'viewport' maps window coordinates to image coordinates:
+	void draw_portal_texture(Portal const &portal, OffscreenTarget const *target, glm::mat4 const &world_to_clip, glm::vec4 const &clip_plane, glm::vec3 const &cam_position, glm::vec4 const &viewport) const;
+
+	//world-to-world transform for something passing through a portal to its destination:
+	glm::mat4 portal_transfer(Portal const &portal) const;
+
+	//How views through portals get rid of what's between their camera and the destination portal:
+	enum class PortalClip : uint8_t {
+		ClipDistance, //a per-vertex clip plane (gl_ClipDistance)
+		ObliqueNear, //the projection's near plane, tilted to lie on the portal
+	};
+	// Oblique near planes need no clip distances in the shaders, but trade away some depth precision;
+	//  views whose camera isn't behind the portal plane fall back to ClipDistance.
+	PortalClip portal_clip = PortalClip::ClipDistance;
+	//projection for a view whose clipping plane is 'clip_plane' (sets *oblique if the plane was folded into its near plane):
+	glm::mat4 view_projection(glm::mat4 const &cam_projection, glm::mat4x3 const &cam_to_world, glm::vec4 const &clip_plane, bool *oblique) const;
+
+	//Resolution scale for the view at each recursion level (index 0 is the camera's own view, 1 is through one portal, ...):
+	// levels past the end use the last entry. Views drawn at a lower scale than the view around them go through a
+	// reduced-size offscreen target, which is then composited into the portal's stencil region (stencil mode),
+	// or simply get a smaller target (texture mode).
+	std::vector< float > level_scales = { 1.0f, 1.0f, 0.5f, 0.5f, 0.25f };
+	float level_scale(GLint level) const;
+
+	//state for drawing into reduced-resolution targets:
+	mutable std::vector< OffscreenTarget > scaled_targets; //one per nesting depth
+	mutable uint32_t scaled_depth = 0; //how many reduced-resolution targets are being drawn into right now
+	mutable GLint level_offset = 0; //recursion level (in the camera's terms) of the current target's level 0
+	mutable float target_scale = 1.0f; //resolution scale of the current target
+	mutable glm::ivec4 root_viewport = glm::ivec4(0); //viewport of the camera's own view
+	void draw_scaled(float scale, glm::mat4 const &cam_projection, glm::mat4x3 const &new_cam_to_world, glm::vec4 const &new_clip_plane,
+		GLint recursion_lvl, GLint max_recursion_lvl, Portal const *dest, ScreenRect const &p_rect, GLuint query, uint32_t plan_node) const;
+
+	//Adaptive recursion: within the depth cap above, only look through portals that cover enough of the screen,
+	// and only until this frame's budget is spent. The portals left over are filled with the clear color,
+	// so this is off by default (F3 in PlayMode turns it on).
+	// The budget is handed out breadth-first: every level's portals (largest first) are served before any deeper ones,
+	// so a deep chain behind one portal can't starve a big sibling portal near the camera.
+	struct RecursionBudget {
+		bool enabled = false;
+		float min_pixels = 256.0f; //smallest portal (by screen rectangle area, in pixels) worth looking through
+		uint32_t max_views = 64; //most portal views drawn per frame
+		float max_milliseconds = 0.0f; //CPU time draw() may spend before it stops opening portals (0 = no limit)
+	} recursion_budget;
+
+	struct BudgetStats {
+		uint32_t views = 0; //portal views drawn this frame
+		uint32_t stopped = 0; //portals only given the clear fill this frame
+	};
+	mutable BudgetStats budget_stats;
+	mutable std::chrono::steady_clock::time_point draw_start;
+	bool open_portal_view(float pixels) const; //checks (and, if open, spends) the budget
+	bool open_planned_view() const; //...for a view plan_recursion already sized up: just the view count and time limit
+
+	//Which portal views the stencil path opens this frame, decided level by level before drawing starts:
+	// (node 0 is the camera's view; links record the views opened from each node)
+	struct BudgetPlanNode {
+		Portal const *from; //portal this view looks out of (nullptr for the camera)
+		GLint level; //recursion level, in the camera's terms
+		glm::mat4x3 cam_to_world;
+		glm::vec4 clip_plane;
+		ScreenRect view_rect;
+	};
+	struct BudgetPlanLink {
+		uint32_t parent;
+		Portal const *portal;
+		uint32_t child;
+	};
+	struct BudgetPlanCandidate {
+		uint32_t parent;
+		Portal const *portal;
+		ScreenRect rect;
+		float pixels;
+	};
+	mutable std::vector< BudgetPlanNode > budget_plan;
+	mutable std::vector< BudgetPlanLink > budget_plan_links;
+	mutable std::vector< BudgetPlanCandidate > budget_plan_candidates; //(scratch)
+	static constexpr uint32_t NotPlanned = -1U;
+	void plan_recursion(glm::mat4 const &cam_projection, glm::mat4x3 const &cam_to_world, glm::vec4 const &clip_plane, GLint max_recursion_lvl) const;
+	uint32_t planned_view(uint32_t plan_node, Portal const *portal) const; //child node, or NotPlanned
+
+	//This helper function draws normal drawables in 'cell' (nullptr for all cells), skipping those outside of 'frustum'
+	// or entirely behind 'clip_plane' (when it isn't all zero, whether or not use_clip also clips against it on the GPU)
 	void draw_non_portals(glm::mat4 const &world_to_clip, 
+		Frustum const &frustum,
+		GLint recursion_lvl,
+		std::string const *cell,
 		glm::mat4x3 const &world_to_light = glm::mat4x3(1.0f), 
 		bool const &use_clip = false,
 		glm::vec4 const &clip_plane = glm::vec4(0)) const;
 
 	//And this one draws a single drawable
+	// (or, given instance_count > 0, that many instances of its mesh, with objects listed at instance_base in render_queue.instances)
+	// (lod picks one of the pipeline's coarser meshes, as returned by select_lod; 0 draws the full mesh)
+	// (texture0, if not 0, is bound as a GL_TEXTURE_2D on unit 0 in place of the pipeline's first texture)
 	void draw_one(Drawable const &drawable, glm::mat4 const &world_to_clip, 
 		glm::mat4x3 const &world_to_light = glm::mat4x3(1.0f), 
 		uint8_t const &clip_plane_count = 0,
 		glm::vec4 const &clip_plane = glm::vec4(0), 
-		glm::vec4 const &self_clip_plane = glm::vec4(0)) const; 
+		glm::vec4 const &self_clip_plane = glm::vec4(0),
+		uint32_t instance_count = 0,
+		uint32_t instance_base = 0,
+		uint32_t lod = 0,
+		GLuint texture0 = 0) const; 
 
 	// Draw a tri covering the entire screen. Useful for selective depth buffer operations.
 	// https://stackoverflow.com/questions/2588875/whats-the-best-way-to-draw-a-fullscreen-quad-in-opengl-3-2
@@ -294,7 +941,14 @@ struct Scene {
 	} full_tri_program;
 
 	// Test if portal is visible in view frustum
-	bool is_portal_visible(glm::mat4 const &world_to_clip, Portal const &portal) const;
+	bool is_portal_visible(Frustum const &frustum, Portal const &portal) const;
+
+	// Screen rectangle covered by a portal (conservative; clipped to view_rect, and possibly empty)
+	ScreenRect get_portal_rect(glm::mat4 const &world_to_clip, Portal const &portal, ScreenRect const &view_rect) const;
+
+	// Restrict fragment work to a screen rectangle (in terms of the viewport recorded by draw(Camera)):
+	void set_scissor(ScreenRect const &rect) const;
+	mutable glm::ivec4 draw_viewport = glm::ivec4(0);
 
 	struct Texture {
 		Texture(std::string const &filename);
@@ -339,26 +993,30 @@ struct Scene {
 	// the 'on_drawable' callback gives your code a chance to look up mesh data and make Drawables:
 	// throws on file format errors
 	void load(std::string const &filename,
-		std::function< void(Scene &, Transform *, std::string const &) > const &on_drawable = nullptr,
-		std::function< void(Scene &, Transform *, std::string const &, std::string const &, std::string const &, std::string const &) > const &on_portal = nullptr,
-		std::function< void(Scene &, Transform *, std::string const &) > const &on_button = nullptr
+		std::function< void(Scene &, Transform, std::string const &) > const &on_drawable = nullptr,
+		std::function< void(Scene &, Transform, std::string const &, std::string const &, std::string const &, std::string const &) > const &on_portal = nullptr,
+		std::function< void(Scene &, Transform, std::string const &) > const &on_button = nullptr
 	);
 
 	//this function is called to read extra chunks from the scene file after the main chunks are read:
 	// this is useful if you, e.g., subclassing scene to represent a game level/area
-	virtual void load_extra(std::istream &from, std::vector< char > const &str0, std::vector< Transform * > const &xfh0) { }
+	// (read chunks from 'from' with read_chunk; spans into it are only valid during the call)
+	virtual void load_extra(MappedChunks &from, ChunkSpan< char > const &str0, std::vector< Transform > const &xfh0) { }
 
 	//empty scene:
 	Scene() = default;
 
+	//frees the scene's own GL objects (if it ever drew):
+	virtual ~Scene();
+
 	//load a scene:
-	Scene(std::string const &filename, std::function< void(Scene &, Transform *, std::string const &) > const &on_drawable,
-		std::function< void(Scene &, Transform *, std::string const &, std::string const &, std::string const &, std::string const &) > const &on_portal, 
-		std::function< void(Scene &, Transform *, std::string const &) > const &on_button);
+	Scene(std::string const &filename, std::function< void(Scene &, Transform, std::string const &) > const &on_drawable,
+		std::function< void(Scene &, Transform, std::string const &, std::string const &, std::string const &, std::string const &) > const &on_portal, 
+		std::function< void(Scene &, Transform, std::string const &) > const &on_button);
 
-	//copy a scene (with proper pointer fixup):
+	//copy a scene (transform handles remain valid in the copy, so the transform arrays just get copied):
 	Scene(Scene const &); //...as a constructor
 	Scene &operator=(Scene const &); //...as scene = scene
-	//... as a set() function that optionally returns the transform->transform mapping:
-	void set(Scene const &, std::unordered_map< Transform const *, Transform * > *transform_map = nullptr);
+	//... as a set() function:
+	void set(Scene const &);
 };
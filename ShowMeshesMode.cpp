@@ -10,16 +10,14 @@ ShowMeshesMode::ShowMeshesMode(MeshBuffer const &buffer_) : buffer(buffer_) {
 
 	//Set up scene:
 	{ //create a single camera:
-		scene.transforms.emplace_back();
-		scene.cameras.emplace_back(&scene.transforms.back());
+		scene.cameras.emplace_back(scene.transforms.create("Camera"));
 		scene_camera = &scene.cameras.back();
 		scene_camera->fovy = 60.0f / 180.0f * 3.1415926f;
 		scene_camera->near = 0.01f;
 		//scene_camera->transform and scene_camera->aspect will be set in draw()
 	}
 	{ //create a drawable to hold the current mesh:
-		scene.transforms.emplace_back();
-		scene.drawables.emplace_back(&scene.transforms.back());
+		scene.drawables.emplace_back(scene.transforms.create("Mesh"));
 		scene_drawable = &scene.drawables.back();
 
 		scene_drawable->pipeline = show_meshes_program_pipeline;
@@ -28,6 +26,7 @@ ShowMeshesMode::ShowMeshesMode(MeshBuffer const &buffer_) : buffer(buffer_) {
 		scene_drawable->pipeline.type = GL_TRIANGLES;
 		scene_drawable->pipeline.start = 0;
 		scene_drawable->pipeline.count = 0;
+		scene_drawable->pipeline.index_type = GL_NONE;
 	}
 
 	//select first mesh in buffer:
@@ -69,7 +68,7 @@ bool ShowMeshesMode::handle_event(SDL_Event const &evt, glm::uvec2 const &window
 			if (SDL_GetModState() & KMOD_SHIFT) {
 				//shift: pan
 
-				glm::mat3 frame = glm::mat3_cast(scene_camera->transform->rotation);
+				glm::mat3 frame = glm::mat3_cast(scene.transforms.get_rotation(scene_camera->transform));
 				camera.target -= frame[0] * (delta.x * camera.radius) + frame[1] * (delta.y * camera.radius);
 			} else {
 				//no shift: tumble
@@ -104,12 +103,13 @@ bool ShowMeshesMode::handle_event(SDL_Event const &evt, glm::uvec2 const &window
 void ShowMeshesMode::draw(glm::uvec2 const &drawable_size) {
 	//--- use camera structure to set up scene camera ---
 
-	scene_camera->transform->rotation =
+	glm::quat &rotation = scene.transforms.rotation(scene_camera->transform);
+	rotation =
 		glm::angleAxis(camera.azimuth, glm::vec3(0.0f, 0.0f, 1.0f))
 		* glm::angleAxis(0.5f * 3.1415926f + -camera.elevation, glm::vec3(1.0f, 0.0f, 0.0f))
 	;
-	scene_camera->transform->position = camera.target + camera.radius * (scene_camera->transform->rotation * glm::vec3(0.0f, 0.0f, 1.0f));
-	scene_camera->transform->scale = glm::vec3(1.0f);
+	scene.transforms.position(scene_camera->transform) = camera.target + camera.radius * (rotation * glm::vec3(0.0f, 0.0f, 1.0f));
+	scene.transforms.scale(scene_camera->transform) = glm::vec3(1.0f);
 	scene_camera->aspect = float(drawable_size.x) / float(drawable_size.y);
 
 
@@ -123,7 +123,7 @@ void ShowMeshesMode::draw(glm::uvec2 const &drawable_size) {
 	scene.draw(*scene_camera);
 
 	{ //decorate with some lines:
-		DrawLines draw_lines(scene_camera->make_projection() * glm::mat4(scene_camera->transform->make_world_to_local()));
+		DrawLines draw_lines(scene_camera->make_projection() * glm::mat4(scene.transforms.make_world_to_local(scene_camera->transform)));
 
 		//axis (unit-length):
 		draw_lines.draw(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(1.0f, 0.0f, 0.0f), glm::u8vec4(0xff, 0x00, 0x00, 0xff));
@@ -161,6 +161,10 @@ void ShowMeshesMode::select_prev_mesh() {
 		scene_drawable->pipeline.type = f->second.type;
 		scene_drawable->pipeline.start = f->second.start;
 		scene_drawable->pipeline.count = f->second.count;
+		scene_drawable->pipeline.index_type = f->second.index_type;
+		scene_drawable->pipeline.position_offset = f->second.position_offset;
+		scene_drawable->pipeline.position_scale = f->second.position_scale;
+		scene_drawable->pipeline.octahedral_normals = f->second.octahedral_normals;
 		current_mesh_min = f->second.min;
 		current_mesh_max = f->second.max;
 	} else {
@@ -168,6 +172,7 @@ void ShowMeshesMode::select_prev_mesh() {
 		scene_drawable->pipeline.type = GL_TRIANGLES;
 		scene_drawable->pipeline.start = 0;
 		scene_drawable->pipeline.count = 0;
+		scene_drawable->pipeline.index_type = GL_NONE;
 		current_mesh_min = glm::vec3(0.0f);
 		current_mesh_max = glm::vec3(0.0f);
 	}
@@ -190,6 +195,10 @@ void ShowMeshesMode::select_next_mesh() {
 		scene_drawable->pipeline.type = f->second.type;
 		scene_drawable->pipeline.start = f->second.start;
 		scene_drawable->pipeline.count = f->second.count;
+		scene_drawable->pipeline.index_type = f->second.index_type;
+		scene_drawable->pipeline.position_offset = f->second.position_offset;
+		scene_drawable->pipeline.position_scale = f->second.position_scale;
+		scene_drawable->pipeline.octahedral_normals = f->second.octahedral_normals;
 		current_mesh_min = f->second.min;
 		current_mesh_max = f->second.max;
 	} else {
@@ -197,6 +206,7 @@ void ShowMeshesMode::select_next_mesh() {
 		scene_drawable->pipeline.type = GL_TRIANGLES;
 		scene_drawable->pipeline.start = 0;
 		scene_drawable->pipeline.count = 0;
+		scene_drawable->pipeline.index_type = GL_NONE;
 		current_mesh_min = glm::vec3(0.0f);
 		current_mesh_max = glm::vec3(0.0f);
 	}
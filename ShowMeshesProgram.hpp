@@ -23,6 +23,10 @@ struct ShowMeshesProgram {
 	GLuint OBJECT_TO_CLIP_mat4 = -1U;
 	GLuint OBJECT_TO_LIGHT_mat4x3 = -1U;
 	GLuint NORMAL_TO_LIGHT_mat3 = -1U;
+	//vertex decoding for quantized meshes (see MeshBuffer::VertexDecodeGLSL):
+	GLuint POSITION_OFFSET_vec3 = -1U;
+	GLuint POSITION_SCALE_vec3 = -1U;
+	GLuint OCTAHEDRAL_NORMALS_bool = -1U;
 
 	GLuint INSPECT_MODE_int = -1U; //0: basic lighting; 1: position only; 2: normal only; 3: color only; 4: texcoord only
 
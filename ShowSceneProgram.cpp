@@ -2,6 +2,7 @@
 
 #include "gl_compile_program.hpp"
 #include "gl_errors.hpp"
+#include "Mesh.hpp"
 
 Scene::Drawable::Pipeline show_scene_program_pipeline;
 
@@ -13,6 +14,9 @@ Load< ShowSceneProgram > show_scene_program(LoadTagEarly, []() -> ShowSceneProgr
 	show_scene_program_pipeline.OBJECT_TO_CLIP_mat4 = ret->OBJECT_TO_CLIP_mat4;
 	show_scene_program_pipeline.OBJECT_TO_LIGHT_mat4x3 = ret->OBJECT_TO_LIGHT_mat4x3;
 	show_scene_program_pipeline.NORMAL_TO_LIGHT_mat3 = ret->NORMAL_TO_LIGHT_mat3;
+	show_scene_program_pipeline.POSITION_OFFSET_vec3 = ret->POSITION_OFFSET_vec3;
+	show_scene_program_pipeline.POSITION_SCALE_vec3 = ret->POSITION_SCALE_vec3;
+	show_scene_program_pipeline.OCTAHEDRAL_NORMALS_bool = ret->OCTAHEDRAL_NORMALS_bool;
 
 	return ret;
 });
@@ -21,12 +25,10 @@ ShowSceneProgram::ShowSceneProgram() {
 	//Compile vertex and fragment shaders using the convenient 'gl_compile_program' helper function:
 	program = gl_compile_program(
 		//vertex shader:
-		"#version 330\n"
+		std::string("#version 330\n") + MeshBuffer::VertexDecodeGLSL + //(declares Position and Normal)
 		"uniform mat4 OBJECT_TO_CLIP;\n"
 		"uniform mat4x3 OBJECT_TO_LIGHT;\n"
 		"uniform mat3 NORMAL_TO_LIGHT;\n"
-		"in vec4 Position;\n"
-		"in vec3 Normal;\n"
 		"in vec4 Color;\n"
 		"in vec2 TexCoord;\n"
 		"out vec3 position;\n"
@@ -34,9 +36,9 @@ ShowSceneProgram::ShowSceneProgram() {
 		"out vec4 color;\n"
 		"out vec2 texCoord;\n"
 		"void main() {\n"
-		"	gl_Position = OBJECT_TO_CLIP * Position;\n"
-		"	position = OBJECT_TO_LIGHT * Position;\n"
-		"	normal = NORMAL_TO_LIGHT * Normal;\n"
+		"	gl_Position = OBJECT_TO_CLIP * mesh_position();\n"
+		"	position = OBJECT_TO_LIGHT * mesh_position();\n"
+		"	normal = NORMAL_TO_LIGHT * mesh_normal();\n"
 		"	color = Color;\n"
 		"	texCoord = TexCoord;\n"
 		"}\n"
@@ -83,6 +85,9 @@ ShowSceneProgram::ShowSceneProgram() {
 	OBJECT_TO_CLIP_mat4 = glGetUniformLocation(program, "OBJECT_TO_CLIP");
 	OBJECT_TO_LIGHT_mat4x3 = glGetUniformLocation(program, "OBJECT_TO_LIGHT");
 	NORMAL_TO_LIGHT_mat3 = glGetUniformLocation(program, "NORMAL_TO_LIGHT");
+	POSITION_OFFSET_vec3 = glGetUniformLocation(program, "POSITION_OFFSET");
+	POSITION_SCALE_vec3 = glGetUniformLocation(program, "POSITION_SCALE");
+	OCTAHEDRAL_NORMALS_bool = glGetUniformLocation(program, "OCTAHEDRAL_NORMALS");
 
 	INSPECT_MODE_int = glGetUniformLocation(program, "INSPECT_MODE");
 }
@@ -1,28 +1,114 @@
 #include "WalkMesh.hpp"
 
-#include "read_write_chunk.hpp"
+#include "mapped_chunk.hpp"
 
 #include <glm/gtx/norm.hpp>
+#include <glm/gtx/quaternion.hpp>
 #include <glm/gtx/string_cast.hpp>
 
 #include <iostream>
-#include <fstream>
 #include <algorithm>
 #include <string>
+#include <utility>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define WALKMESH_SSE2
+#endif
+
+WalkMesh::WalkMesh(std::vector< glm::vec3 > vertices_, std::vector< glm::vec3 > normals_, std::vector< glm::uvec3 > triangles_)
+	: vertices(std::move(vertices_)), normals(std::move(normals_)), triangles(std::move(triangles_)) {
+
+	//half-edges leaving each vertex (counting sort by starting vertex):
+	uint32_t const half_edge_count = uint32_t(triangles.size() * 3);
+	vertex_half_edge_begin.assign(vertices.size() + 1, 0);
+	for (uint32_t he = 0; he < half_edge_count; ++he) {
+		vertex_half_edge_begin[triangles[he / 3][he % 3] + 1] += 1;
+	}
+	for (uint32_t v = 0; v < vertices.size(); ++v) {
+		vertex_half_edge_begin[v + 1] += vertex_half_edge_begin[v];
+	}
+	vertex_half_edges.resize(half_edge_count);
+	{
+		std::vector< uint32_t > fill(vertex_half_edge_begin.begin(), vertex_half_edge_begin.end() - 1);
+		for (uint32_t he = 0; he < half_edge_count; ++he) {
+			vertex_half_edges[fill[triangles[he / 3][he % 3]]++] = he;
+		}
+	}
 
-WalkMesh::WalkMesh(std::vector< glm::vec3 > const &vertices_, std::vector< glm::vec3 > const &normals_, std::vector< glm::uvec3 > const &triangles_)
-	: vertices(vertices_), normals(normals_), triangles(triangles_) {
+	//pair each half-edge (a,b) with the one running (b,a):
+	opposite.assign(half_edge_count, -1U);
+	for (uint32_t he = 0; he < half_edge_count; ++he) {
+		uint32_t const a = triangles[he / 3][he % 3];
+		uint32_t const b = triangles[he / 3][(he + 1) % 3];
+		assert(find_half_edge(a, b) == he && "each directed edge should appear in only one triangle");
+		opposite[he] = find_half_edge(b, a);
+	}
 
-	//construct next_vertex map (maps each edge to the next vertex in the triangle):
-	next_vertex.reserve(triangles.size()*3);
-	auto do_next = [this](uint32_t a, uint32_t b, uint32_t c) {
-		auto ret = next_vertex.insert(std::make_pair(glm::uvec2(a,b), c));
-		assert(ret.second);
-	};
+	//per-triangle constants:
+	triangle_data.reserve(triangles.size());
 	for (auto const &tri : triangles) {
-		do_next(tri.x, tri.y, tri.z);
-		do_next(tri.y, tri.z, tri.x);
-		do_next(tri.z, tri.x, tri.y);
+		glm::vec3 const &a = vertices[tri.x];
+		TriangleData td;
+		td.v0 = vertices[tri.y] - a;
+		td.v1 = vertices[tri.z] - a;
+		td.d00 = glm::dot(td.v0, td.v0);
+		td.d01 = glm::dot(td.v0, td.v1);
+		td.d11 = glm::dot(td.v1, td.v1);
+		td.denom = td.d00 * td.d11 - td.d01 * td.d01;
+		glm::vec3 const normal = glm::normalize(glm::cross(td.v0, td.v1));
+		td.plane = glm::vec4(normal, -glm::dot(normal, a));
+		triangle_data.emplace_back(td);
+	}
+
+	//build the BVH: split each node's triangles at the median centroid along the longest axis of their centroids' bounds
+	bvh_triangles.resize(triangles.size());
+	std::vector< glm::vec3 > centroids(triangles.size());
+	for (uint32_t ti = 0; ti < triangles.size(); ++ti) {
+		bvh_triangles[ti] = ti;
+		centroids[ti] = (vertices[triangles[ti].x] + vertices[triangles[ti].y] + vertices[triangles[ti].z]) / 3.0f;
+	}
+	bvh_nodes.reserve(2 * (triangles.size() / BVHLeafSize + 1));
+	std::vector< uint32_t > to_split;
+	if (!triangles.empty()) { //(an empty mesh gets no nodes at all)
+		bvh_nodes.emplace_back(BVHNode{glm::vec3(0.0f), glm::vec3(0.0f), 0, uint32_t(triangles.size())});
+		to_split.emplace_back(0);
+	}
+	while (!to_split.empty()) {
+		uint32_t const n = to_split.back();
+		to_split.pop_back();
+		uint32_t const first = bvh_nodes[n].first;
+		uint32_t const count = bvh_nodes[n].count;
+
+		glm::vec3 min = glm::vec3( std::numeric_limits< float >::infinity());
+		glm::vec3 max = glm::vec3(-std::numeric_limits< float >::infinity());
+		glm::vec3 c_min = min, c_max = max;
+		for (uint32_t i = first; i < first + count; ++i) {
+			glm::uvec3 const &tri = triangles[bvh_triangles[i]];
+			min = glm::min(min, glm::min(vertices[tri.x], glm::min(vertices[tri.y], vertices[tri.z])));
+			max = glm::max(max, glm::max(vertices[tri.x], glm::max(vertices[tri.y], vertices[tri.z])));
+			c_min = glm::min(c_min, centroids[bvh_triangles[i]]);
+			c_max = glm::max(c_max, centroids[bvh_triangles[i]]);
+		}
+		bvh_nodes[n].min = min;
+		bvh_nodes[n].max = max;
+		if (count <= BVHLeafSize) continue;
+
+		glm::vec3 const extent = c_max - c_min;
+		uint32_t const axis = (extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2));
+		uint32_t const mid = first + count / 2;
+		std::nth_element(bvh_triangles.begin() + first, bvh_triangles.begin() + mid, bvh_triangles.begin() + first + count, [&](uint32_t a, uint32_t b) {
+			return centroids[a][axis] < centroids[b][axis];
+		});
+
+		uint32_t const child = uint32_t(bvh_nodes.size());
+		bvh_nodes.emplace_back(BVHNode{glm::vec3(0.0f), glm::vec3(0.0f), first, mid - first});
+		bvh_nodes.emplace_back(BVHNode{glm::vec3(0.0f), glm::vec3(0.0f), mid, first + count - mid});
+		bvh_nodes[n].first = child;
+		bvh_nodes[n].count = 0;
+		to_split.emplace_back(child);
+		to_split.emplace_back(child + 1);
 	}
 
 	//DEBUG: are vertex normals consistent with geometric normals?
@@ -40,21 +126,61 @@ WalkMesh::WalkMesh(std::vector< glm::vec3 > const &vertices_, std::vector< glm::
 	// }
 }
 
-//project pt to the plane of triangle a,b,c and return the barycentric weights of the projected point:
-glm::vec3 barycentric_weights(glm::vec3 const &a, glm::vec3 const &b, glm::vec3 const &c, glm::vec3 const &pt) {
-	// credit https://gamedev.stackexchange.com/questions/23743/whats-the-most-efficient-way-to-find-barycentric-coordinates
-	glm::vec3 const &v0 = b - a, &v1 = c - a, &v2 = pt - a;
-	float const &d00 = glm::dot(v0, v0);
-	float const &d01 = glm::dot(v0, v1);
-	float const &d11 = glm::dot(v1, v1);
-	float const &d20 = glm::dot(v2, v0);
-	float const &d21 = glm::dot(v2, v1);
-	float const &denom = d00 * d11 - d01 * d01;
-	float const &v = (d11 * d20 - d01 * d21) / denom;
-	float const &w = (d00 * d21 - d01 * d20) / denom;
-	float const &u = 1.0f - v - w;
-	
-	return glm::vec3(u, v, w);
+float WalkMesh::closest_on_triangle(uint32_t ti, glm::vec3 const &world_point, WalkPoint *at) const {
+	assert(at);
+	glm::uvec3 const &tri = triangles[ti];
+
+	//get barycentric coordinates of closest point in the plane of the triangle:
+	glm::vec3 coords = triangle_weights(ti, world_point);
+
+	//is that point inside the triangle?
+	if (coords.x >= 0.0f && coords.y >= 0.0f && coords.z >= 0.0f) {
+		//yes, point is inside triangle.
+		*at = WalkPoint(tri, coords, ti);
+		return glm::length2(world_point - to_world_point(*at));
+	}
+
+	//no, so check triangle vertices and edges:
+	float closest_dis2 = std::numeric_limits< float >::infinity();
+	auto check_edge = [&world_point, &at, &closest_dis2, this](uint32_t ai, uint32_t bi, uint32_t ci) {
+		glm::vec3 const &a = vertices[ai];
+		glm::vec3 const &b = vertices[bi];
+
+		//find closest point on line segment ab:
+		float along = glm::dot(world_point-a, b-a);
+		float max = glm::dot(b-a, b-a);
+		glm::vec3 pt;
+		glm::vec3 coords;
+		if (along < 0.0f) {
+			pt = a;
+			coords = glm::vec3(1.0f, 0.0f, 0.0f);
+		} else if (along > max) {
+			pt = b;
+			coords = glm::vec3(0.0f, 1.0f, 0.0f);
+		} else {
+			float amt = along / max;
+			pt = glm::mix(a, b, amt);
+			coords = glm::vec3(1.0f - amt, amt, 0.0f);
+		}
+
+		float dis2 = glm::length2(world_point - pt);
+		if (dis2 < closest_dis2) {
+			closest_dis2 = dis2;
+			at->indices = glm::uvec3(ai, bi, ci);
+			at->weights = coords;
+		}
+	};
+	check_edge(tri.x, tri.y, tri.z);
+	check_edge(tri.y, tri.z, tri.x);
+	check_edge(tri.z, tri.x, tri.y);
+	at->triangle = ti;
+	return closest_dis2;
+}
+
+//squared distance from a point to an axis-aligned box (zero inside it):
+static float box_dis2(glm::vec3 const &min, glm::vec3 const &max, glm::vec3 const &pt) {
+	glm::vec3 const d = glm::max(glm::max(min - pt, pt - max), glm::vec3(0.0f));
+	return glm::dot(d, d);
 }
 
 WalkPoint WalkMesh::nearest_walk_point(glm::vec3 const &world_point) const {
@@ -62,59 +188,62 @@ WalkPoint WalkMesh::nearest_walk_point(glm::vec3 const &world_point) const {
 
 	WalkPoint closest;
 	float closest_dis2 = std::numeric_limits< float >::infinity();
-
-	for (auto const &tri : triangles) {
-		//find closest point on triangle:
-
-		glm::vec3 const &a = vertices[tri.x];
-		glm::vec3 const &b = vertices[tri.y];
-		glm::vec3 const &c = vertices[tri.z];
-
-		//get barycentric coordinates of closest point in the plane of (a,b,c):
-		glm::vec3 coords = barycentric_weights(a,b,c, world_point);
-
-		//is that point inside the triangle?
-		if (coords.x >= 0.0f && coords.y >= 0.0f && coords.z >= 0.0f) {
-			//yes, point is inside triangle.
-			float dis2 = glm::length2(world_point - to_world_point(WalkPoint(tri, coords)));
-			if (dis2 < closest_dis2) {
-				closest_dis2 = dis2;
-				closest.indices = tri;
-				closest.weights = coords;
+	uint32_t closest_ti = -1U;
+	if (bvh_nodes.empty()) return closest;
+
+	//depth-first, nearer child first, skipping nodes that can't hold anything closer:
+	uint32_t stack[64];
+	uint32_t stack_size = 0;
+	stack[stack_size++] = 0;
+	while (stack_size > 0) {
+		BVHNode const &node = bvh_nodes[stack[--stack_size]];
+		//(ties don't prune, so the result matches nearest_walk_point_linear exactly -- see below)
+		if (box_dis2(node.min, node.max, world_point) > closest_dis2) continue;
+
+		if (node.count > 0) {
+			for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+				uint32_t const ti = bvh_triangles[i];
+				WalkPoint at;
+				float const dis2 = closest_on_triangle(ti, world_point, &at);
+				//equally-close triangles go to the lowest index, as in a linear scan:
+				if (dis2 < closest_dis2 || (dis2 == closest_dis2 && ti < closest_ti)) {
+					closest_dis2 = dis2;
+					closest_ti = ti;
+					closest = at;
+				}
 			}
 		} else {
-			//check triangle vertices and edges:
-			auto check_edge = [&world_point, &closest, &closest_dis2, this](uint32_t ai, uint32_t bi, uint32_t ci) {
-				glm::vec3 const &a = vertices[ai];
-				glm::vec3 const &b = vertices[bi];
-
-				//find closest point on line segment ab:
-				float along = glm::dot(world_point-a, b-a);
-				float max = glm::dot(b-a, b-a);
-				glm::vec3 pt;
-				glm::vec3 coords;
-				if (along < 0.0f) {
-					pt = a;
-					coords = glm::vec3(1.0f, 0.0f, 0.0f);
-				} else if (along > max) {
-					pt = b;
-					coords = glm::vec3(0.0f, 1.0f, 0.0f);
-				} else {
-					float amt = along / max;
-					pt = glm::mix(a, b, amt);
-					coords = glm::vec3(1.0f - amt, amt, 0.0f);
-				}
+			float const d0 = box_dis2(bvh_nodes[node.first].min, bvh_nodes[node.first].max, world_point);
+			float const d1 = box_dis2(bvh_nodes[node.first + 1].min, bvh_nodes[node.first + 1].max, world_point);
+			assert(stack_size + 2 <= 64 && "BVH deeper than expected");
+			//(push the farther child first, so the nearer one is visited first)
+			if (d0 <= d1) {
+				stack[stack_size++] = node.first + 1;
+				stack[stack_size++] = node.first;
+			} else {
+				stack[stack_size++] = node.first;
+				stack[stack_size++] = node.first + 1;
+			}
+		}
+	}
+	assert(closest.indices.x < vertices.size());
+	assert(closest.indices.y < vertices.size());
+	assert(closest.indices.z < vertices.size());
+	return closest;
+}
 
-				float dis2 = glm::length2(world_point - pt);
-				if (dis2 < closest_dis2) {
-					closest_dis2 = dis2;
-					closest.indices = glm::uvec3(ai, bi, ci);
-					closest.weights = coords;
-				}
-			};
-			check_edge(tri.x, tri.y, tri.z);
-			check_edge(tri.y, tri.z, tri.x);
-			check_edge(tri.z, tri.x, tri.y);
+WalkPoint WalkMesh::nearest_walk_point_linear(glm::vec3 const &world_point) const {
+	assert(!triangles.empty() && "Cannot start on an empty walkmesh");
+
+	WalkPoint closest;
+	float closest_dis2 = std::numeric_limits< float >::infinity();
+
+	for (uint32_t ti = 0; ti < triangles.size(); ++ti) {
+		WalkPoint at;
+		float const dis2 = closest_on_triangle(ti, world_point, &at);
+		if (dis2 < closest_dis2) {
+			closest_dis2 = dis2;
+			closest = at;
 		}
 	}
 	assert(closest.indices.x < vertices.size());
@@ -123,6 +252,106 @@ WalkPoint WalkMesh::nearest_walk_point(glm::vec3 const &world_point) const {
 	return closest;
 }
 
+bool WalkMesh::ground_walk_point(glm::vec3 const &world_point, float max_drop, WalkPoint *at) const {
+	assert(at);
+	if (bvh_nodes.empty()) return false;
+
+	float best_drop = max_drop;
+	bool found = false;
+
+	uint32_t stack[64];
+	uint32_t stack_size = 0;
+	stack[stack_size++] = 0;
+	while (stack_size > 0) {
+		BVHNode const &node = bvh_nodes[stack[--stack_size]];
+		//the ray is a vertical segment from world_point down to world_point.z - best_drop:
+		if (world_point.x < node.min.x || world_point.x > node.max.x) continue;
+		if (world_point.y < node.min.y || world_point.y > node.max.y) continue;
+		if (node.min.z > world_point.z || node.max.z < world_point.z - best_drop) continue;
+
+		if (node.count == 0) {
+			assert(stack_size + 2 <= 64 && "BVH deeper than expected");
+			stack[stack_size++] = node.first;
+			stack[stack_size++] = node.first + 1;
+			continue;
+		}
+		for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+			glm::uvec3 const &tri = triangles[bvh_triangles[i]];
+			glm::vec2 const a = glm::vec2(vertices[tri.x]);
+			glm::vec2 const b = glm::vec2(vertices[tri.y]);
+			glm::vec2 const c = glm::vec2(vertices[tri.z]);
+			//barycentric coordinates of the point in the triangle's xy-projection:
+			float const area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+			if (area == 0.0f) continue; //vertical (or degenerate) triangle
+			glm::vec2 const p = glm::vec2(world_point);
+			float const v = ((p.x - a.x) * (c.y - a.y) - (p.y - a.y) * (c.x - a.x)) / area;
+			float const w = ((b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x)) / area;
+			float const u = 1.0f - v - w;
+			if (u < 0.0f || v < 0.0f || w < 0.0f) continue;
+
+			WalkPoint const hit(tri, glm::vec3(u, v, w), bvh_triangles[i]);
+			float const drop = world_point.z - to_world_point(hit).z;
+			if (drop < 0.0f || drop > best_drop) continue;
+			best_drop = drop;
+			*at = hit;
+			found = true;
+		}
+	}
+	return found;
+}
+
+void WalkMesh::triangles_in_radius(glm::vec3 const &world_point, float radius, std::vector< uint32_t > *out) const {
+	assert(out);
+	if (bvh_nodes.empty()) return;
+	float const radius2 = radius * radius;
+
+	uint32_t stack[64];
+	uint32_t stack_size = 0;
+	stack[stack_size++] = 0;
+	while (stack_size > 0) {
+		BVHNode const &node = bvh_nodes[stack[--stack_size]];
+		if (box_dis2(node.min, node.max, world_point) > radius2) continue;
+
+		if (node.count == 0) {
+			assert(stack_size + 2 <= 64 && "BVH deeper than expected");
+			stack[stack_size++] = node.first;
+			stack[stack_size++] = node.first + 1;
+			continue;
+		}
+		for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+			WalkPoint at;
+			if (closest_on_triangle(bvh_triangles[i], world_point, &at) <= radius2) {
+				out->emplace_back(bvh_triangles[i]);
+			}
+		}
+	}
+}
+
+
+uint32_t WalkMesh::find_half_edge(uint32_t a, uint32_t b) const {
+	for (uint32_t i = vertex_half_edge_begin[a]; i < vertex_half_edge_begin[a + 1]; ++i) {
+		uint32_t const he = vertex_half_edges[i];
+		if (triangles[he / 3][(he + 1) % 3] == b) return he;
+	}
+	return -1U;
+}
+
+uint32_t WalkMesh::triangle_of(WalkPoint const &wp, uint32_t *rotation_) const {
+	assert(rotation_);
+	auto &rotation = *rotation_;
+
+	uint32_t t = wp.triangle;
+	if (t >= triangles.size()) {
+		//not known, so look it up by the (directed) edge from wp.indices.x to wp.indices.y:
+		uint32_t const he = find_half_edge(wp.indices.x, wp.indices.y);
+		assert(he != -1U && "walkpoint isn't on this walkmesh");
+		t = he / 3;
+	}
+	glm::uvec3 const &tri = triangles[t];
+	rotation = (tri.x == wp.indices.x ? 0 : (tri.y == wp.indices.x ? 1 : 2));
+	assert(tri[rotation] == wp.indices.x && tri[(rotation + 1) % 3] == wp.indices.y && tri[(rotation + 2) % 3] == wp.indices.z);
+	return t;
+}
 
 void WalkMesh::walk_in_triangle(WalkPoint const &start, glm::vec3 const &step, WalkPoint *end_, float *time_) const {
 	assert(end_);
@@ -131,14 +360,15 @@ void WalkMesh::walk_in_triangle(WalkPoint const &start, glm::vec3 const &step, W
 	assert(time_);
 	auto &time = *time_;
 
-	glm::vec3 const &a = vertices[start.indices.x];
-	glm::vec3 const &b = vertices[start.indices.y];
-	glm::vec3 const &c = vertices[start.indices.z];
+	uint32_t rotation;
+	uint32_t const t = triangle_of(start, &rotation);
 
 	// credit Michael (@stroucki) and Jim McCann for fixing default interior case
 
 	glm::vec3 const &dest = to_world_point(start) + step;
-	glm::vec3 const &dest_bary = barycentric_weights(a, b, c, dest);
+	//(weights come out in the triangle's own order; rotate them to match start.indices)
+	glm::vec3 const tri_bary = triangle_weights(t, dest);
+	glm::vec3 const dest_bary = glm::vec3(tri_bary[rotation], tri_bary[(rotation + 1) % 3], tri_bary[(rotation + 2) % 3]);
 	float min_time = std::numeric_limits<float>::infinity();
 	unsigned int min_coord = -1U;
 	
@@ -157,7 +387,14 @@ void WalkMesh::walk_in_triangle(WalkPoint const &start, glm::vec3 const &step, W
 	check_edge(2, dest_bary.z, start.weights.z);
 	
 	time = std::min(1.0f, min_time);
-	
+
+	finish_walk_in_triangle(start, t, dest_bary, time, min_coord, &end);
+}
+
+void WalkMesh::finish_walk_in_triangle(WalkPoint const &start, uint32_t t, glm::vec3 const &dest_bary, float time, uint32_t min_coord, WalkPoint *end_) const {
+	assert(end_);
+	auto &end = *end_;
+
 	glm::vec3 const &weights = start.weights + 
 			time * (dest_bary - start.weights);
 	
@@ -189,6 +426,7 @@ void WalkMesh::walk_in_triangle(WalkPoint const &start, glm::vec3 const &step, W
 			end.weights = weights;
 			break;
 	}
+	end.triangle = t;
 }
 
 bool WalkMesh::cross_edge(WalkPoint const &start, WalkPoint *end_, glm::quat *rotation_) const {
@@ -200,15 +438,20 @@ bool WalkMesh::cross_edge(WalkPoint const &start, WalkPoint *end_, glm::quat *ro
 
 	assert(start.weights.z == 0.0f); //*must* be on an edge.
 
+	//the edge is the half-edge leaving start.indices.x in start's triangle:
+	uint32_t start_rotation;
+	uint32_t const t = triangle_of(start, &start_rotation);
+	uint32_t const twin = opposite[3 * t + start_rotation];
+
 	//check if 'edge' is a non-boundary edge:
-	auto const f = next_vertex.find(glm::uvec2(start.indices.y, start.indices.x));
-	if (f != next_vertex.end()) {
+	if (twin != -1U) {
 		//it is!
 
 		//make 'end' represent the same (world) point, but on triangle (edge.y, edge.x, [other point]):
-		uint32_t const &z = f->second;
+		uint32_t const &z = triangles[twin / 3][(twin + 2) % 3];
 		end.indices = glm::uvec3(start.indices.y, start.indices.x, z);
 		end.weights = glm::vec3(start.weights.y, start.weights.x, 0.0f);
+		end.triangle = twin / 3;
 
 		//make 'rotation' the rotation that takes (start.indices)'s normal to (end.indices)'s normal:
 		rotation = glm::rotation(start.weights.x * normals[start.indices.x] + start.weights.y * normals[start.indices.y], 
@@ -217,25 +460,278 @@ bool WalkMesh::cross_edge(WalkPoint const &start, WalkPoint *end_, glm::quat *ro
 		return true;
 	} else {
 		end = start;
+		end.triangle = t;
 		rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
 		return false;
 	}
 }
 
 
+void WalkMesh::slide_at_edge(WalkPoint *at_, glm::vec3 *remain_) const {
+	assert(at_);
+	auto &at = *at_;
+
+	assert(remain_);
+	auto &remain = *remain_;
+
+	//try to step over edge:
+	WalkPoint end;
+	glm::quat rotation;
+	if (cross_edge(at, &end, &rotation)) {
+		//stepped to a new triangle:
+		at = end;
+		//rotate step to follow surface:
+		remain = rotation * remain;
+	} else {
+		//ran into a wall, bounce / slide along it:
+		glm::vec3 const &a = vertices[at.indices.x];
+		glm::vec3 const &b = vertices[at.indices.y];
+		glm::vec3 const &c = vertices[at.indices.z];
+		glm::vec3 along = glm::normalize(b-a);
+		glm::vec3 normal = glm::normalize(glm::cross(b-a, c-a));
+		glm::vec3 in = glm::cross(normal, along);
+
+		//check how much 'remain' is pointing out of the triangle:
+		float d = glm::dot(remain, in);
+		if (d < 0.0f) {
+			//bounce off of the wall:
+			remain += (-1.25f * d) * in;
+		} else {
+			//if it's just pointing along the edge, bend slightly away from wall:
+			remain += 0.01f * d * in;
+		}
+	}
+}
+
+glm::vec3 WalkMesh::walk(WalkPoint *at_, glm::vec3 remain, uint32_t max_iterations) const {
+	assert(at_);
+	auto &at = *at_;
+
+	//using a for() instead of a while() here so that if walkpoint gets stuck in
+	// some awkward case, code will not infinite loop:
+	for (uint32_t iter = 0; iter < max_iterations; ++iter) {
+		if (remain == glm::vec3(0.0f)) break;
+		WalkPoint end;
+		float time;
+		walk_in_triangle(at, remain, &end, &time);
+		at = end;
+		if (time == 1.0f) {
+			//finished within triangle:
+			remain = glm::vec3(0.0f);
+			break;
+		}
+		//some step remains:
+		remain *= (1.0f - time);
+		slide_at_edge(&at, &remain);
+	}
+	return remain;
+}
+
+void WalkMesh::walk_batch(WalkPoint *at, glm::vec3 *step, size_t count, uint32_t threads, uint32_t max_iterations) const {
+	assert(at || count == 0);
+	assert(step || count == 0);
+
+	//small batches aren't worth a thread:
+	constexpr size_t MinPerThread = 256;
+	threads = uint32_t(std::max< size_t >(1, std::min< size_t >(threads, count / MinPerThread)));
+	if (threads <= 1) {
+		walk_range(at, step, count, max_iterations);
+		return;
+	}
+
+	//split into contiguous chunks, one per thread (the calling thread takes the first):
+	std::vector< std::thread > workers;
+	workers.reserve(threads - 1);
+	size_t const chunk = (count + threads - 1) / threads;
+	for (uint32_t i = 1; i < threads; ++i) {
+		size_t const begin = std::min(count, i * chunk);
+		size_t const end = std::min(count, begin + chunk);
+		if (begin == end) break;
+		workers.emplace_back([this, at, step, begin, end, max_iterations](){
+			walk_range(at + begin, step + begin, end - begin, max_iterations);
+		});
+	}
+	walk_range(at, step, std::min(count, chunk), max_iterations);
+	for (auto &w : workers) {
+		w.join();
+	}
+}
+
+void WalkMesh::walk_range(WalkPoint *at, glm::vec3 *remain, size_t count, uint32_t max_iterations) const {
+	//Every agent goes through exactly the same steps as in walk(); agents still walking are just
+	// gathered so that their barycentric weights and edge times can be computed together.
+	std::vector< uint32_t > active;
+	active.reserve(count);
+	for (uint32_t i = 0; i < count; ++i) {
+		if (remain[i] != glm::vec3(0.0f)) active.emplace_back(i);
+	}
+
+	std::vector< uint32_t > still_active;
+	still_active.reserve(count);
+	for (uint32_t iter = 0; iter < max_iterations && !active.empty(); ++iter) {
+		still_active.clear();
+		for (size_t g = 0; g < active.size(); g += 4) {
+			uint32_t const lanes = uint32_t(std::min< size_t >(4, active.size() - g));
+
+			//walk_in_triangle, four agents at a time:
+			WalkStep steps[4];
+			for (uint32_t l = 0; l < lanes; ++l) {
+				uint32_t const i = active[g + l];
+				steps[l].start = at[i];
+				steps[l].triangle = triangle_of(at[i], &steps[l].rotation);
+				steps[l].step = remain[i];
+			}
+			//(any unused lanes repeat the first, and are ignored)
+			for (uint32_t l = lanes; l < 4; ++l) {
+				steps[l] = steps[0];
+			}
+			step_in_triangles(steps);
+
+			for (uint32_t l = 0; l < lanes; ++l) {
+				uint32_t const i = active[g + l];
+				WalkPoint end;
+				finish_walk_in_triangle(steps[l].start, steps[l].triangle, steps[l].dest_bary, steps[l].time, steps[l].min_coord, &end);
+				at[i] = end;
+				if (steps[l].time == 1.0f) {
+					//finished within triangle:
+					remain[i] = glm::vec3(0.0f);
+					continue;
+				}
+				//some step remains:
+				remain[i] *= (1.0f - steps[l].time);
+				slide_at_edge(&at[i], &remain[i]);
+				if (remain[i] != glm::vec3(0.0f)) still_active.emplace_back(i);
+			}
+		}
+		std::swap(active, still_active);
+	}
+}
+
+void WalkMesh::step_in_triangles(WalkStep *steps) const {
+	//gather inputs, one lane per step:
+	alignas(16) float w[3][4], A[3][4], B[3][4], C[3][4], S[3][4], O[3][4], V0[3][4], V1[3][4];
+	alignas(16) float d00[4], d01[4], d11[4], denom[4];
+	for (uint32_t l = 0; l < 4; ++l) {
+		WalkStep const &s = steps[l];
+		TriangleData const &td = triangle_data[s.triangle];
+		for (uint32_t c = 0; c < 3; ++c) {
+			w[c][l] = s.start.weights[c];
+			A[c][l] = vertices[s.start.indices.x][c];
+			B[c][l] = vertices[s.start.indices.y][c];
+			C[c][l] = vertices[s.start.indices.z][c];
+			S[c][l] = s.step[c];
+			O[c][l] = vertices[triangles[s.triangle].x][c];
+			V0[c][l] = td.v0[c];
+			V1[c][l] = td.v1[c];
+		}
+		d00[l] = td.d00;
+		d01[l] = td.d01;
+		d11[l] = td.d11;
+		denom[l] = td.denom;
+	}
+
+	alignas(16) float bary[3][4]; //weights in each triangle's own order
+	alignas(16) float dest_bary[3][4]; //...rotated to each start's order
+	alignas(16) float times[4];
+	alignas(16) int32_t coords[4];
+
+	//NOTE: every operation below is the same one, in the same order, as in walk_in_triangle and triangle_weights
+	// (so results match bit-for-bit, as long as the compiler isn't fusing multiply-adds in the scalar code)
+#ifdef WALKMESH_SSE2
+	{
+		__m128 const wx = _mm_load_ps(w[0]), wy = _mm_load_ps(w[1]), wz = _mm_load_ps(w[2]);
+		//dest = to_world_point(start) + step, then relative to the triangle's first vertex:
+		__m128 v2[3];
+		for (uint32_t c = 0; c < 3; ++c) {
+			__m128 const p = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(wx, _mm_load_ps(A[c])), _mm_mul_ps(wy, _mm_load_ps(B[c]))), _mm_mul_ps(wz, _mm_load_ps(C[c]))),
+				_mm_load_ps(S[c]));
+			v2[c] = _mm_sub_ps(p, _mm_load_ps(O[c]));
+		}
+		auto dot = [&v2](float const (&u)[3][4]) {
+			return _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(v2[0], _mm_load_ps(u[0])), _mm_mul_ps(v2[1], _mm_load_ps(u[1]))), _mm_mul_ps(v2[2], _mm_load_ps(u[2])));
+		};
+		__m128 const d20 = dot(V0), d21 = dot(V1);
+		__m128 const D00 = _mm_load_ps(d00), D01 = _mm_load_ps(d01), D11 = _mm_load_ps(d11), DENOM = _mm_load_ps(denom);
+		__m128 const v = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(D11, d20), _mm_mul_ps(D01, d21)), DENOM);
+		__m128 const ww = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(D00, d21), _mm_mul_ps(D01, d20)), DENOM);
+		__m128 const u = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(1.0f), v), ww);
+		_mm_store_ps(bary[0], u);
+		_mm_store_ps(bary[1], v);
+		_mm_store_ps(bary[2], ww);
+	}
+#else
+	for (uint32_t l = 0; l < 4; ++l) {
+		glm::vec3 const b = triangle_weights(steps[l].triangle, to_world_point(steps[l].start) + steps[l].step);
+		bary[0][l] = b.x;
+		bary[1][l] = b.y;
+		bary[2][l] = b.z;
+	}
+#endif
+
+	for (uint32_t l = 0; l < 4; ++l) {
+		uint32_t const r = steps[l].rotation;
+		dest_bary[0][l] = bary[r][l];
+		dest_bary[1][l] = bary[(r + 1) % 3][l];
+		dest_bary[2][l] = bary[(r + 2) % 3][l];
+	}
+
+#ifdef WALKMESH_SSE2
+	{
+		//edge times: for each coordinate that reaches zero, time = -source / (dest - source); keep the first smallest:
+		__m128 min_time = _mm_set1_ps(std::numeric_limits< float >::infinity());
+		__m128 min_coord = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		__m128 const sign = _mm_set1_ps(-0.0f);
+		for (uint32_t c = 0; c < 3; ++c) {
+			__m128 const dest = _mm_load_ps(dest_bary[c]);
+			__m128 const source = _mm_load_ps(w[c]);
+			__m128 const time = _mm_div_ps(_mm_xor_ps(source, sign), _mm_sub_ps(dest, source));
+			__m128 const take = _mm_and_ps(_mm_cmpngt_ps(dest, _mm_setzero_ps()), _mm_cmplt_ps(time, min_time));
+			min_time = _mm_or_ps(_mm_and_ps(take, time), _mm_andnot_ps(take, min_time));
+			min_coord = _mm_or_ps(_mm_and_ps(take, _mm_castsi128_ps(_mm_set1_epi32(int32_t(c)))), _mm_andnot_ps(take, min_coord));
+		}
+		//(same as std::min(1.0f, min_time))
+		_mm_store_ps(times, _mm_min_ps(min_time, _mm_set1_ps(1.0f)));
+		_mm_store_si128(reinterpret_cast< __m128i * >(coords), _mm_castps_si128(min_coord));
+	}
+#else
+	for (uint32_t l = 0; l < 4; ++l) {
+		float min_time = std::numeric_limits< float >::infinity();
+		int32_t min_coord = -1;
+		for (uint32_t c = 0; c < 3; ++c) {
+			if (dest_bary[c][l] > 0.0f) continue;
+			float const time = -w[c][l] / (dest_bary[c][l] - w[c][l]);
+			if (time < min_time) {
+				min_time = time;
+				min_coord = int32_t(c);
+			}
+		}
+		times[l] = std::min(1.0f, min_time);
+		coords[l] = min_coord;
+	}
+#endif
+
+	for (uint32_t l = 0; l < 4; ++l) {
+		steps[l].dest_bary = glm::vec3(dest_bary[0][l], dest_bary[1][l], dest_bary[2][l]);
+		steps[l].time = times[l];
+		steps[l].min_coord = uint32_t(coords[l]);
+	}
+}
+
 WalkMeshes::WalkMeshes(std::string const &filename) {
-	std::ifstream file(filename, std::ios::binary);
+	MappedChunks file(filename);
 
-	std::vector< glm::vec3 > vertices;
+	ChunkSpan< glm::vec3 > vertices;
 	read_chunk(file, "p...", &vertices);
 
-	std::vector< glm::vec3 > normals;
+	ChunkSpan< glm::vec3 > normals;
 	read_chunk(file, "n...", &normals);
 
-	std::vector< glm::uvec3 > triangles;
+	ChunkSpan< glm::uvec3 > triangles;
 	read_chunk(file, "tri0", &triangles);
 
-	std::vector< char > names;
+	ChunkSpan< char > names;
 	read_chunk(file, "str0", &names);
 
 	struct IndexEntry {
@@ -244,10 +740,10 @@ WalkMeshes::WalkMeshes(std::string const &filename) {
 		uint32_t triangle_begin, triangle_end;
 	};
 
-	std::vector< IndexEntry > index;
+	ChunkSpan< IndexEntry > index;
 	read_chunk(file, "idxA", &index);
 
-	if (file.peek() != EOF) {
+	if (!file.at_end()) {
 		std::cerr << "WARNING: trailing data in walkmesh file '" << filename << "'" << std::endl;
 	}
 
@@ -268,7 +764,7 @@ WalkMeshes::WalkMeshes(std::string const &filename) {
 			throw std::runtime_error("Invalid triangle indices in index of '" + filename + "'");
 		}
 
-		//copy vertices/normals:
+		//copy vertices/normals (straight from the mapped file into the vectors the WalkMesh keeps):
 		std::vector< glm::vec3 > wm_vertices(vertices.begin() + e.vertex_begin, vertices.begin() + e.vertex_end);
 		std::vector< glm::vec3 > wm_normals(normals.begin() + e.vertex_begin, normals.begin() + e.vertex_end);
 
@@ -289,7 +785,7 @@ WalkMeshes::WalkMeshes(std::string const &filename) {
 		
 		std::string name(names.begin() + e.name_begin, names.begin() + e.name_end);
 
-		auto ret = meshes.emplace(name, WalkMesh(wm_vertices, wm_normals, wm_triangles));
+		auto ret = meshes.emplace(name, WalkMesh(std::move(wm_vertices), std::move(wm_normals), std::move(wm_triangles)));
 		if (!ret.second) {
 			throw std::runtime_error("WalkMesh with duplicated name '" + name + "' in '" + filename + "'");
 		}
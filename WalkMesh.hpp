@@ -1,11 +1,12 @@
 #pragma once
 
 #include <glm/glm.hpp>
-#include <glm/gtx/hash.hpp> //allows the use of 'uvec2' as an unordered_map key
+#include <glm/gtc/quaternion.hpp>
 
 #include <vector>
 #include <string>
 #include <unordered_map>
+#include <limits>
 
 //"WalkPoint" represents location on the WalkMesh as barycentric coordinates on a triangle:
 struct WalkPoint {
@@ -14,7 +15,9 @@ struct WalkPoint {
 	//barycentric coordinates for current point:
 	glm::vec3 weights = glm::vec3(std::numeric_limits< float >::quiet_NaN());
 	//NOTE: by convention, if WalkPoint is on an edge, indices/weights will be arranged so that weights.z will be 0.0.
-	WalkPoint(glm::uvec3 const &indices_, glm::vec3 const &weights_) : indices(indices_), weights(weights_) { }
+	//index of the triangle in WalkMesh::triangles, if known (WalkMesh functions fill this in; it saves looking the triangle up):
+	uint32_t triangle = -1U;
+	WalkPoint(glm::uvec3 const &indices_, glm::vec3 const &weights_, uint32_t triangle_ = -1U) : indices(indices_), weights(weights_), triangle(triangle_) { }
 	WalkPoint() = default;
 };
 
@@ -24,15 +27,86 @@ struct WalkMesh {
 	std::vector< glm::vec3 > normals; //normals for interpolated 'up' direction
 	std::vector< glm::uvec3 > triangles; //CCW-oriented
 
-	//This "next vertex" map includes [a,b]->c, [b,c]->a, and [c,a]->b for each triangle (a,b,c), and is useful for checking what's over an edge from a given point:
-	std::unordered_map< glm::uvec2, uint32_t > next_vertex;
-
-	//Construct new WalkMesh and build next_vertex structure:
-	WalkMesh(std::vector< glm::vec3 > const &vertices_, std::vector< glm::vec3 > const &normals_, std::vector< glm::uvec3 > const &triangles_);
+	//Half-edge adjacency: half-edge 3*t+e runs from triangles[t][e] to triangles[t][(e+1)%3], and
+	// opposite[3*t+e] is the half-edge running the other way along the same edge (or -1U on the boundary),
+	// so what's over an edge is a direct lookup:
+	std::vector< uint32_t > opposite;
+	//half-edges leaving each vertex, for WalkPoints that don't know their triangle:
+	// (vertex v's are vertex_half_edges[vertex_half_edge_begin[v] .. vertex_half_edge_begin[v+1]])
+	std::vector< uint32_t > vertex_half_edge_begin;
+	std::vector< uint32_t > vertex_half_edges;
+
+	//Per-triangle constants (in triangles[t]'s own vertex order), so walking doesn't recompute them:
+	struct TriangleData {
+		glm::vec3 v0, v1; //b - a, c - a
+		float d00, d01, d11, denom; //barycentric solve factors (see triangle_weights)
+		glm::vec4 plane; //unit normal and offset, dot(normal, x) + plane.w == 0 on the triangle
+	};
+	std::vector< TriangleData > triangle_data;
+
+	//Construct new WalkMesh and build the adjacency and per-triangle data:
+	WalkMesh(std::vector< glm::vec3 > vertices_, std::vector< glm::vec3 > normals_, std::vector< glm::uvec3 > triangles_);
+
+	//Bounding volume hierarchy over the triangles (built by the constructor), used by the spatial queries below:
+	struct BVHNode {
+		glm::vec3 min, max; //bounds of everything under this node
+		uint32_t first; //interior: index of first child (the second follows it); leaf: index of first entry in bvh_triangles
+		uint32_t count; //0 for interior nodes, else number of triangles in this leaf
+	};
+	std::vector< BVHNode > bvh_nodes; //bvh_nodes[0] is the root
+	std::vector< uint32_t > bvh_triangles; //triangle indices, grouped by leaf
+	static constexpr uint32_t BVHLeafSize = 4;
 
 	//used to initialize walking -- finds the closest point on the walk mesh:
-	// (should only need to call this at the start of a level)
+	// (called at the start of a level and after teleports; walks the BVH, so cost grows with log(triangles))
 	WalkPoint nearest_walk_point(glm::vec3 const &world_point) const;
+	//same result, by checking every triangle (kept for reference and benchmarking):
+	WalkPoint nearest_walk_point_linear(glm::vec3 const &world_point) const;
+
+	//"ground snap" -- finds the highest point on the walk mesh straight down (-z) from 'world_point', no more than max_drop below it:
+	// returns false (leaving *at alone) if there isn't one
+	bool ground_walk_point(glm::vec3 const &world_point, float max_drop, WalkPoint *at) const;
+
+	//appends (in no particular order) the indices of triangles with some point within 'radius' of 'world_point':
+	void triangles_in_radius(glm::vec3 const &world_point, float radius, std::vector< uint32_t > *out) const;
+
+	//closest point to 'world_point' on triangle 'ti' (as a walkpoint), and the squared distance to it:
+	float closest_on_triangle(uint32_t ti, glm::vec3 const &world_point, WalkPoint *at) const;
+
+	//pieces of walking, shared by walk() and walk_batch() so they stay in step:
+	// the second half of walk_in_triangle, given the weights of the destination and the edge it reaches first (-1U for none):
+	void finish_walk_in_triangle(WalkPoint const &start, uint32_t t, glm::vec3 const &dest_bary, float time, uint32_t min_coord, WalkPoint *end) const;
+	// what happens at an edge: cross it (rotating *remain to follow the surface) or bounce/slide off a wall:
+	void slide_at_edge(WalkPoint *at, glm::vec3 *remain) const;
+	// one agent's walk_in_triangle, split up so four can be computed together by step_in_triangles:
+	struct WalkStep {
+		WalkPoint start;
+		uint32_t triangle;
+		uint32_t rotation;
+		glm::vec3 step;
+		//outputs:
+		glm::vec3 dest_bary;
+		float time;
+		uint32_t min_coord;
+	};
+	void step_in_triangles(WalkStep *steps) const; //(exactly four steps)
+	void walk_range(WalkPoint *at, glm::vec3 *remain, size_t count, uint32_t max_iterations) const;
+
+	//half-edge from vertex a to vertex b (-1U if there isn't one):
+	uint32_t find_half_edge(uint32_t a, uint32_t b) const;
+	//which triangle a walkpoint is on, and which of that triangle's vertices is wp.indices.x (0, 1, or 2):
+	uint32_t triangle_of(WalkPoint const &wp, uint32_t *rotation) const;
+	//barycentric weights (in triangles[t]'s vertex order) of 'pt' projected into the plane of triangle t:
+	// credit https://gamedev.stackexchange.com/questions/23743/whats-the-most-efficient-way-to-find-barycentric-coordinates
+	glm::vec3 triangle_weights(uint32_t t, glm::vec3 const &pt) const {
+		TriangleData const &td = triangle_data[t];
+		glm::vec3 const v2 = pt - vertices[triangles[t].x];
+		float const d20 = glm::dot(v2, td.v0);
+		float const d21 = glm::dot(v2, td.v1);
+		float const v = (td.d11 * d20 - td.d01 * d21) / td.denom;
+		float const w = (td.d00 * d21 - td.d01 * d20) / td.denom;
+		return glm::vec3(1.0f - v - w, v, w);
+	}
 
 
 	//take a step on a triangle, stopping at edges:
@@ -64,6 +138,15 @@ struct WalkMesh {
 		glm::quat *rotation     //[out] rotation over edge
 	) const;
 
+	//walk 'step' (world space) from *at, crossing edges and sliding along walls, for at most max_iterations triangles:
+	// returns whatever part of the step is left over (zero unless the iteration budget ran out)
+	glm::vec3 walk(WalkPoint *at, glm::vec3 step, uint32_t max_iterations = 10) const;
+
+	//walk() for many agents at once: at[i] takes step[i], which is left holding what walk() would have returned.
+	// Results match calling walk() on each agent; barycentric weights and edge times are computed four agents
+	// at a time (with SSE2, where available), and big batches are split across up to 'threads' threads.
+	void walk_batch(WalkPoint *at, glm::vec3 *step, size_t count, uint32_t threads = 1, uint32_t max_iterations = 10) const;
+
 	//used to read back results of walking:
 	glm::vec3 to_world_point(WalkPoint const &wp) const {
 		//if you were looking here for the lesson solution, well, here you go:
@@ -84,6 +167,7 @@ struct WalkMesh {
 
 	//read back a triangle normal at a walkpoint:
 	glm::vec3 to_world_triangle_normal(WalkPoint const &wp) const {
+		if (wp.triangle < triangle_data.size()) return glm::vec3(triangle_data[wp.triangle].plane);
 		glm::vec3 const &a = vertices[wp.indices.x];
 		glm::vec3 const &b = vertices[wp.indices.y];
 		glm::vec3 const &c = vertices[wp.indices.z];
@@ -95,6 +179,8 @@ struct WalkMesh {
 struct WalkMeshes {
 	//load a list of named WalkMeshes from a file:
 	WalkMeshes(std::string const &filename);
+	//...or start with none (and fill in 'meshes' directly, e.g., in tools):
+	WalkMeshes() = default;
 
 	//retrieve a WalkMesh by name:
 	WalkMesh const &lookup(std::string const &name) const;
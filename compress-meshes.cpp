@@ -0,0 +1,189 @@
+//Converts a mesh file to the quantized, indexed ".qpnct" format read by MeshBuffer:
+// positions become 16-bit fractions of each mesh's bounding box, normals are octahedral-encoded
+// in two 16-bit values, and texture coordinates become half floats (20 bytes per vertex instead of 36).
+// Vertices that quantize identically within a mesh are merged.
+//$ compress-meshes <in.pnct|in.ipnct> <out.qpnct>
+
+#include "read_write_chunk.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//same layouts as in Mesh.cpp:
+struct Vertex {
+	glm::vec3 Position;
+	glm::vec3 Normal;
+	glm::u8vec4 Color;
+	glm::vec2 TexCoord;
+};
+static_assert(sizeof(Vertex) == 3*4+3*4+4*1+2*4, "Vertex is packed.");
+
+struct QuantizedVertex {
+	glm::u16vec4 Position;
+	glm::i16vec2 Normal;
+	glm::u8vec4 Color;
+	glm::u16vec2 TexCoord;
+};
+static_assert(sizeof(QuantizedVertex) == 4*2+2*2+4*1+2*2, "QuantizedVertex is packed.");
+
+struct IndexEntry {
+	uint32_t name_begin, name_end;
+	uint32_t vertex_begin, vertex_end;
+};
+static_assert(sizeof(IndexEntry) == 16, "Index entry should be packed");
+
+struct Bounds {
+	glm::vec3 min, max;
+};
+static_assert(sizeof(Bounds) == 2*3*4, "Bounds is packed.");
+
+static bool ends_with(std::string const &str, std::string const &suffix) {
+	return str.size() >= suffix.size() && str.substr(str.size() - suffix.size()) == suffix;
+}
+
+//unit vector to a point in [-1,1]^2 (upper hemisphere in the center diamond, lower folded into the corners):
+static glm::vec2 octahedral_encode(glm::vec3 n) {
+	float const sum = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+	if (sum == 0.0f) return glm::vec2(0.0f);
+	n /= sum;
+	if (n.z >= 0.0f) return glm::vec2(n.x, n.y);
+	return glm::vec2(
+		(1.0f - std::abs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f),
+		(1.0f - std::abs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f)
+	);
+}
+
+//(same as mesh_normal() in MeshBuffer::VertexDecodeGLSL)
+static glm::vec3 octahedral_decode(glm::vec2 e) {
+	glm::vec3 n(e.x, e.y, 1.0f - std::abs(e.x) - std::abs(e.y));
+	float const t = std::max(-n.z, 0.0f);
+	n.x += (n.x >= 0.0f ? -t : t);
+	n.y += (n.y >= 0.0f ? -t : t);
+	return glm::normalize(n);
+}
+
+int main(int argc, char **argv) {
+	try {
+		if (argc != 3) {
+			std::cerr << "Usage:\n\t" << argv[0] << " <in.pnct|in.ipnct> <out.qpnct>" << std::endl;
+			return 1;
+		}
+		std::string const in_file = argv[1];
+		std::string const out_file = argv[2];
+		if (!ends_with(out_file, ".qpnct")) throw std::runtime_error("Output file '" + out_file + "' should end in .qpnct");
+
+		std::ifstream in(in_file, std::ios::binary);
+		if (!in) throw std::runtime_error("Failed to open '" + in_file + "'");
+
+		std::vector< Vertex > data;
+		std::vector< uint32_t > elements;
+		read_chunk(in, "pnct", &data);
+		if (ends_with(in_file, ".ipnct")) {
+			read_chunk(in, "ind0", &elements);
+		} else if (ends_with(in_file, ".pnct")) {
+			elements.reserve(data.size());
+			for (uint32_t v = 0; v < data.size(); ++v) {
+				elements.emplace_back(v);
+			}
+		} else {
+			throw std::runtime_error("Unknown file type '" + in_file + "'");
+		}
+		std::vector< char > strings;
+		read_chunk(in, "str0", &strings);
+		std::vector< IndexEntry > index;
+		read_chunk(in, "idx0", &index);
+		std::vector< uint32_t > programs;
+		read_chunk(in, "prg0", &programs);
+
+		std::vector< QuantizedVertex > out_data;
+		std::vector< uint32_t > out_elements;
+		std::vector< IndexEntry > out_index;
+		std::vector< Bounds > out_bounds;
+
+		float max_position_error = 0.0f;
+		float max_normal_error = 0.0f; //(radians)
+
+		std::unordered_map< std::string, uint32_t > merged; //packed vertex -> index in out_data
+		for (auto const &entry : index) {
+			if (!(entry.vertex_begin <= entry.vertex_end && entry.vertex_end <= elements.size())) {
+				throw std::runtime_error("index entry has out-of-range vertex start/count");
+			}
+			Bounds bounds{glm::vec3(std::numeric_limits< float >::infinity()), glm::vec3(-std::numeric_limits< float >::infinity())};
+			for (uint32_t e = entry.vertex_begin; e < entry.vertex_end; ++e) {
+				if (elements[e] >= data.size()) throw std::runtime_error("element chunk has out-of-range vertex index");
+				bounds.min = glm::min(bounds.min, data[elements[e]].Position);
+				bounds.max = glm::max(bounds.max, data[elements[e]].Position);
+			}
+			if (entry.vertex_begin == entry.vertex_end) bounds.min = bounds.max = glm::vec3(0.0f);
+			glm::vec3 const size = bounds.max - bounds.min;
+
+			IndexEntry out_entry = entry;
+			out_entry.vertex_begin = uint32_t(out_elements.size());
+			merged.clear();
+			for (uint32_t e = entry.vertex_begin; e < entry.vertex_end; ++e) {
+				Vertex const &v = data[elements[e]];
+
+				QuantizedVertex q;
+				for (uint32_t c = 0; c < 3; ++c) {
+					float const f = (size[c] > 0.0f ? (v.Position[c] - bounds.min[c]) / size[c] : 0.0f);
+					q.Position[c] = uint16_t(std::round(glm::clamp(f, 0.0f, 1.0f) * 65535.0f));
+				}
+				q.Position.w = 0;
+				glm::vec2 const oct = octahedral_encode(v.Normal);
+				for (uint32_t c = 0; c < 2; ++c) {
+					q.Normal[c] = int16_t(std::round(glm::clamp(oct[c], -1.0f, 1.0f) * 32767.0f));
+				}
+				q.Color = v.Color;
+				uint32_t const half = glm::packHalf2x16(v.TexCoord);
+				q.TexCoord = glm::u16vec2(half & 0xffff, half >> 16);
+
+				//track how far decoding lands from the original:
+				glm::vec3 const position = bounds.min + size * (glm::vec3(q.Position) / 65535.0f);
+				max_position_error = std::max(max_position_error, glm::length(position - v.Position));
+				if (glm::length(v.Normal) > 0.0f) {
+					glm::vec3 const normal = octahedral_decode(glm::max(glm::vec2(q.Normal) / 32767.0f, glm::vec2(-1.0f)));
+					float const cos_angle = glm::clamp(glm::dot(normal, glm::normalize(v.Normal)), -1.0f, 1.0f);
+					max_normal_error = std::max(max_normal_error, std::acos(cos_angle));
+				}
+
+				auto ret = merged.emplace(std::string(reinterpret_cast< char const * >(&q), sizeof(q)), uint32_t(out_data.size()));
+				if (ret.second) out_data.emplace_back(q);
+				out_elements.emplace_back(ret.first->second);
+			}
+			out_entry.vertex_end = uint32_t(out_elements.size());
+			out_index.emplace_back(out_entry);
+			out_bounds.emplace_back(bounds);
+		}
+
+		std::ofstream out(out_file, std::ios::binary);
+		write_chunk("pnq0", out_data, &out);
+		write_chunk("ind0", out_elements, &out);
+		write_chunk("str0", strings, &out);
+		write_chunk("idx0", out_index, &out);
+		write_chunk("prg0", programs, &out);
+		write_chunk("bnd0", out_bounds, &out);
+		if (!out) throw std::runtime_error("Failed to write '" + out_file + "'");
+
+		size_t const in_bytes = data.size() * sizeof(Vertex) + (ends_with(in_file, ".ipnct") ? elements.size() * 4 : 0);
+		size_t const out_bytes = out_data.size() * sizeof(QuantizedVertex) + out_elements.size() * 4;
+		std::cout << "Wrote '" << out_file << "': " << index.size() << " meshes, "
+		          << data.size() << " -> " << out_data.size() << " vertices, "
+		          << in_bytes << " -> " << out_bytes << " bytes of vertex+element data\n"
+		          << "  max position error: " << max_position_error << "\n"
+		          << "  max normal error: " << max_normal_error * 180.0f / 3.1415926f << " degrees" << std::endl;
+	} catch (std::exception &e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
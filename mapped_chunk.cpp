@@ -0,0 +1,77 @@
+#include "mapped_chunk.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedChunks::MappedChunks(std::string const &filename_) : filename(filename_) {
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		throw std::runtime_error("Failed to open '" + filename + "'");
+	}
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size)) {
+		CloseHandle(file);
+		throw std::runtime_error("Failed to get size of '" + filename + "'");
+	}
+	file_handle = file;
+	size = size_t(file_size.QuadPart);
+	if (size == 0) return; //(empty files can't be mapped; there's nothing to read anyway)
+
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping == NULL) {
+		CloseHandle(file);
+		throw std::runtime_error("Failed to map '" + filename + "'");
+	}
+	void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (view == NULL) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		throw std::runtime_error("Failed to map '" + filename + "'");
+	}
+	mapping_handle = mapping;
+	data = reinterpret_cast< char const * >(view);
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd == -1) {
+		throw std::runtime_error("Failed to open '" + filename + "'");
+	}
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		close(fd);
+		throw std::runtime_error("Failed to get size of '" + filename + "'");
+	}
+	size = size_t(info.st_size);
+	if (size == 0) { //(empty files can't be mapped; there's nothing to read anyway)
+		close(fd);
+		return;
+	}
+
+	void *view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); //(the mapping keeps the file open)
+	if (view == MAP_FAILED) {
+		throw std::runtime_error("Failed to map '" + filename + "'");
+	}
+	//chunks are read front to back, once:
+	madvise(view, size, MADV_SEQUENTIAL);
+	data = reinterpret_cast< char const * >(view);
+#endif
+}
+
+MappedChunks::~MappedChunks() {
+#ifdef _WIN32
+	if (data) UnmapViewOfFile(data);
+	if (mapping_handle) CloseHandle(mapping_handle);
+	if (file_handle) CloseHandle(file_handle);
+#else
+	if (data) munmap(const_cast< char * >(data), size);
+#endif
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+//Zero-copy reading of chunk files (the format written by write_chunk in read_write_chunk.hpp):
+// MappedChunks maps a whole file into memory (mmap on POSIX, a file mapping on Windows),
+// and read_chunk fills in ChunkSpans that point straight into the mapping.
+//
+// Chunk data is used where it lies if it is aligned for the element type.
+// Chunks that follow an odd-sized chunk (e.g., "str0") may not be; those are copied
+// into aligned storage owned by the MappedChunks, so a span can always be dereferenced.
+// Spans stay valid as long as the MappedChunks they came from.
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+//read-only view of a contiguous array of T (the parts of C++20's std::span the loaders use):
+template< typename T >
+struct ChunkSpan {
+	ChunkSpan() = default;
+	ChunkSpan(T const *data_, size_t size_) : first(data_), count(size_) { }
+	explicit ChunkSpan(std::vector< T > const &vec) : first(vec.data()), count(vec.size()) { }
+
+	T const *data() const { return first; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	T const *begin() const { return first; }
+	T const *end() const { return first + count; }
+	T const &operator[](size_t i) const {
+		assert(i < count);
+		return first[i];
+	}
+
+	T const *first = nullptr;
+	size_t count = 0;
+};
+
+struct MappedChunks {
+	//map a file for reading:
+	// note: will throw if the file can't be opened or mapped.
+	MappedChunks(std::string const &filename);
+	~MappedChunks();
+	MappedChunks(MappedChunks const &) = delete;
+	MappedChunks &operator=(MappedChunks const &) = delete;
+
+	std::string filename;
+
+	//the whole file:
+	char const *data = nullptr;
+	size_t size = 0;
+
+	//where the next chunk header starts (read_chunk advances this):
+	size_t offset = 0;
+	bool at_end() const { return offset >= size; }
+
+	//chunks that had to be copied to be aligned:
+	std::vector< std::vector< std::max_align_t > > copies;
+	size_t copied_bytes = 0;
+
+	//-- internals ---
+#ifdef _WIN32
+	void *file_handle = nullptr; //(HANDLEs)
+	void *mapping_handle = nullptr;
+#endif
+};
+
+//read the next chunk from a mapped file, in the same format as read_chunk(std::istream &, ...):
+// note: will throw if the magic number doesn't match or the chunk doesn't fit in the file.
+template< typename T >
+void read_chunk(MappedChunks &from, std::string const &magic, ChunkSpan< T > *to_) {
+	static_assert(std::is_trivially_copyable< T >::value, "chunks hold plain data");
+	assert(to_);
+	auto &to = *to_;
+
+	struct ChunkHeader {
+		char magic[4] = {'\0', '\0', '\0', '\0'};
+		uint32_t size = 0;
+	};
+	static_assert(sizeof(ChunkHeader) == 8, "header is packed");
+
+	ChunkHeader header;
+	assert(from.offset <= from.size);
+	if (from.size - from.offset < sizeof(header)) {
+		throw std::runtime_error("Failed to read chunk header");
+	}
+	//(the header itself may not be aligned, so copy it out)
+	std::memcpy(&header, from.data + from.offset, sizeof(header));
+	if (std::string(header.magic,4) != magic) {
+		throw std::runtime_error("Unexpected magic number in chunk");
+	}
+
+	if (header.size % sizeof(T) != 0) {
+		throw std::runtime_error("Size of chunk not divisible by element size");
+	}
+	if (header.size > from.size - from.offset - sizeof(header)) {
+		throw std::runtime_error("Failed to read chunk data.");
+	}
+
+	char const *start = from.data + from.offset + sizeof(header);
+	if (reinterpret_cast< uintptr_t >(start) % alignof(T) != 0) {
+		from.copies.emplace_back((header.size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t));
+		std::memcpy(from.copies.back().data(), start, header.size);
+		start = reinterpret_cast< char const * >(from.copies.back().data());
+		from.copied_bytes += header.size;
+	}
+
+	to = ChunkSpan< T >(reinterpret_cast< T const * >(start), header.size / sizeof(T));
+	from.offset += sizeof(header) + header.size;
+}
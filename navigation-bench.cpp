@@ -0,0 +1,172 @@
+//Times Navigation::find_path for a crowd of agents repathing, with and without the corridor cache.
+//$ navigation-bench [file.w] [-n agents] [-r rounds]
+// with no file, uses a generated stack of bumpy grid "floors", each linked to the next (as portals would), instead.
+// every round, each agent asks for a path between the same two places (as agents standing still or following
+// a slowly-moving target would), so rounds after the first can come from the cache.
+
+#include "Navigation.hpp"
+#include "WalkMesh.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+//(size x size)-quad grid with some hills:
+static WalkMesh make_grid(uint32_t size) {
+	std::vector< glm::vec3 > vertices;
+	std::vector< glm::vec3 > normals;
+	std::vector< glm::uvec3 > triangles;
+	for (uint32_t y = 0; y <= size; ++y) {
+		for (uint32_t x = 0; x <= size; ++x) {
+			float const fx = float(x), fy = float(y);
+			vertices.emplace_back(fx, fy, 0.5f * std::sin(0.3f * fx) * std::cos(0.2f * fy));
+			normals.emplace_back(0.0f, 0.0f, 1.0f);
+		}
+	}
+	auto at = [size](uint32_t x, uint32_t y) { return y * (size + 1) + x; };
+	for (uint32_t y = 0; y < size; ++y) {
+		for (uint32_t x = 0; x < size; ++x) {
+			triangles.emplace_back(at(x, y), at(x + 1, y), at(x + 1, y + 1));
+			triangles.emplace_back(at(x, y), at(x + 1, y + 1), at(x, y + 1));
+		}
+	}
+	return WalkMesh(std::move(vertices), std::move(normals), std::move(triangles));
+}
+
+static void bench(std::string const &label, Navigation &navigation, uint32_t agents, uint32_t rounds) {
+	//each agent's start and goal, on random meshes:
+	struct Query {
+		uint32_t from_mesh;
+		WalkPoint from;
+		uint32_t to_mesh;
+		WalkPoint to;
+	};
+	std::mt19937 mt(0x31415926);
+	std::uniform_real_distribution< float > unit(0.0f, 1.0f);
+	std::uniform_int_distribution< uint32_t > pick_mesh(0, uint32_t(navigation.meshes.size()) - 1);
+	auto random_point = [&](uint32_t mesh) {
+		WalkMesh const &wm = *navigation.meshes[mesh];
+		glm::vec3 const &min = wm.bvh_nodes[0].min;
+		glm::vec3 const &max = wm.bvh_nodes[0].max;
+		return wm.nearest_walk_point(min + glm::vec3(unit(mt), unit(mt), unit(mt)) * (max - min));
+	};
+	std::vector< Query > queries;
+	queries.reserve(agents);
+	for (uint32_t i = 0; i < agents; ++i) {
+		Query q;
+		q.from_mesh = pick_mesh(mt);
+		q.to_mesh = (navigation.links.empty() ? q.from_mesh : pick_mesh(mt)); //(without links, paths can't leave their mesh)
+		q.from = random_point(q.from_mesh);
+		q.to = random_point(q.to_mesh);
+		queries.emplace_back(q);
+	}
+
+	using clock = std::chrono::high_resolution_clock;
+	std::vector< std::vector< Navigation::Waypoint > > first(agents); //results without the cache, to check against
+	std::vector< Navigation::Waypoint > path;
+	uint32_t found = 0, mismatches = 0;
+	size_t waypoints = 0;
+	auto time = [&](size_t capacity, bool check) {
+		navigation.cache_capacity = capacity;
+		navigation.clear_cache();
+		navigation.cache_stats = Navigation::CacheStats();
+		auto before = clock::now();
+		for (uint32_t round = 0; round < rounds; ++round) {
+			for (uint32_t i = 0; i < agents; ++i) {
+				Query const &q = queries[i];
+				bool const ok = navigation.find_path(q.from_mesh, q.from, q.to_mesh, q.to, &path);
+				if (!check) {
+					if (round == 0) {
+						first[i] = path;
+						found += (ok ? 1 : 0);
+						waypoints += path.size();
+					}
+					continue;
+				}
+				bool same = (path.size() == first[i].size());
+				for (size_t w = 0; same && w < path.size(); ++w) {
+					same = path[w].mesh == first[i][w].mesh && path[w].position == first[i][w].position && path[w].portal == first[i][w].portal;
+				}
+				if (!same) mismatches += 1;
+			}
+		}
+		auto after = clock::now();
+		double const seconds = std::chrono::duration< double >(after - before).count();
+		return (seconds > 0.0 ? double(agents) * double(rounds) / seconds : 0.0);
+	};
+
+	double const uncached = time(0, false);
+	double const cached = time(agents, true);
+	Navigation::CacheStats const stats = navigation.cache_stats;
+
+	std::cout << label << ": " << navigation.node_centers.size() << " triangles on " << navigation.meshes.size() << " mesh(es), "
+	          << navigation.links.size() << " link(s)\n"
+	          << "  " << agents << " agents x " << rounds << " rounds; " << found << " paths found, "
+	          << (found ? double(waypoints) / double(found) : 0.0) << " waypoints each\n"
+	          << "  no cache: " << uncached << " paths/second\n"
+	          << "  cache:    " << cached << " paths/second (" << (uncached > 0.0 ? cached / uncached : 0.0) << "x; "
+	          << stats.hits << " hits, " << stats.misses << " misses)\n"
+	          << "  mismatched paths: " << mismatches << " of " << agents * rounds << std::endl;
+	if (mismatches != 0) throw std::runtime_error("cached and uncached paths disagree on '" + label + "'");
+}
+
+int main(int argc, char **argv) {
+	try {
+		std::vector< std::string > args;
+		uint32_t agents = 500;
+		uint32_t rounds = 10;
+		for (int i = 1; i < argc; ++i) {
+			std::string arg = argv[i];
+			if (arg == "-n") {
+				if (i + 1 >= argc) throw std::runtime_error("-n needs an agent count");
+				agents = std::max(1U, uint32_t(std::stoul(argv[++i])));
+			} else if (arg == "-r") {
+				if (i + 1 >= argc) throw std::runtime_error("-r needs a round count");
+				rounds = std::max(1U, uint32_t(std::stoul(argv[++i])));
+			} else {
+				args.emplace_back(arg);
+			}
+		}
+
+		if (args.empty()) {
+			for (uint32_t size : {16, 64, 128}) {
+				//four floors, each linked to the next by a row of portals along alternating edges
+				// (so paths between floors cross each one):
+				WalkMeshes walkmeshes;
+				for (uint32_t f = 0; f < 4; ++f) {
+					walkmeshes.meshes.emplace("floor" + std::to_string(f), make_grid(size));
+				}
+				Navigation navigation(walkmeshes);
+				for (uint32_t f = 0; f + 1 < 4; ++f) {
+					float const y = (f % 2 == 0 ? float(size) - 0.5f : 0.5f);
+					for (uint32_t k = 0; k < 8; ++k) {
+						glm::vec3 const at = glm::vec3((float(k) + 0.5f) * float(size) / 8.0f, y, 0.0f);
+						navigation.add_link(f, at, f + 1, at);
+						navigation.add_link(f + 1, at, f, at);
+					}
+				}
+				bench(std::to_string(size) + "x" + std::to_string(size) + " grid floors", navigation, agents, rounds);
+			}
+		} else {
+			WalkMeshes walkmeshes(args[0]);
+			for (auto it = walkmeshes.meshes.begin(); it != walkmeshes.meshes.end(); ) {
+				if (it->second.triangles.empty()) it = walkmeshes.meshes.erase(it);
+				else ++it;
+			}
+			if (walkmeshes.meshes.empty()) throw std::runtime_error("No walkmeshes with triangles in '" + args[0] + "'");
+			Navigation navigation(walkmeshes);
+			bench(args[0], navigation, agents, rounds);
+		}
+	} catch (std::exception &e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,425 @@
+//Reorders the triangles and vertices of a mesh file for faster drawing:
+// - triangles are ordered for post-transform vertex cache reuse ("Tipsify", Sander, Nehab, and Barczak 2007),
+// - ...then split into clusters that are sorted so outward-facing surfaces tend to draw first (less overdraw),
+// - ...and vertices are stored in the order they are first used (better vertex fetch locality).
+// Reports ACMR (cache misses per triangle) and ATVR (cache misses per vertex; 1.0 is ideal) before and after.
+// Meshes keep their index ranges, so the output loads in MeshBuffer just like the input.
+//$ optimize-meshes [-c cache-size] <in.pnct|in.ipnct|in.qpnct> <out.ipnct|out.qpnct>
+// (.pnct files are welded and written indexed, as .ipnct; other files keep their format)
+
+#include "read_write_chunk.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//same layouts as in Mesh.cpp:
+struct IndexEntry {
+	uint32_t name_begin, name_end;
+	uint32_t vertex_begin, vertex_end;
+};
+static_assert(sizeof(IndexEntry) == 16, "Index entry should be packed");
+
+struct Bounds {
+	glm::vec3 min, max;
+};
+static_assert(sizeof(Bounds) == 2*3*4, "Bounds is packed.");
+
+//(.pnct/.ipnct vertices are 36 bytes starting with a vec3 position; .qpnct are 20 starting with a u16vec4 position)
+static constexpr uint32_t FloatVertexSize = 3*4+3*4+4*1+2*4;
+static constexpr uint32_t QuantizedVertexSize = 4*2+2*2+4*1+2*2;
+
+static bool ends_with(std::string const &str, std::string const &suffix) {
+	return str.size() >= suffix.size() && str.substr(str.size() - suffix.size()) == suffix;
+}
+
+//FIFO post-transform cache, as used to estimate ACMR/ATVR:
+// (a vertex is cached if it was added within the last 'size' misses)
+struct FIFOCache {
+	FIFOCache(uint32_t vertex_count, uint32_t size_) : size(size_), added(vertex_count, 0), time(size_ + 1) { }
+	uint32_t size;
+	std::vector< uint32_t > added;
+	uint32_t time;
+	//returns true on a miss:
+	bool touch(uint32_t v) {
+		if (time - added[v] <= size) return false;
+		added[v] = time++;
+		return true;
+	}
+	void flush() {
+		time += size + 1;
+	}
+};
+
+static uint32_t cache_misses(std::vector< uint32_t > const &elements, uint32_t vertex_count, uint32_t cache_size) {
+	FIFOCache cache(vertex_count, cache_size);
+	uint32_t misses = 0;
+	for (uint32_t v : elements) {
+		if (cache.touch(v)) misses += 1;
+	}
+	return misses;
+}
+
+//Reorder triangles (elements over vertices [0,vertex_count), all of them used) for cache reuse.
+// Also records where the ordering had to jump to an unrelated part of the mesh (the start of each "hard" cluster).
+static void tipsify(std::vector< uint32_t > *elements_, uint32_t vertex_count, uint32_t cache_size, std::vector< uint32_t > *clusters) {
+	assert(elements_);
+	assert(clusters);
+	auto &elements = *elements_;
+	uint32_t const triangle_count = uint32_t(elements.size() / 3);
+	clusters->clear();
+	if (triangle_count == 0) return;
+
+	//triangles around each vertex:
+	std::vector< uint32_t > first(vertex_count + 1, 0);
+	for (uint32_t v : elements) {
+		first[v + 1] += 1;
+	}
+	for (uint32_t v = 0; v < vertex_count; ++v) {
+		first[v + 1] += first[v];
+	}
+	std::vector< uint32_t > adjacent(elements.size());
+	{
+		std::vector< uint32_t > next(first.begin(), first.end() - 1);
+		for (uint32_t i = 0; i < elements.size(); ++i) {
+			adjacent[next[elements[i]]++] = i / 3;
+		}
+	}
+
+	std::vector< uint32_t > live(vertex_count); //un-emitted triangles using each vertex
+	for (uint32_t v = 0; v < vertex_count; ++v) {
+		live[v] = first[v + 1] - first[v];
+	}
+	std::vector< uint32_t > stamp(vertex_count, 0); //when each vertex last entered the cache
+	uint32_t time = cache_size + 1;
+	std::vector< uint8_t > emitted(triangle_count, 0);
+	std::vector< uint32_t > dead_end; //recently-used vertices, to fall back on
+	std::vector< uint32_t > candidates;
+	uint32_t scan = 0;
+
+	std::vector< uint32_t > out;
+	out.reserve(elements.size());
+	clusters->emplace_back(0);
+
+	uint32_t fan = elements[0];
+	while (fan != -1U) {
+		//emit every remaining triangle around the fanning vertex:
+		candidates.clear();
+		for (uint32_t a = first[fan]; a < first[fan + 1]; ++a) {
+			uint32_t const t = adjacent[a];
+			if (emitted[t]) continue;
+			emitted[t] = 1;
+			for (uint32_t c = 0; c < 3; ++c) {
+				uint32_t const v = elements[3 * t + c];
+				out.emplace_back(v);
+				dead_end.emplace_back(v);
+				candidates.emplace_back(v);
+				live[v] -= 1;
+				if (time - stamp[v] > cache_size) {
+					stamp[v] = time;
+					time += 1;
+				}
+			}
+		}
+
+		//next, fan around the vertex that has been cached longest but will still be cached after its own triangles are emitted:
+		uint32_t next = -1U;
+		int32_t best = -1;
+		for (uint32_t v : candidates) {
+			if (live[v] == 0) continue;
+			int32_t priority = 0;
+			if (time - stamp[v] + 2 * live[v] <= cache_size) priority = int32_t(time - stamp[v]);
+			if (priority > best) {
+				best = priority;
+				next = v;
+			}
+		}
+
+		if (next == -1U) {
+			//dead end: back up through recently used vertices, then look for anything left:
+			while (!dead_end.empty()) {
+				uint32_t const v = dead_end.back();
+				dead_end.pop_back();
+				if (live[v] > 0) {
+					next = v;
+					break;
+				}
+			}
+			while (next == -1U && scan < vertex_count) {
+				if (live[scan] > 0) next = scan;
+				else scan += 1;
+			}
+			if (next != -1U) clusters->emplace_back(uint32_t(out.size() / 3));
+		}
+		fan = next;
+	}
+	assert(out.size() == elements.size());
+	elements = std::move(out);
+}
+
+//Split cache-ordered triangles into clusters and draw the clusters facing away from the mesh center first.
+// Clusters start at the given hard boundaries, and are split further wherever that costs little cache reuse:
+// a split happens once the triangles since the last split have an ACMR (starting from an empty cache) within 'threshold' of the whole mesh's.
+static void reduce_overdraw(std::vector< uint32_t > *elements_, std::vector< glm::vec3 > const &positions, uint32_t cache_size, std::vector< uint32_t > const &hard_clusters, float threshold) {
+	assert(elements_);
+	auto &elements = *elements_;
+	uint32_t const triangle_count = uint32_t(elements.size() / 3);
+	if (triangle_count == 0) return;
+	uint32_t const vertex_count = uint32_t(positions.size());
+
+	float const mesh_acmr = float(cache_misses(elements, vertex_count, cache_size)) / float(triangle_count);
+
+	std::vector< uint32_t > clusters;
+	FIFOCache cache(vertex_count, cache_size);
+	for (uint32_t h = 0; h < hard_clusters.size(); ++h) {
+		uint32_t const end = (h + 1 < hard_clusters.size() ? hard_clusters[h + 1] : triangle_count);
+		uint32_t start = hard_clusters[h];
+		clusters.emplace_back(start);
+		cache.flush();
+		uint32_t misses = 0;
+		for (uint32_t t = start; t < end; ++t) {
+			for (uint32_t c = 0; c < 3; ++c) {
+				if (cache.touch(elements[3 * t + c])) misses += 1;
+			}
+			if (t + 1 < end && float(misses) <= threshold * mesh_acmr * float(t + 1 - start)) {
+				start = t + 1;
+				clusters.emplace_back(start);
+				cache.flush();
+				misses = 0;
+			}
+		}
+	}
+
+	//area-weighted centroid and normal of each cluster (and of the whole mesh):
+	struct Cluster {
+		uint32_t begin, end;
+		glm::vec3 centroid = glm::vec3(0.0f);
+		glm::vec3 normal = glm::vec3(0.0f);
+		float area = 0.0f;
+		float key = 0.0f;
+	};
+	std::vector< Cluster > sorted;
+	glm::vec3 mesh_centroid = glm::vec3(0.0f);
+	float mesh_area = 0.0f;
+	for (uint32_t i = 0; i < clusters.size(); ++i) {
+		Cluster cluster;
+		cluster.begin = clusters[i];
+		cluster.end = (i + 1 < clusters.size() ? clusters[i + 1] : triangle_count);
+		for (uint32_t t = cluster.begin; t < cluster.end; ++t) {
+			glm::vec3 const &a = positions[elements[3 * t + 0]];
+			glm::vec3 const &b = positions[elements[3 * t + 1]];
+			glm::vec3 const &c = positions[elements[3 * t + 2]];
+			glm::vec3 const n = glm::cross(b - a, c - a); //(length is twice the area)
+			float const area = 0.5f * glm::length(n);
+			cluster.normal += n;
+			cluster.centroid += area * (a + b + c) / 3.0f;
+			cluster.area += area;
+		}
+		mesh_centroid += cluster.centroid;
+		mesh_area += cluster.area;
+		if (cluster.area > 0.0f) cluster.centroid /= cluster.area;
+		sorted.emplace_back(cluster);
+	}
+	if (mesh_area > 0.0f) mesh_centroid /= mesh_area;
+
+	for (auto &cluster : sorted) {
+		float const length = glm::length(cluster.normal);
+		if (length > 0.0f) cluster.key = glm::dot(cluster.centroid - mesh_centroid, cluster.normal / length);
+	}
+	std::stable_sort(sorted.begin(), sorted.end(), [](Cluster const &a, Cluster const &b) {
+		return a.key > b.key;
+	});
+
+	std::vector< uint32_t > out;
+	out.reserve(elements.size());
+	for (auto const &cluster : sorted) {
+		out.insert(out.end(), elements.begin() + 3 * cluster.begin, elements.begin() + 3 * cluster.end);
+	}
+	elements = std::move(out);
+}
+
+int main(int argc, char **argv) {
+	try {
+		uint32_t cache_size = 16;
+		float const threshold = 1.05f;
+		std::vector< std::string > args;
+		for (int i = 1; i < argc; ++i) {
+			std::string arg = argv[i];
+			if (arg == "-c") {
+				if (i + 1 >= argc) throw std::runtime_error("-c needs a cache size");
+				cache_size = std::max(3U, uint32_t(std::stoul(argv[++i])));
+			} else {
+				args.emplace_back(arg);
+			}
+		}
+		if (args.size() != 2) {
+			std::cerr << "Usage:\n\t" << argv[0] << " [-c cache-size] <in.pnct|in.ipnct|in.qpnct> <out.ipnct|out.qpnct>" << std::endl;
+			return 1;
+		}
+		std::string const in_file = args[0];
+		std::string const out_file = args[1];
+
+		bool quantized = false;
+		std::string out_extension;
+		if (ends_with(in_file, ".qpnct")) {
+			quantized = true;
+			out_extension = ".qpnct";
+		} else if (ends_with(in_file, ".ipnct") || ends_with(in_file, ".pnct")) {
+			out_extension = ".ipnct";
+		} else {
+			throw std::runtime_error("Unknown file type '" + in_file + "'");
+		}
+		if (!ends_with(out_file, out_extension)) {
+			throw std::runtime_error("Output file '" + out_file + "' should end in " + out_extension);
+		}
+
+		std::ifstream in(in_file, std::ios::binary);
+		if (!in) throw std::runtime_error("Failed to open '" + in_file + "'");
+
+		//vertices are handled as opaque blobs, except for reading positions:
+		uint32_t const stride = (quantized ? QuantizedVertexSize : FloatVertexSize);
+		std::vector< char > data;
+		std::vector< uint32_t > elements;
+		read_chunk(in, quantized ? "pnq0" : "pnct", &data);
+		if (data.size() % stride != 0) throw std::runtime_error("Vertex chunk isn't a whole number of vertices");
+		uint32_t const vertex_count = uint32_t(data.size() / stride);
+		bool const indexed = !ends_with(in_file, ".pnct");
+		if (indexed) {
+			read_chunk(in, "ind0", &elements);
+		}
+		std::vector< char > strings;
+		read_chunk(in, "str0", &strings);
+		std::vector< IndexEntry > index;
+		read_chunk(in, "idx0", &index);
+		std::vector< uint32_t > programs;
+		read_chunk(in, "prg0", &programs);
+		std::vector< Bounds > bounds;
+		if (quantized) {
+			read_chunk(in, "bnd0", &bounds);
+			if (bounds.size() != index.size()) throw std::runtime_error("bounds chunk doesn't match index chunk");
+		}
+
+		for (auto const &entry : index) {
+			if (!(entry.vertex_begin <= entry.vertex_end && entry.vertex_end <= (indexed ? elements.size() : vertex_count))) {
+				throw std::runtime_error("index entry has out-of-range vertex start/count");
+			}
+			if ((entry.vertex_end - entry.vertex_begin) % 3 != 0) {
+				throw std::runtime_error("index entry isn't a whole number of triangles");
+			}
+		}
+		for (uint32_t v : elements) {
+			if (v >= vertex_count) throw std::runtime_error("element chunk has out-of-range vertex index");
+		}
+
+		if (!indexed) {
+			//weld identical vertices within each mesh, as MeshBuffer would when loading:
+			std::unordered_map< std::string, uint32_t > welded_index;
+			std::vector< char > welded;
+			for (auto &entry : index) {
+				welded_index.clear();
+				uint32_t const begin = uint32_t(elements.size());
+				for (uint32_t v = entry.vertex_begin; v < entry.vertex_end; ++v) {
+					auto ret = welded_index.emplace(std::string(&data[size_t(v) * stride], stride), uint32_t(welded.size() / stride));
+					if (ret.second) welded.insert(welded.end(), &data[size_t(v) * stride], &data[size_t(v) * stride] + stride);
+					elements.emplace_back(ret.first->second);
+				}
+				entry.vertex_begin = begin;
+				entry.vertex_end = uint32_t(elements.size());
+			}
+			data = std::move(welded);
+		}
+
+		auto position = [&](uint32_t mesh, uint32_t v) {
+			char const *at = &data[size_t(v) * stride];
+			if (quantized) {
+				glm::u16vec4 q;
+				std::memcpy(&q, at, sizeof(q));
+				return bounds[mesh].min + (bounds[mesh].max - bounds[mesh].min) * (glm::vec3(q) / 65535.0f);
+			} else {
+				glm::vec3 p;
+				std::memcpy(&p, at, sizeof(p));
+				return p;
+			}
+		};
+
+		uint64_t misses_before = 0, misses_after = 0;
+		uint64_t triangles = 0, vertices = 0;
+
+		std::vector< uint32_t > local_of(data.size() / stride, -1U);
+		std::vector< uint32_t > global_of;
+		std::vector< uint32_t > local_elements;
+		std::vector< glm::vec3 > positions;
+		std::vector< uint32_t > clusters;
+		for (uint32_t m = 0; m < index.size(); ++m) {
+			IndexEntry const &entry = index[m];
+			if (entry.vertex_begin == entry.vertex_end) continue;
+
+			//renumber this mesh's vertices densely:
+			global_of.clear();
+			local_elements.clear();
+			positions.clear();
+			for (uint32_t e = entry.vertex_begin; e < entry.vertex_end; ++e) {
+				uint32_t const v = elements[e];
+				if (local_of[v] == -1U) {
+					local_of[v] = uint32_t(global_of.size());
+					global_of.emplace_back(v);
+					positions.emplace_back(position(m, v));
+				}
+				local_elements.emplace_back(local_of[v]);
+			}
+			uint32_t const local_count = uint32_t(global_of.size());
+
+			misses_before += cache_misses(local_elements, local_count, cache_size);
+			tipsify(&local_elements, local_count, cache_size, &clusters);
+			reduce_overdraw(&local_elements, positions, cache_size, clusters, threshold);
+			misses_after += cache_misses(local_elements, local_count, cache_size);
+			triangles += local_elements.size() / 3;
+			vertices += local_count;
+
+			for (uint32_t i = 0; i < local_elements.size(); ++i) {
+				elements[entry.vertex_begin + i] = global_of[local_elements[i]];
+			}
+			for (uint32_t v : global_of) {
+				local_of[v] = -1U;
+			}
+		}
+
+		//store vertices in order of first use (dropping any that no mesh uses):
+		std::vector< uint32_t > new_index(data.size() / stride, -1U);
+		std::vector< char > new_data;
+		new_data.reserve(data.size());
+		for (auto &v : elements) {
+			if (new_index[v] == -1U) {
+				new_index[v] = uint32_t(new_data.size() / stride);
+				new_data.insert(new_data.end(), &data[size_t(v) * stride], &data[size_t(v) * stride] + stride);
+			}
+			v = new_index[v];
+		}
+
+		std::ofstream out(out_file, std::ios::binary);
+		write_chunk(quantized ? "pnq0" : "pnct", new_data, &out);
+		write_chunk("ind0", elements, &out);
+		write_chunk("str0", strings, &out);
+		write_chunk("idx0", index, &out);
+		write_chunk("prg0", programs, &out);
+		if (quantized) write_chunk("bnd0", bounds, &out);
+		if (!out) throw std::runtime_error("Failed to write '" + out_file + "'");
+
+		auto ratio = [](uint64_t a, uint64_t b) { return b ? double(a) / double(b) : 0.0; };
+		std::cout << "Wrote '" << out_file << "': " << index.size() << " meshes, " << triangles << " triangles, "
+		          << vertices << " vertices (FIFO cache of " << cache_size << ")\n"
+		          << "  ACMR: " << ratio(misses_before, triangles) << " -> " << ratio(misses_after, triangles) << "\n"
+		          << "  ATVR: " << ratio(misses_before, vertices) << " -> " << ratio(misses_after, vertices) << std::endl;
+	} catch (std::exception &e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -15,7 +15,7 @@ for i in range(0,len(sys.argv)):
 		args = sys.argv[i+1:]
 
 if len(args) != 2:
-	print("\n\nUsage:\nblender --background --python export-meshes.py -- <infile.blend[:collection]> <outfile.pnct>\nExports the meshes referenced by all objects in the specified collection(s) (default: all objects) to a binary blob.\n")
+	print("\n\nUsage:\nblender --background --python export-meshes.py -- <infile.blend[:collection]> <outfile.pnct|outfile.ipnct>\nExports the meshes referenced by all objects in the specified collection(s) (default: all objects) to a binary blob.\n(.ipnct files store each mesh's distinct vertices once, plus an element chunk indexing them.)\n")
 	exit(1)
 
 import bpy
@@ -28,7 +28,8 @@ if m:
 	collection_name = m.group(2)
 outfile = args[1]
 
-assert outfile.endswith(".pnct")
+assert outfile.endswith(".pnct") or outfile.endswith(".ipnct")
+indexed = outfile.endswith(".ipnct")
 
 print("Will export meshes referenced from ",end="")
 if collection_name:
@@ -94,9 +95,12 @@ data = []
 #strings contains the mesh names:
 strings = b''
 
-#index gives offsets into the data (and names) for each mesh:
+#index gives offsets into the data (or elements, if indexed) and names for each mesh:
 index = b''
 
+#elements are indices into data, when indexed:
+elements = []
+
 #program represents shader program / post processing for each mesh:
 program = b''
 
@@ -149,7 +153,7 @@ for obj in bpy.data.objects:
 	index += struct.pack('I', name_begin)
 	index += struct.pack('I', name_end)
 
-	index += struct.pack('I', vertex_count) #vertex_begin
+	index += struct.pack('I', len(elements) if indexed else vertex_count) #vertex_begin
 	#...count will be written below
 
 	colors = None
@@ -170,6 +174,9 @@ for obj in bpy.data.objects:
 
 	local_data = b''
 
+	#distinct vertices of this mesh (when indexed), by their packed bytes:
+	mesh_vertices = dict()
+
 	#write the mesh triangles:
 	for poly in mesh.polygons:
 		assert(len(poly.loop_indices) == 3)
@@ -177,28 +184,38 @@ for obj in bpy.data.objects:
 			assert(mesh.loops[poly.loop_indices[i]].vertex_index == poly.vertices[i])
 			loop = mesh.loops[poly.loop_indices[i]]
 			vertex = mesh.vertices[loop.vertex_index]
+			packed = b''
 			for x in vertex.co:
-				local_data += struct.pack('f', x)
+				packed += struct.pack('f', x)
 			for x in loop.normal:
-				local_data += struct.pack('f', x)
+				packed += struct.pack('f', x)
 			if colors != None:
 				col = colors[poly.loop_indices[i]].color
-				local_data += struct.pack('BBBB', int(col[0] * 255), int(col[1] * 255), int(col[2] * 255), 255)
+				packed += struct.pack('BBBB', int(col[0] * 255), int(col[1] * 255), int(col[2] * 255), 255)
 			else:
-				local_data += struct.pack('BBBB', 255, 255, 255, 255)
+				packed += struct.pack('BBBB', 255, 255, 255, 255)
 			if uvs != None:
 				uv = uvs[poly.loop_indices[i]].uv
-				local_data += struct.pack('ff', uv.x, uv.y)
+				packed += struct.pack('ff', uv.x, uv.y)
+			else:
+				packed += struct.pack('ff', 0, 0)
+			if indexed:
+				if packed not in mesh_vertices:
+					mesh_vertices[packed] = vertex_count
+					vertex_count += 1
+					local_data += packed
+				elements.append(mesh_vertices[packed])
 			else:
-				local_data += struct.pack('ff', 0, 0)
+				local_data += packed
 		if len(local_data) > 1000:
 			data.append(local_data)
 			local_data = b''
-	vertex_count += len(mesh.polygons) * 3
+	if not indexed:
+		vertex_count += len(mesh.polygons) * 3
 
 	data.append(local_data)
 
-	index += struct.pack('I', vertex_count) #vertex_end
+	index += struct.pack('I', len(elements) if indexed else vertex_count) #vertex_end
 
 data = b''.join(data)
 
@@ -211,6 +228,12 @@ blob = open(outfile, 'wb')
 blob.write(struct.pack('4s',b'pnct')) #type
 blob.write(struct.pack('I', len(data))) #length
 blob.write(data)
+if indexed:
+	#(indexed files have an element chunk right after the data)
+	element_data = struct.pack(str(len(elements)) + 'I', *elements)
+	blob.write(struct.pack('4s',b'ind0')) #type
+	blob.write(struct.pack('I', len(element_data))) #length
+	blob.write(element_data)
 #second chunk: the strings
 blob.write(struct.pack('4s',b'str0')) #type
 blob.write(struct.pack('I', len(strings))) #length
@@ -226,4 +249,4 @@ blob.write(program)
 wrote = blob.tell()
 blob.close()
 
-print("Wrote " + str(wrote) + " bytes [== " + str(len(data)+8) + " bytes of data + " + str(len(strings)+8) + " bytes of strings + " + str(len(index)+8) + " bytes of index + " + str(len(program)+8) + " bytes of program] to '" + outfile + "'")
+print("Wrote " + str(wrote) + " bytes [== " + str(len(data)+8) + " bytes of data + " + (str(len(elements)*4+8) + " bytes of elements + " if indexed else "") + str(len(strings)+8) + " bytes of strings + " + str(len(index)+8) + " bytes of index + " + str(len(program)+8) + " bytes of program] to '" + outfile + "'")
@@ -107,7 +107,7 @@ int main(int argc, char **argv) {
 	if (scene_file != "") {
 		try {
 			scene = new Scene();
-			scene->load(scene_file, [&buffer,&buffer_vao](Scene &scene, Scene::Transform *transform, std::string const &mesh_name){
+			scene->load(scene_file, [&buffer,&buffer_vao](Scene &scene, Scene::Transform transform, std::string const &mesh_name){
 				if (!buffer_vao) return;
 				Mesh const &mesh = buffer->lookup(mesh_name);
 
@@ -120,6 +120,17 @@ int main(int argc, char **argv) {
 				drawable.pipeline.type = mesh.type;
 				drawable.pipeline.start = mesh.start;
 				drawable.pipeline.count = mesh.count;
+				drawable.pipeline.index_type = mesh.index_type;
+				drawable.pipeline.position_offset = mesh.position_offset;
+				drawable.pipeline.position_scale = mesh.position_scale;
+				drawable.pipeline.octahedral_normals = mesh.octahedral_normals;
+				drawable.pipeline.lod_count = uint32_t(std::min< size_t >(mesh.lods.size(), Scene::Drawable::Pipeline::MaxLODs));
+				for (uint32_t l = 0; l < drawable.pipeline.lod_count; ++l) {
+					drawable.pipeline.lods[l] = Scene::Drawable::Pipeline::LOD{mesh.lods[l].start, mesh.lods[l].count, mesh.lods[l].error};
+				}
+
+				drawable.min = mesh.min;
+				drawable.max = mesh.max;
 
 			});
 		} catch (std::exception &e) {
@@ -0,0 +1,149 @@
+//Compares the BVH-backed WalkMesh::nearest_walk_point against the linear scan it replaced,
+// and WalkMesh::walk_batch against walking agents one at a time.
+//$ walkmesh-bench [file.w [mesh-name]] [-n queries] [-t threads]
+// with no file, times a generated bumpy grid at a few sizes instead.
+
+#include "WalkMesh.hpp"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+//(size x size)-quad grid with some hills, as a stand-in for a large level:
+static WalkMesh make_grid(uint32_t size) {
+	std::vector< glm::vec3 > vertices;
+	std::vector< glm::vec3 > normals;
+	std::vector< glm::uvec3 > triangles;
+	for (uint32_t y = 0; y <= size; ++y) {
+		for (uint32_t x = 0; x <= size; ++x) {
+			float const fx = float(x), fy = float(y);
+			vertices.emplace_back(fx, fy, 0.5f * std::sin(0.3f * fx) * std::cos(0.2f * fy));
+			normals.emplace_back(0.0f, 0.0f, 1.0f);
+		}
+	}
+	auto at = [size](uint32_t x, uint32_t y) { return y * (size + 1) + x; };
+	for (uint32_t y = 0; y < size; ++y) {
+		for (uint32_t x = 0; x < size; ++x) {
+			triangles.emplace_back(at(x, y), at(x + 1, y), at(x + 1, y + 1));
+			triangles.emplace_back(at(x, y), at(x + 1, y + 1), at(x, y + 1));
+		}
+	}
+	return WalkMesh(std::move(vertices), std::move(normals), std::move(triangles));
+}
+
+static void bench(std::string const &label, WalkMesh const &walkmesh, uint32_t queries, uint32_t threads) {
+	//query points spread over (and a bit beyond) the mesh's bounds:
+	glm::vec3 min = walkmesh.bvh_nodes[0].min;
+	glm::vec3 max = walkmesh.bvh_nodes[0].max;
+	glm::vec3 const pad = 0.1f * (max - min) + glm::vec3(1.0f);
+	std::mt19937 mt(0x31415926);
+	std::uniform_real_distribution< float > unit(0.0f, 1.0f);
+	std::vector< glm::vec3 > points(queries);
+	for (auto &p : points) {
+		p = (min - pad) + glm::vec3(unit(mt), unit(mt), unit(mt)) * ((max + pad) - (min - pad));
+	}
+
+	using clock = std::chrono::high_resolution_clock;
+	auto time = [&](auto &&query, std::vector< WalkPoint > *results) {
+		results->clear();
+		results->reserve(points.size());
+		auto before = clock::now();
+		for (auto const &p : points) {
+			results->emplace_back(query(p));
+		}
+		auto after = clock::now();
+		return std::chrono::duration< double, std::micro >(after - before).count() / double(points.size());
+	};
+
+	std::vector< WalkPoint > linear, bvh;
+	double const linear_us = time([&](glm::vec3 const &p) { return walkmesh.nearest_walk_point_linear(p); }, &linear);
+	double const bvh_us = time([&](glm::vec3 const &p) { return walkmesh.nearest_walk_point(p); }, &bvh);
+
+	uint32_t mismatches = 0;
+	for (uint32_t i = 0; i < queries; ++i) {
+		if (linear[i].indices != bvh[i].indices || linear[i].weights != bvh[i].weights) mismatches += 1;
+	}
+
+	std::cout << label << ": " << walkmesh.triangles.size() << " triangles, " << walkmesh.bvh_nodes.size() << " BVH nodes\n"
+	          << "  linear: " << linear_us << " us/query\n"
+	          << "  bvh:    " << bvh_us << " us/query (" << (bvh_us > 0.0 ? linear_us / bvh_us : 0.0) << "x)\n"
+	          << "  mismatched results: " << mismatches << " of " << queries << std::endl;
+	if (mismatches != 0) throw std::runtime_error("BVH and linear nearest_walk_point disagree on '" + label + "'");
+
+	//crowd of agents, each starting at one of the query points and taking a few steps in random directions:
+	std::vector< WalkPoint > one_at(bvh), batch_at(bvh);
+	std::uniform_real_distribution< float > signed_unit(-1.0f, 1.0f);
+	double scalar_us = 0.0, batch_us = 0.0;
+	uint32_t walk_mismatches = 0;
+	for (uint32_t frame = 0; frame < 10; ++frame) {
+		std::vector< glm::vec3 > steps(queries);
+		for (auto &step : steps) {
+			step = glm::vec3(signed_unit(mt), signed_unit(mt), 0.0f);
+		}
+		std::vector< glm::vec3 > one_remain(steps), batch_remain(steps);
+
+		auto before = clock::now();
+		for (uint32_t i = 0; i < queries; ++i) {
+			one_remain[i] = walkmesh.walk(&one_at[i], one_remain[i]);
+		}
+		auto middle = clock::now();
+		walkmesh.walk_batch(batch_at.data(), batch_remain.data(), batch_remain.size(), threads);
+		auto after = clock::now();
+		scalar_us += std::chrono::duration< double, std::micro >(middle - before).count();
+		batch_us += std::chrono::duration< double, std::micro >(after - middle).count();
+
+		for (uint32_t i = 0; i < queries; ++i) {
+			if (one_at[i].indices != batch_at[i].indices || one_at[i].weights != batch_at[i].weights || one_remain[i] != batch_remain[i]) walk_mismatches += 1;
+		}
+	}
+	std::cout << "  walk:       " << scalar_us / (10.0 * queries) << " us/agent/frame\n"
+	          << "  walk_batch: " << batch_us / (10.0 * queries) << " us/agent/frame (" << threads << " thread(s), "
+	          << (batch_us > 0.0 ? scalar_us / batch_us : 0.0) << "x)\n"
+	          << "  mismatched walks: " << walk_mismatches << " of " << 10 * queries << std::endl;
+	if (walk_mismatches != 0) throw std::runtime_error("walk_batch and walk disagree on '" + label + "'");
+}
+
+int main(int argc, char **argv) {
+	try {
+		std::vector< std::string > args;
+		uint32_t queries = 2000;
+		uint32_t threads = std::max(1U, std::thread::hardware_concurrency());
+		for (int i = 1; i < argc; ++i) {
+			std::string arg = argv[i];
+			if (arg == "-n") {
+				if (i + 1 >= argc) throw std::runtime_error("-n needs a query count");
+				queries = uint32_t(std::stoul(argv[++i]));
+			} else if (arg == "-t") {
+				if (i + 1 >= argc) throw std::runtime_error("-t needs a thread count");
+				threads = std::max(1U, uint32_t(std::stoul(argv[++i])));
+			} else {
+				args.emplace_back(arg);
+			}
+		}
+
+		if (args.empty()) {
+			for (uint32_t size : {16, 64, 256}) {
+				bench(std::to_string(size) + "x" + std::to_string(size) + " grid", make_grid(size), queries, threads);
+			}
+		} else {
+			WalkMeshes walkmeshes(args[0]);
+			for (auto const &wm : walkmeshes.meshes) {
+				if (args.size() > 1 && wm.first != args[1]) continue;
+				if (wm.second.triangles.empty()) continue;
+				bench(wm.first, wm.second, queries, threads);
+			}
+		}
+	} catch (std::exception &e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}